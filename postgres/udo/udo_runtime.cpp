@@ -1,18 +1,33 @@
 #include "udo/udo_runtime.h"
 #include "udo/CxxUDOAnalyzer.hpp"
+#include "udo/CxxUDOCache.hpp"
 #include "udo/CxxUDOCompiler.hpp"
 #include "udo/CxxUDOExecution.hpp"
+#include "udo/Setting.hpp"
+#include "udo/UDOStats.hpp"
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Type.h>
+#include <atomic>
 #include <bit>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
+#include <signal.h>
 #include <catalog/pg_type_d.h>
 //---------------------------------------------------------------------------
 // UDO runtime
@@ -30,33 +45,132 @@ PG_MODULE_MAGIC;
 using namespace udo;
 using namespace std;
 //---------------------------------------------------------------------------
+static Setting<unsigned> cxxUDOCompileThreads("cxxUDOCompileThreads", "The number of threads that compile C++ UDOs in the background", 2);
+static Setting<uint64_t> udoHandleCacheBudget("udoHandleCacheBudget", "The memory budget of the cached UDO handles (0 for unlimited), the least recently used handles that are not pinned are evicted when it is exceeded", 1ull << 30, settinghelper::makeParser<uint64_t>(&settinghelper::DefaultParserFunctions<uint64_t>::parseWithUnits));
+//---------------------------------------------------------------------------
 namespace {
 //---------------------------------------------------------------------------
 struct UDOImpl {
    /// The C++ UDO analyzer
    CxxUDOAnalyzer analyzer;
+   /// The analyzers of the UDOs that are fused into this UDO when it is the
+   /// first UDO of a pipeline
+   vector<CxxUDOAnalyzer> pipelineConsumers;
    /// Auxiliary storage for the types returned in udo_get_scalar_arguments
    vector<Oid> scalarArgTypesStorage;
    /// Auxiliary storage for the value returned in udo_get_input/output_attributes
    vector<udo_attribute_descr> attrsStorage;
-   /// The compiled object file
-   vector<char> objectFile;
+   /// The key of the UDO in the persistent cache (empty if not cached)
+   string cacheKey;
+   /// The lock of the cache entry that is held while this backend compiles
+   /// the first code of the UDO, so that other backends wait for it
+   CxxUDOCache::EntryLock cacheLock;
+   /// The serialized analysis that will be stored in the persistent cache
+   vector<char> serializedAnalysis;
+   /// Was the UDO analyzed already?
+   bool isAnalyzed = false;
+   /// Was the module preprocessed already?
+   bool isPreprocessed = false;
+   /// Does emit call a consumer of the host directly?
+   bool isEmitFused = false;
+   /// Auxiliary storage for the value returned in udo_cxxudo_get_bitcode
+   vector<char> bitcode;
+   /// The constant constructor arguments the UDO is specialized for (empty if
+   /// it is not specialized)
+   vector<optional<uint64_t>> constructorArguments;
+   /// The mask of the output attributes that are needed, the bits of
+   /// attributes that don't exist are ignored. It is only changed after the
+   /// analysis and always has all bits set if all attributes are needed.
+   uint64_t outputMask = ~uint64_t(0);
+   /// The number of output tuples that the compiled code buffers, it is fixed
+   /// when the handle is created so that the code and the cache key agree
+   unsigned emitBatchSize = CxxUDOCompiler::getEmitBatchSize();
+   /// The object file that was compiled by this backend
+   vector<char> compiledObjectFile;
+   /// The entry of the persistent cache the object file was loaded from, it
+   /// stays mapped as long as the object file is used
+   optional<CxxUDOCache::MappedEntry> cacheEntry;
+   /// The object file, it points into compiledObjectFile or cacheEntry
+   span<const char> objectFile;
    /// The execution (if loaded)
-   optional<CxxUDOExecution> execution;
+   unique_ptr<CxxUDOExecution> execution;
+   /// The background compilation of the optimized code when tiered
+   /// compilation is used. It only uses copies of the data of the handle, so
+   /// the handle can be destroyed before it is finished.
+   future<tl::expected<vector<char>, string>> optimizedCompilation;
+   /// The time when the optimized compilation was started
+   chrono::steady_clock::time_point optimizedCompilationStart;
+   /// The task of `udo_cxxudo_compile_async()` that uses the handle (if any)
+   shared_future<udo_errno> pendingTask;
+   /// Is the handle destroyed? The pending task then stops as soon as
+   /// possible.
+   atomic<bool> isCancelled = false;
+   /// The statistics about the tiered compilation
+   udo_cxx_tier_stats tierStats = {};
+   /// The limit of the allocations of the UDO and its instances, 0 for
+   /// unlimited
+   uint64_t allocationLimit = 0;
+   /// The statistics about compiling and linking the UDO
+   UDOStats stats;
    /// The constructor arg (if requested)
    unique_ptr<byte[]> constructorArg;
    /// The last error message
    string errorMessage;
+   /// The key of the handle in the handle cache
+   uint64_t handleCacheKey = 0;
+   /// The number of pins of the handle by the handle cache
+   unsigned handleCachePinCount = 0;
+   /// Is the handle an entry of the handle cache? A handle that is removed
+   /// from the cache while it is pinned is destroyed when it is released.
+   bool isHandleCacheEntry = false;
 
    /// Constructor that passes the args to the analyzer
    template <typename... Ts>
    UDOImpl(Ts&&... args) : analyzer(forward<Ts>(args)...) {}
+   /// Destructor, cancels the pending task and waits for it
+   ~UDOImpl();
 
    /// Set the size, alignment and pgTypeOid members of attr according to the
    /// given type. Return false if type is not supported.
    bool makeAttrType(llvm::Type* type, udo_attribute_descr& attr) const;
+   /// Compute the key of the UDO in the persistent cache
+   string computeCacheKey() const;
+   /// Get the output mask that keeps all output attributes
+   uint64_t getFullOutputMask() const;
+   /// Look up the UDO in the persistent cache. Returns true if the object
+   /// file was loaded.
+   bool lookupCacheEntry(bool loadAnalysis);
+   /// Lock the entry of the UDO in the persistent cache before it is compiled
+   /// and look it up again. The lock is held until the compiled UDO was
+   /// stored. Returns true if the object file was loaded.
+   bool lockCacheEntry();
+   /// Look up the UDO in the persistent cache again after the generated code
+   /// was changed
+   void updateCacheKey();
+   /// Use an object file that was compiled by this backend
+   void setObjectFile(vector<char> newObjectFile);
+   /// Use the object file of an entry of the persistent cache
+   void setObjectFile(CxxUDOCache::MappedEntry entry);
+   /// Drop the object file
+   void clearObjectFile();
+   /// Preprocess the module if that was not done yet
+   udo_errno preprocessModule(unsigned optimizationLevel);
+   /// Get the memory used by the UDO in bytes
+   uint64_t getMemoryUsage() const;
 };
 //---------------------------------------------------------------------------
+UDOImpl::~UDOImpl()
+// Destructor
+{
+   // The task accesses the handle, so it must be finished before the handle
+   // is freed. This happens when the backend aborts the query before it
+   // waited for the task.
+   if (pendingTask.valid()) {
+      isCancelled = true;
+      pendingTask.wait();
+   }
+}
+//---------------------------------------------------------------------------
 bool UDOImpl::makeAttrType(llvm::Type* type, udo_attribute_descr& attr) const
 // Set the size, alignment and pgTypeOid members of attr according to the given
 // type. Return false if the type is not supported.
@@ -112,6 +226,432 @@ bool UDOImpl::makeAttrType(llvm::Type* type, udo_attribute_descr& attr) const
    return true;
 }
 //---------------------------------------------------------------------------
+string UDOImpl::computeCacheKey() const
+// Compute the key of the UDO in the persistent cache
+{
+   // The buffering of emitted tuples and the constants of the specialization
+   // change the generated code
+   auto extraKey = "emitBatchSize=" + to_string(emitBatchSize);
+   for (auto& argument : constructorArguments)
+      extraKey += argument ? ";" + to_string(*argument) : ";-";
+   // The key is also computed before the analysis exists, so the mask is
+   // normalized by udo_cxxudo_compile_with_mask() instead of here
+   if (outputMask != ~uint64_t(0))
+      extraKey += ";outputMask=" + to_string(outputMask);
+   for (auto& consumer : pipelineConsumers) {
+      auto& source = consumer.getSource();
+      auto& className = consumer.getUDOClassName();
+      extraKey += ";consumer=" + to_string(className.size()) + ":" + className + to_string(source.size()) + ":" + source;
+   }
+   return CxxUDOCache::computeKey(analyzer.getSource(), analyzer.getUDOClassName(), CxxUDOCompiler::getOptLevel(), extraKey);
+}
+//---------------------------------------------------------------------------
+uint64_t UDOImpl::getFullOutputMask() const
+// Get the output mask that keeps all output attributes
+{
+   auto numOutputs = analyzer.getAnalysis().output.size();
+   return numOutputs >= 64 ? ~uint64_t(0) : (uint64_t(1) << numOutputs) - 1;
+}
+//---------------------------------------------------------------------------
+bool UDOImpl::lookupCacheEntry(bool loadAnalysis)
+// Look up the UDO in the persistent cache
+{
+   auto entry = CxxUDOCache::lookup(cacheKey);
+   if (!entry)
+      return false;
+   // A broken entry is ignored and the UDO is analyzed again
+   if (loadAnalysis && !analyzer.loadSerializedAnalysis(entry->serializedAnalysis))
+      return false;
+   setObjectFile(move(*entry));
+   tierStats.optimizationLevel = CxxUDOCompiler::getOptLevel();
+   return true;
+}
+//---------------------------------------------------------------------------
+bool UDOImpl::lockCacheEntry()
+// Lock the entry of the UDO in the persistent cache before it is compiled and
+// look it up again
+{
+   // Another backend may be compiling the same UDO, then the lock is only
+   // acquired after it stored the entry
+   cacheLock = CxxUDOCache::lockEntry(cacheKey);
+   if (lookupCacheEntry(false)) {
+      cacheLock.unlock();
+      return true;
+   }
+   return false;
+}
+//---------------------------------------------------------------------------
+void UDOImpl::updateCacheKey()
+// Look up the UDO in the persistent cache again after the generated code was
+// changed
+{
+   clearObjectFile();
+   if (cacheKey.empty())
+      return;
+
+   // The analysis is needed to store the changed code in the cache even if
+   // the original code was loaded from it
+   if (serializedAnalysis.empty())
+      serializedAnalysis = analyzer.getSerializedAnalysis();
+
+   cacheKey = computeCacheKey();
+   lookupCacheEntry(false);
+}
+//---------------------------------------------------------------------------
+void UDOImpl::setObjectFile(vector<char> newObjectFile)
+// Use an object file that was compiled by this backend
+{
+   cacheEntry.reset();
+   compiledObjectFile = move(newObjectFile);
+   objectFile = compiledObjectFile;
+}
+//---------------------------------------------------------------------------
+void UDOImpl::setObjectFile(CxxUDOCache::MappedEntry entry)
+// Use the object file of an entry of the persistent cache
+{
+   // The object file is linked directly from the mapping instead of copying it
+   compiledObjectFile.clear();
+   cacheEntry = move(entry);
+   objectFile = cacheEntry->objectFile;
+}
+//---------------------------------------------------------------------------
+void UDOImpl::clearObjectFile()
+// Drop the object file
+{
+   objectFile = {};
+   compiledObjectFile.clear();
+   cacheEntry.reset();
+}
+//---------------------------------------------------------------------------
+udo_errno UDOImpl::preprocessModule(unsigned optimizationLevel)
+// Preprocess the module if that was not done yet
+{
+   if (isPreprocessed)
+      return UDO_SUCCESS;
+
+   CxxUDOCompiler compiler(analyzer, optimizationLevel);
+   if (auto result = compiler.preprocessModule(outputMask, emitBatchSize); !result) {
+      errorMessage = move(result).error();
+      return UDO_COMPILE_ERROR;
+   }
+   if (!constructorArguments.empty()) {
+      if (auto result = compiler.specializeConstructor(constructorArguments); !result) {
+         errorMessage = move(result).error();
+         return UDO_COMPILE_ERROR;
+      }
+   }
+
+   isPreprocessed = true;
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
+uint64_t UDOImpl::getMemoryUsage() const
+// Get the memory used by the UDO in bytes. The llvm module is not included
+// as its size is not known.
+{
+   uint64_t usage = sizeof(UDOImpl) + analyzer.getSource().size() + serializedAnalysis.size() + bitcode.size() + objectFile.size();
+   for (auto& consumer : pipelineConsumers)
+      usage += consumer.getSource().size();
+   if (execution)
+      usage += execution->getMemoryUsage();
+   return usage;
+}
+//---------------------------------------------------------------------------
+/// The cache of the handles of UDOs. The host pins a handle while it uses it
+/// and only handles that are not pinned are evicted, the least recently used
+/// first. Handles that were cached or looked up without pinning are never
+/// evicted, as the host may use them at any time. The memory usage of an
+/// entry is measured whenever it is unpinned, as the handle may be changed
+/// while it is pinned.
+class HandleCache {
+   private:
+   /// An entry of the cache
+   struct Entry {
+      /// The key
+      uint64_t key;
+      /// The handle
+      UDOImpl* impl;
+      /// The memory used by the handle when it was last measured
+      uint64_t memoryUsage;
+      /// Can the handle be evicted? Not set once the handle was used without
+      /// pinning it.
+      bool isEvictable;
+   };
+
+   /// The mutex that protects all members and the pin counts of the handles
+   mutex cacheMutex;
+   /// The entries, the most recently used first
+   list<Entry> entries;
+   /// The entries by their key
+   unordered_map<uint64_t, list<Entry>::iterator> entriesByKey;
+   /// The memory used by all entries
+   uint64_t memoryUsage = 0;
+   /// The number of lookups that found a handle
+   uint64_t numHits = 0;
+   /// The number of lookups that did not find a handle
+   uint64_t numMisses = 0;
+   /// The number of evicted handles
+   uint64_t numEvictions = 0;
+
+   /// Remove an entry, the handle is added to `victims` if it is not pinned
+   void remove(list<Entry>::iterator it, vector<unique_ptr<UDOImpl>>& victims);
+   /// Evict handles that are evictable and not pinned until the memory budget
+   /// is met
+   void evict(vector<unique_ptr<UDOImpl>>& victims);
+
+   public:
+   /// Insert a handle and pin it if requested
+   void insert(uint64_t key, UDOImpl* impl, bool pin);
+   /// Look up a handle and pin it if requested, nullptr if there is none
+   UDOImpl* lookup(uint64_t key, bool pin);
+   /// Release a pinned handle
+   void release(UDOImpl* impl);
+   /// Get the statistics
+   udo_handle_cache_stats getStats();
+};
+//---------------------------------------------------------------------------
+void HandleCache::remove(list<Entry>::iterator it, vector<unique_ptr<UDOImpl>>& victims)
+// Remove an entry, the handle is added to `victims` if it is not pinned
+{
+   auto* impl = it->impl;
+   memoryUsage -= it->memoryUsage;
+   entriesByKey.erase(it->key);
+   entries.erase(it);
+
+   impl->isHandleCacheEntry = false;
+   if (impl->handleCachePinCount == 0)
+      victims.emplace_back(impl);
+}
+//---------------------------------------------------------------------------
+void HandleCache::evict(vector<unique_ptr<UDOImpl>>& victims)
+// Evict handles that are evictable and not pinned until the memory budget is
+// met
+{
+   uint64_t budget = udoHandleCacheBudget.get();
+   if (budget == 0)
+      return;
+
+   auto it = entries.end();
+   while (memoryUsage > budget && it != entries.begin()) {
+      auto current = prev(it);
+      if (!current->isEvictable || current->impl->handleCachePinCount > 0) {
+         it = current;
+         continue;
+      }
+      ++numEvictions;
+      remove(current, victims);
+   }
+}
+//---------------------------------------------------------------------------
+void HandleCache::insert(uint64_t key, UDOImpl* impl, bool pin)
+// Insert a handle and pin it if requested
+{
+   // The victims are destroyed after the lock was released because the
+   // destructor of a handle may wait for a background compilation.
+   vector<unique_ptr<UDOImpl>> victims;
+   unique_lock lock(cacheMutex);
+
+   if (pin)
+      ++impl->handleCachePinCount;
+   if (auto it = entriesByKey.find(key); it != entriesByKey.end()) {
+      if (it->second->impl == impl) {
+         if (!pin)
+            it->second->isEvictable = false;
+         entries.splice(entries.begin(), entries, it->second);
+         return;
+      }
+      // An unpinned handle is destroyed right away
+      remove(it->second, victims);
+   }
+
+   impl->handleCacheKey = key;
+   impl->isHandleCacheEntry = true;
+   auto usage = impl->getMemoryUsage();
+   entries.push_front({key, impl, usage, pin});
+   entriesByKey.emplace(key, entries.begin());
+   memoryUsage += usage;
+
+   evict(victims);
+}
+//---------------------------------------------------------------------------
+UDOImpl* HandleCache::lookup(uint64_t key, bool pin)
+// Look up a handle and pin it if requested, nullptr if there is none
+{
+   unique_lock lock(cacheMutex);
+
+   auto it = entriesByKey.find(key);
+   if (it == entriesByKey.end()) {
+      ++numMisses;
+      return nullptr;
+   }
+   ++numHits;
+   entries.splice(entries.begin(), entries, it->second);
+   auto& entry = *it->second;
+   auto* impl = entry.impl;
+   if (pin) {
+      ++impl->handleCachePinCount;
+   } else {
+      // The caller never tells when it stops using the handle
+      entry.isEvictable = false;
+      if (impl->handleCachePinCount == 0) {
+         // A caller that does not pin handles is done with the previous use
+         // of the handle when it looks it up again, so it can be measured
+         // again
+         memoryUsage -= entry.memoryUsage;
+         entry.memoryUsage = impl->getMemoryUsage();
+         memoryUsage += entry.memoryUsage;
+      }
+   }
+   return impl;
+}
+//---------------------------------------------------------------------------
+void HandleCache::release(UDOImpl* impl)
+// Release a pinned handle
+{
+   vector<unique_ptr<UDOImpl>> victims;
+   unique_lock lock(cacheMutex);
+
+   assert(impl->handleCachePinCount > 0);
+   if (--impl->handleCachePinCount > 0)
+      return;
+   if (!impl->isHandleCacheEntry) {
+      // The handle was replaced or evicted while it was pinned
+      victims.emplace_back(impl);
+      return;
+   }
+
+   // Nobody uses the handle now, so its memory usage can be measured again
+   auto& entry = *entriesByKey.find(impl->handleCacheKey)->second;
+   memoryUsage -= entry.memoryUsage;
+   entry.memoryUsage = impl->getMemoryUsage();
+   memoryUsage += entry.memoryUsage;
+
+   evict(victims);
+}
+//---------------------------------------------------------------------------
+udo_handle_cache_stats HandleCache::getStats()
+// Get the statistics
+{
+   unique_lock lock(cacheMutex);
+
+   udo_handle_cache_stats stats;
+   stats.numHits = numHits;
+   stats.numMisses = numMisses;
+   stats.numEvictions = numEvictions;
+   stats.numEntries = entries.size();
+   stats.memoryUsage = memoryUsage;
+   stats.memoryBudget = udoHandleCacheBudget.get();
+   return stats;
+}
+//---------------------------------------------------------------------------
+/// The threads that compile C++ UDOs in the background
+class CompileThreadPool {
+   private:
+   /// The mutex that protects all members
+   mutex poolMutex;
+   /// The condition variable that is notified when a task is added
+   condition_variable tasksAvailable;
+   /// The queued tasks
+   deque<packaged_task<void()>> tasks;
+   /// The worker threads
+   vector<thread> workers;
+   /// Are the workers stopping?
+   bool stopping = false;
+
+   /// The loop of a worker thread
+   void work();
+   /// Add a task and start the workers if necessary
+   void push(packaged_task<void()> task);
+
+   public:
+   /// Destructor
+   ~CompileThreadPool();
+
+   /// Add a task. Unlike the future of std::async, the returned future does
+   /// not wait for the task when it is destroyed.
+   template <typename Func>
+   future<invoke_result_t<Func&>> submit(Func func);
+
+   /// Get the pool that is shared by all background compilations
+   static CompileThreadPool& get();
+};
+//---------------------------------------------------------------------------
+template <typename Func>
+future<invoke_result_t<Func&>> CompileThreadPool::submit(Func func)
+// Add a task
+{
+   packaged_task<invoke_result_t<Func&>()> task(move(func));
+   auto result = task.get_future();
+   push(packaged_task<void()>([task = move(task)]() mutable { task(); }));
+   return result;
+}
+//---------------------------------------------------------------------------
+CompileThreadPool::~CompileThreadPool()
+// Destructor
+{
+   {
+      unique_lock lock(poolMutex);
+      stopping = true;
+   }
+   tasksAvailable.notify_all();
+   for (auto& worker : workers)
+      worker.join();
+}
+//---------------------------------------------------------------------------
+void CompileThreadPool::work()
+// The loop of a worker thread
+{
+   while (true) {
+      packaged_task<void()> task;
+      {
+         unique_lock lock(poolMutex);
+         tasksAvailable.wait(lock, [&] { return stopping || !tasks.empty(); });
+         if (stopping)
+            return;
+         task = move(tasks.front());
+         tasks.pop_front();
+      }
+      task();
+   }
+}
+//---------------------------------------------------------------------------
+void CompileThreadPool::push(packaged_task<void()> task)
+// Add a task and start the workers if necessary
+{
+   {
+      unique_lock lock(poolMutex);
+      tasks.push_back(move(task));
+
+      // The workers are started lazily, so that no threads exist when the
+      // postmaster forks the backends.
+      if (workers.empty()) {
+         // Postgres signals must be handled by the backend's main thread, so
+         // the workers block all signals.
+         sigset_t allSignals, oldSignals;
+         sigfillset(&allSignals);
+         pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+         auto numThreads = max(cxxUDOCompileThreads.get(), 1u);
+         for (unsigned i = 0; i < numThreads; ++i)
+            workers.emplace_back([this] { work(); });
+         pthread_sigmask(SIG_SETMASK, &oldSignals, nullptr);
+      }
+   }
+   tasksAvailable.notify_one();
+}
+//---------------------------------------------------------------------------
+CompileThreadPool& CompileThreadPool::get()
+// Get the pool that is shared by all background compilations
+{
+   static CompileThreadPool compileThreadPool;
+   return compileThreadPool;
+}
+//---------------------------------------------------------------------------
+/// A task that runs in the background
+struct Task {
+   /// The result of the task, it is shared with the handle the task uses
+   shared_future<udo_errno> result;
+};
+//---------------------------------------------------------------------------
 }
 //---------------------------------------------------------------------------
 udo_handle udo_cxxudo_init(const char* cxxSource, size_t cxxSourceLen, const char* udoClassName, size_t udoClassNameLen)
@@ -124,8 +664,23 @@ udo_handle udo_cxxudo_init(const char* cxxSource, size_t cxxSourceLen, const cha
    return reinterpret_cast<udo_handle>(impl);
 }
 //---------------------------------------------------------------------------
+udo_handle udo_cxxudo_init_pipeline(const udo_cxxudo_source* udos, size_t numUDOs)
+// Initialize a pipeline of C++ UDOs where each UDO consumes the output of the
+// previous one
+{
+   if (numUDOs == 0)
+      return nullptr;
+
+   auto* impl = new UDOImpl(string(udos[0].cxxSource, udos[0].cxxSourceLen), string(udos[0].udoClassName, udos[0].udoClassNameLen));
+   impl->pipelineConsumers.reserve(numUDOs - 1);
+   for (size_t i = 1; i < numUDOs; ++i)
+      impl->pipelineConsumers.emplace_back(string(udos[i].cxxSource, udos[i].cxxSourceLen), string(udos[i].udoClassName, udos[i].udoClassNameLen));
+   return reinterpret_cast<udo_handle>(impl);
+}
+//---------------------------------------------------------------------------
 void udo_cxxudo_destroy(udo_handle handle)
-// Destroy a handle created with `udo_cxxudo_init()`
+// Destroy a handle created with `udo_cxxudo_init()` or
+// `udo_cxxudo_init_pipeline()`
 {
    auto* impl = reinterpret_cast<UDOImpl*>(handle);
    delete impl;
@@ -138,43 +693,89 @@ const char* udo_error_message(udo_handle handle)
    return impl->errorMessage.c_str();
 }
 //---------------------------------------------------------------------------
-static unordered_map<uint64_t, UDOImpl*> cachedImpls;
+static HandleCache handleCache;
 //---------------------------------------------------------------------------
 void udo_cache_handle(udo_handle handle, uint64_t cacheKey)
 // Cache a handle with a given key
 {
    auto* impl = reinterpret_cast<UDOImpl*>(handle);
-
-   auto it = cachedImpls.find(cacheKey);
-   if (it == cachedImpls.end()) {
-      cachedImpls.emplace(cacheKey, impl);
-   } else {
-      delete it->second;
-      it->second = impl;
-   }
+   handleCache.insert(cacheKey, impl, false);
 }
 //---------------------------------------------------------------------------
 udo_handle udo_get_cached_handle(uint64_t cacheKey)
 // Get a cached handle
 {
-   auto it = cachedImpls.find(cacheKey);
-   if (it == cachedImpls.end()) {
-      return nullptr;
-   } else {
-      return reinterpret_cast<udo_handle>(it->second);
-   }
+   return reinterpret_cast<udo_handle>(handleCache.lookup(cacheKey, false));
+}
+//---------------------------------------------------------------------------
+void udo_cache_handle_pinned(udo_handle handle, uint64_t cacheKey)
+// Cache a handle with a given key and pin it
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   handleCache.insert(cacheKey, impl, true);
+}
+//---------------------------------------------------------------------------
+udo_handle udo_get_cached_handle_pinned(uint64_t cacheKey)
+// Get a cached handle and pin it
+{
+   return reinterpret_cast<udo_handle>(handleCache.lookup(cacheKey, true));
+}
+//---------------------------------------------------------------------------
+void udo_release_cached_handle(udo_handle handle)
+// Release a handle that was pinned by the handle cache
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   handleCache.release(impl);
+}
+//---------------------------------------------------------------------------
+void udo_get_handle_cache_stats(udo_handle_cache_stats* stats)
+// Get the statistics of the cache of handles
+{
+   *stats = handleCache.getStats();
 }
 //---------------------------------------------------------------------------
 udo_errno udo_cxxudo_analyze(udo_handle handle)
 // Analyze a C++ UDO
 {
    auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   UDOStats::Scope statsScope(&impl->stats);
+
+   if (impl->isAnalyzed)
+      return UDO_SUCCESS;
+
+   if (CxxUDOCache::isEnabled()) {
+      impl->cacheKey = impl->computeCacheKey();
+
+      if (impl->lookupCacheEntry(true)) {
+         impl->isAnalyzed = true;
+         return UDO_SUCCESS;
+      }
+   }
 
    if (auto result = impl->analyzer.analyze(); !result) {
       impl->errorMessage = move(result).error();
       return UDO_INVALID_USER_CODE;
    }
 
+   // Fuse the other UDOs of a pipeline into the module of the first one
+   for (size_t i = 0; i < impl->pipelineConsumers.size(); ++i) {
+      auto& consumer = impl->pipelineConsumers[i];
+      if (auto result = consumer.analyze(); !result) {
+         impl->errorMessage = move(result).error();
+         return UDO_INVALID_USER_CODE;
+      }
+      CxxUDOCompiler compiler(impl->analyzer);
+      if (auto result = compiler.fuseConsumer(consumer, i + 1); !result) {
+         impl->errorMessage = move(result).error();
+         return UDO_INVALID_USER_CODE;
+      }
+   }
+
+   // The analysis must be serialized before the compiler modifies the module
+   if (!impl->cacheKey.empty())
+      impl->serializedAnalysis = impl->analyzer.getSerializedAnalysis();
+
+   impl->isAnalyzed = true;
    return UDO_SUCCESS;
 }
 //---------------------------------------------------------------------------
@@ -207,7 +808,7 @@ udo_errno udo_get_arguments(udo_handle handle, udo_arguments* scalarArgs)
    }
 
    scalarArgs->numScalarArguments = impl->scalarArgTypesStorage.size();
-   scalarArgs->numTableArguments = analysis.accept ? 1 : 0;
+   scalarArgs->numTableArguments = (analysis.accept || analysis.acceptBatch) ? 1 : 0;
    scalarArgs->pgTypeOids = impl->scalarArgTypesStorage.data();
 
    return UDO_SUCCESS;
@@ -278,31 +879,237 @@ size_t udo_get_size(udo_handle handle)
    return analysis.size;
 }
 //---------------------------------------------------------------------------
+size_t udo_cxxudo_get_emit_batch_size(udo_handle handle)
+// Get the number of output tuples that a compiled C++ UDO buffers per thread
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   return impl->emitBatchSize;
+}
+//---------------------------------------------------------------------------
+udo_errno udo_cxxudo_get_bitcode(udo_handle handle, const char** bitcode, size_t* bitcodeSize)
+// Get the bitcode of the optimized module of a C++ UDO
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   UDOStats::Scope statsScope(&impl->stats);
+
+   if (auto result = impl->preprocessModule(CxxUDOCompiler::getOptLevel()); result != UDO_SUCCESS)
+      return result;
+
+   CxxUDOCompiler compiler(impl->analyzer);
+   impl->bitcode = compiler.getBitcode();
+   *bitcode = impl->bitcode.data();
+   *bitcodeSize = impl->bitcode.size();
+
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
+udo_errno udo_cxxudo_fuse_emit(udo_handle handle, const char* bitcode, size_t bitcodeSize, const char* consumerName, size_t consumerNameLen)
+// Let the emit function of a C++ UDO call a consumer of the host directly
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   UDOStats::Scope statsScope(&impl->stats);
+
+   if (impl->execution) {
+      impl->errorMessage = "The emit function of a C++ UDO cannot be fused after it was linked";
+      return UDO_COMPILE_ERROR;
+   }
+
+   if (auto result = impl->preprocessModule(CxxUDOCompiler::getOptLevel()); result != UDO_SUCCESS)
+      return result;
+
+   CxxUDOCompiler compiler(impl->analyzer);
+   if (auto result = compiler.fuseEmit(span(bitcode, bitcodeSize), string_view(consumerName, consumerNameLen)); !result) {
+      impl->errorMessage = move(result).error();
+      return UDO_COMPILE_ERROR;
+   }
+
+   // The object file that was compiled or loaded from the cache before and
+   // the optimized tier do not contain the fused code
+   impl->isEmitFused = true;
+   impl->clearObjectFile();
+   // The optimized tier is detached, i.e. it still finishes on the compile
+   // threads and stores the unfused code in the cache for other backends,
+   // but its result is ignored. The future of the compile threads does not
+   // wait for the task when it is destroyed, so this does not block.
+   impl->optimizedCompilation = {};
+
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
+udo_errno udo_cxxudo_specialize(udo_handle handle, const Datum* values, const bool* isConstant, size_t numValues)
+// Specialize a C++ UDO for the constant scalar arguments of its constructor
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   UDOStats::Scope statsScope(&impl->stats);
+
+   if (impl->isPreprocessed || impl->execution) {
+      impl->errorMessage = "A C++ UDO cannot be specialized after it was compiled";
+      return UDO_COMPILE_ERROR;
+   }
+
+   vector<optional<uint64_t>> constructorArguments(numValues);
+   bool hasConstant = false;
+   for (size_t i = 0; i < numValues; ++i) {
+      if (isConstant[i]) {
+         constructorArguments[i] = static_cast<uint64_t>(values[i]);
+         hasConstant = true;
+      }
+   }
+   if (!hasConstant)
+      return UDO_SUCCESS;
+
+   impl->constructorArguments = move(constructorArguments);
+   impl->updateCacheKey();
+
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
 udo_errno udo_cxxudo_compile(udo_handle handle)
 // Compile a C++ UDO to an object file after it was analyzed
 {
    auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   return udo_cxxudo_compile_with_mask(handle, impl->outputMask);
+}
+//---------------------------------------------------------------------------
+udo_errno udo_cxxudo_compile_with_mask(udo_handle handle, uint64_t outputMask)
+// Compile a C++ UDO to an object file after it was analyzed, computing only
+// the output attributes in the mask
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   UDOStats::Scope statsScope(&impl->stats);
+
+   // A mask that keeps all output attributes is the same as no mask, so that
+   // the code is stored in the cache under the same key
+   auto fullOutputMask = impl->getFullOutputMask();
+   outputMask = (outputMask & fullOutputMask) == fullOutputMask ? ~uint64_t(0) : outputMask & fullOutputMask;
+   if (outputMask != impl->outputMask) {
+      if (impl->isPreprocessed || impl->execution) {
+         impl->errorMessage = "The output attributes of a C++ UDO cannot be changed after it was compiled";
+         return UDO_COMPILE_ERROR;
+      }
+      impl->outputMask = outputMask;
+      impl->updateCacheKey();
+   }
 
    if (!impl->objectFile.empty())
       return UDO_SUCCESS;
 
-   CxxUDOCompiler compiler(impl->analyzer);
+   // The lock is only taken around compiling and storing the UDO, the fused
+   // code is never stored so other backends must not wait for it
+   if (!impl->cacheKey.empty() && !impl->isEmitFused && impl->lockCacheEntry())
+      return UDO_SUCCESS;
 
-   if (auto result = compiler.preprocessModule(); !result) {
-      impl->errorMessage = move(result).error();
-      return UDO_COMPILE_ERROR;
+   // A module that was already preprocessed is only compiled once with the
+   // full optimization level
+   bool isTiered = !impl->isPreprocessed && CxxUDOCompiler::isTieredCompilationEnabled();
+   auto optimizationLevel = isTiered ? CxxUDOCompiler::getFirstTierOptLevel() : CxxUDOCompiler::getOptLevel();
+   impl->tierStats.optimizationLevel = optimizationLevel;
+
+   if (isTiered) {
+      // The compiler modifies the module of the analyzer, so the optimized
+      // code is compiled from the serialized analysis.
+      if (impl->serializedAnalysis.empty())
+         impl->serializedAnalysis = impl->analyzer.getSerializedAnalysis();
+
+      impl->optimizedCompilationStart = chrono::steady_clock::now();
+      // The compilation runs on the compile threads that block the signals of
+      // Postgres
+      // The optimized code is stored without the lock. The entry is written
+      // to a temporary file and renamed, so readers are never blocked and
+      // never see a partial entry.
+      impl->optimizedCompilation = CompileThreadPool::get().submit([funcSource = impl->analyzer.getSource(), udoClassName = impl->analyzer.getUDOClassName(), serializedAnalysis = move(impl->serializedAnalysis), constructorArguments = impl->constructorArguments, outputMask = impl->outputMask, emitBatchSize = impl->emitBatchSize, cacheKey = impl->cacheKey]() mutable {
+         auto result = CxxUDOCompiler::compileSerializedAnalysis(move(funcSource), move(udoClassName), serializedAnalysis, CxxUDOCompiler::getOptLevel(), constructorArguments, outputMask, emitBatchSize);
+         // Only the optimized code is stored in the persistent cache
+         if (result && !cacheKey.empty()) {
+            CxxUDOCache::Entry entry{move(serializedAnalysis), *result};
+            static_cast<void>(CxxUDOCache::store(cacheKey, entry));
+         }
+         return result;
+      });
+      impl->serializedAnalysis.clear();
    }
 
+   if (auto result = impl->preprocessModule(optimizationLevel); result != UDO_SUCCESS) {
+      impl->cacheLock.unlock();
+      return result;
+   }
+
+   CxxUDOCompiler compiler(impl->analyzer, optimizationLevel);
+
    if (auto result = compiler.compile(); result) {
-      impl->objectFile = move(result).value();
+      impl->setObjectFile(move(result).value());
    } else {
       impl->errorMessage = move(result).error();
+      impl->cacheLock.unlock();
       return UDO_COMPILE_ERROR;
    }
 
+   // The fused code depends on the host, so it must not be cached
+   if (!impl->cacheKey.empty() && !isTiered && !impl->isEmitFused) {
+      CxxUDOCache::Entry entry{move(impl->serializedAnalysis), impl->compiledObjectFile};
+      // Failing to store the entry only means that the next backend has to
+      // compile the UDO again
+      static_cast<void>(CxxUDOCache::store(impl->cacheKey, entry));
+      impl->serializedAnalysis.clear();
+   }
+   // In tiered mode, the lock is released after the first tier, other
+   // backends then compile their first tier as well instead of waiting for
+   // the optimized code
+   impl->cacheLock.unlock();
+
    return UDO_SUCCESS;
 }
 //---------------------------------------------------------------------------
+udo_task udo_cxxudo_compile_async_with_mask(udo_handle handle, uint64_t outputMask)
+// Analyze and compile a C++ UDO in the background, computing only the output
+// attributes in the mask
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+
+   auto* task = new Task;
+   task->result = CompileThreadPool::get().submit([handle, impl, outputMask] {
+      if (impl->isCancelled)
+         return UDO_COMPILE_ERROR;
+      if (auto result = udo_cxxudo_analyze(handle); result != UDO_SUCCESS)
+         return result;
+      if (impl->isCancelled)
+         return UDO_COMPILE_ERROR;
+      return udo_cxxudo_compile_with_mask(handle, outputMask);
+   });
+   impl->pendingTask = task->result;
+   return reinterpret_cast<udo_task>(task);
+}
+//---------------------------------------------------------------------------
+udo_task udo_cxxudo_compile_async(udo_handle handle)
+// Analyze and compile a C++ UDO in the background
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   return udo_cxxudo_compile_async_with_mask(handle, impl->outputMask);
+}
+//---------------------------------------------------------------------------
+bool udo_poll(udo_task task)
+// Check if a task is finished without blocking
+{
+   auto* t = reinterpret_cast<Task*>(task);
+   return t->result.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+//---------------------------------------------------------------------------
+udo_errno udo_wait(udo_task task)
+// Wait until a task is finished and destroy it
+{
+   auto* t = reinterpret_cast<Task*>(task);
+   auto result = t->result.get();
+   delete t;
+   return result;
+}
+//---------------------------------------------------------------------------
+void udo_detach(udo_task task)
+// Destroy a task without waiting for it
+{
+   auto* t = reinterpret_cast<Task*>(task);
+   delete t;
+}
+//---------------------------------------------------------------------------
 udo_errno udo_cxxudo_link(udo_handle handle, udo_cxx_functors functors, udo_cxx_allocation_funcs allocationFuncs, int64_t tlsBlockOffset, uint64_t tlsBlockSize, udo_cxx_functions* functions)
 // Link a compiled C++ UDO
 {
@@ -311,14 +1118,31 @@ udo_errno udo_cxxudo_link(udo_handle handle, udo_cxx_functors functors, udo_cxx_
    static_assert(sizeof(udo_cxx_functions) == sizeof(CxxUDOFunctions));
 
    auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   UDOStats::Scope statsScope(&impl->stats);
+   ++impl->tierStats.numLinks;
+
+   // Switching to the optimized code is only safe here, i.e. between two
+   // executions, because the UDO object and the global state of the UDO refer
+   // to the memory of the code that is currently used.
+   if (impl->optimizedCompilation.valid() && impl->optimizedCompilation.wait_for(chrono::seconds(0)) == future_status::ready) {
+      // If the optimized compilation failed, just keep the current code
+      if (auto result = impl->optimizedCompilation.get(); result) {
+         impl->execution.reset();
+         impl->setObjectFile(move(result).value());
+         impl->tierStats.optimizationLevel = CxxUDOCompiler::getOptLevel();
+         impl->tierStats.switchedAtLink = impl->tierStats.numLinks;
+         impl->tierStats.switchDelayMicroseconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - impl->optimizedCompilationStart).count();
+      }
+   }
 
    if (!impl->execution) {
-      impl->execution.emplace(impl->objectFile);
+      impl->execution = make_unique<CxxUDOExecution>(impl->objectFile);
       if (auto result = impl->execution->link(bit_cast<CxxUDOAllocationFuncs>(allocationFuncs), tlsBlockOffset, tlsBlockSize); !result) {
          impl->errorMessage = move(result).error();
          impl->execution.reset();
          return UDO_LINK_ERROR;
       }
+      impl->execution->setAllocationLimit(impl->allocationLimit);
    }
 
    impl->execution->getFunctors() = bit_cast<CxxUDOFunctors>(functors);
@@ -339,3 +1163,110 @@ void* udo_cxxudo_get_constructor_arg(udo_handle handle)
    return impl->constructorArg.get();
 }
 //---------------------------------------------------------------------------
+udo_errno udo_cxxudo_get_tier_stats(udo_handle handle, udo_cxx_tier_stats* stats)
+// Get the statistics about the tiered compilation of a C++ UDO
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   *stats = impl->tierStats;
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
+udo_errno udo_get_stats(udo_handle handle, udo_stats* stats)
+// Get the statistics about compiling and linking a UDO
+{
+   static_assert(sizeof(udo_stats) == sizeof(UDOStats));
+
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   *stats = bit_cast<udo_stats>(impl->stats);
+   stats->objectSize = impl->objectFile.size();
+
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
+udo_errno udo_cxxudo_get_allocation_stats(udo_handle handle, udo_cxx_allocation_stats* stats)
+// Get the statistics about the allocations of a linked C++ UDO
+{
+   static_assert(sizeof(udo_cxx_allocation_stats) == sizeof(CxxUDOAllocationStats));
+
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   if (!impl->execution) {
+      impl->errorMessage = "C++ UDO must be linked before its allocations can be retrieved";
+      return UDO_LINK_ERROR;
+   }
+   auto allocationStats = impl->execution->getAllocationStats();
+   if (!allocationStats) {
+      impl->errorMessage = "The allocations of C++ UDOs are not accounted";
+      return UDO_LINK_ERROR;
+   }
+   *stats = bit_cast<udo_cxx_allocation_stats>(*allocationStats);
+
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
+void udo_cxxudo_set_allocation_limit(udo_handle handle, uint64_t limit)
+// Set the maximum number of bytes a C++ UDO may have allocated at a time
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   impl->allocationLimit = limit;
+   if (impl->execution)
+      impl->execution->setAllocationLimit(limit);
+}
+//---------------------------------------------------------------------------
+udo_errno udo_cxxudo_instantiate(udo_handle handle, udo_cxx_functors functors, udo_instance* instance, udo_cxx_functions* functions)
+// Create a new instance of a C++ UDO after it was linked
+{
+   auto* impl = reinterpret_cast<UDOImpl*>(handle);
+   UDOStats::Scope statsScope(&impl->stats);
+
+   if (!impl->execution) {
+      impl->errorMessage = "C++ UDO must be linked before it can be instantiated";
+      return UDO_LINK_ERROR;
+   }
+
+   auto result = impl->execution->instantiate();
+   if (!result) {
+      impl->errorMessage = move(result).error();
+      return UDO_LINK_ERROR;
+   }
+
+   auto& cxxInstance = *result;
+   cxxInstance->getFunctors() = bit_cast<CxxUDOFunctors>(functors);
+   cxxInstance->setAllocationLimit(impl->allocationLimit);
+   auto instanceFunctions = cxxInstance->initialize();
+   if (!instanceFunctions) {
+      impl->errorMessage = move(instanceFunctions).error();
+      return UDO_LINK_ERROR;
+   }
+   *functions = bit_cast<udo_cxx_functions>(*instanceFunctions);
+   *instance = reinterpret_cast<udo_instance>(cxxInstance.release());
+
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
+void udo_cxxudo_instance_destroy(udo_instance instance)
+// Destroy an instance created with `udo_cxxudo_instantiate()`
+{
+   auto* cxxInstance = reinterpret_cast<CxxUDOInstance*>(instance);
+   delete cxxInstance;
+}
+//---------------------------------------------------------------------------
+udo_errno udo_cxxudo_instance_get_allocation_stats(udo_instance instance, udo_cxx_allocation_stats* stats)
+// Get the statistics about the allocations of an instance of a C++ UDO
+{
+   auto* cxxInstance = reinterpret_cast<CxxUDOInstance*>(instance);
+   auto allocationStats = cxxInstance->getAllocationStats();
+   if (!allocationStats)
+      return UDO_LINK_ERROR;
+   *stats = bit_cast<udo_cxx_allocation_stats>(*allocationStats);
+
+   return UDO_SUCCESS;
+}
+//---------------------------------------------------------------------------
+void udo_cxxudo_instance_set_allocation_limit(udo_instance instance, uint64_t limit)
+// Set the maximum number of bytes an instance of a C++ UDO may have allocated
+// at a time
+{
+   auto* cxxInstance = reinterpret_cast<CxxUDOInstance*>(instance);
+   cxxInstance->setAllocationLimit(limit);
+}
+//---------------------------------------------------------------------------
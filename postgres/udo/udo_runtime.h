@@ -37,6 +37,10 @@ typedef struct udo_cxx_functors {
    udo_functor printDebugFunctor;
    /// The functor for getRandom
    udo_functor getRandomFunctor;
+   /// The functor for the batch emit callback, used instead of emitFunctor
+   /// when `udo_cxxudo_get_emit_batch_size()` is not 0:
+   /// void emitBatch(void* stateArg, void* executionState1, void* executionState2, const void* tuples, uint64_t numTuples)
+   udo_functor emitBatchFunctor;
 } udo_cxx_functors;
 //---------------------------------------------------------------------------
 /// The allocation functions that will be used to link the C++ UDO
@@ -67,8 +71,95 @@ typedef struct udo_cxx_functions {
    void* extraWork;
    /// The process function pointer
    void* process;
+   /// The accept function pointer for a batch of tuples:
+   /// void acceptBatch(void* udo, void* executionState1, void* executionState2, const void* tuples, uint64_t numTuples)
+   void* acceptBatch;
+   /// The function that passes the output tuples the current thread buffered
+   /// to the batch emit functor, NULL if `udo_cxxudo_get_emit_batch_size()` is
+   /// 0. It must be called by every thread after its last call of accept,
+   /// extraWork and process flush the buffer themselves: void flushEmit()
+   void* flushEmit;
 } udo_cxx_functions;
 //---------------------------------------------------------------------------
+/// Statistics about the tiered compilation of a C++ UDO
+typedef struct udo_cxx_tier_stats {
+   /// The optimization level of the code that is currently used
+   unsigned optimizationLevel;
+   /// The number of calls to `udo_cxxudo_link()`
+   uint64_t numLinks;
+   /// The number of the call to `udo_cxxudo_link()` that switched to the
+   /// optimized code, 0 if it was not switched yet
+   uint64_t switchedAtLink;
+   /// The time between the start of the optimized compilation and the switch
+   /// in microseconds
+   uint64_t switchDelayMicroseconds;
+} udo_cxx_tier_stats;
+//---------------------------------------------------------------------------
+/// Statistics about the memory that a C++ UDO allocated since it was
+/// initialized. Only available if the setting cxxUDOAllocationAccounting is
+/// enabled.
+typedef struct udo_cxx_allocation_stats {
+   /// The number of bytes that are currently allocated
+   uint64_t liveBytes;
+   /// The maximum of liveBytes
+   uint64_t peakBytes;
+   /// The number of successful allocations, including reallocations
+   uint64_t numAllocations;
+   /// The number of freed allocations
+   uint64_t numFrees;
+   /// The number of allocations that failed because of the limit or the host
+   uint64_t numFailedAllocations;
+   /// The number of allocations by size. Entry i counts the sizes in
+   /// [2^i, 2^(i+1)), entry 0 also contains 0 and the last entry all larger
+   /// sizes.
+   uint64_t sizeHistogram[32];
+} udo_cxx_allocation_stats;
+//---------------------------------------------------------------------------
+/// The measurements of a phase of compiling or linking a UDO, summed up over
+/// all times the phase ran
+typedef struct udo_phase_stats {
+   /// How often the phase ran
+   uint64_t count;
+   /// The wall time in nanoseconds
+   uint64_t wallTimeNs;
+   /// The CPU time of the thread in nanoseconds
+   uint64_t cpuTimeNs;
+   /// The increase of the peak resident set size of the process in KiB
+   uint64_t peakRSSDeltaKiB;
+} udo_phase_stats;
+//---------------------------------------------------------------------------
+/// Statistics about compiling and linking a UDO. The phases are nested:
+/// codeGen and optimize are part of clangCompile when the UDO is analyzed,
+/// loadObject is part of finalize when a library object is loaded lazily,
+/// and freeze is part of finalize. The background compilation of tiered
+/// compilation is not included.
+typedef struct udo_stats {
+   /// Compiling the C++ source with clang
+   udo_phase_stats clangCompile;
+   /// Generating the llvm module from the AST
+   udo_phase_stats codeGen;
+   /// Optimizing the llvm module
+   udo_phase_stats optimize;
+   /// Compiling the llvm module to an object file
+   udo_phase_stats compileModule;
+   /// Opening the static libraries
+   udo_phase_stats addLibrary;
+   /// Loading the object file and the objects from the static libraries
+   udo_phase_stats loadObject;
+   /// Resolving the relocations and finalizing the memory
+   udo_phase_stats finalize;
+   /// Making the memory of the linked code read-only or executable
+   udo_phase_stats freeze;
+   /// The size of the object file that is currently used
+   uint64_t objectSize;
+   /// The number of objects that were loaded from static libraries
+   uint64_t numArchiveMembersLoaded;
+   /// The number of symbols that were resolved by the linker
+   uint64_t numSymbolsResolved;
+   /// The number of explicit huge pages that back the linked code
+   uint64_t numHugePages;
+} udo_stats;
+//---------------------------------------------------------------------------
 /// The arguments of a UDO
 typedef struct udo_arguments {
    /// The number of scalar arguments
@@ -105,23 +196,98 @@ struct udo_opaque_impl;
 /// library.
 typedef struct udo_opaque_impl* udo_handle;
 //---------------------------------------------------------------------------
+struct udo_opaque_instance;
+//---------------------------------------------------------------------------
+/// An opaque handle for an instance of a linked C++ UDO
+typedef struct udo_opaque_instance* udo_instance;
+//---------------------------------------------------------------------------
+struct udo_opaque_task;
+//---------------------------------------------------------------------------
+/// An opaque token for an operation that runs in the background
+typedef struct udo_opaque_task* udo_task;
+//---------------------------------------------------------------------------
 /// Initialize a C++ UDO with the given C++ source code and the name of the
 /// class that implements the UDO.
 udo_handle udo_cxxudo_init(const char* cxxSource, size_t cxxSourceLen, const char* udoClassName, size_t udoClassNameLen);
 //---------------------------------------------------------------------------
-/// Destroy a handle created with `udo_cxxudo_init()`
+/// The source of a C++ UDO in a pipeline
+typedef struct udo_cxxudo_source {
+   /// The C++ source code
+   const char* cxxSource;
+   /// The length of the source code
+   size_t cxxSourceLen;
+   /// The name of the class that implements the UDO
+   const char* udoClassName;
+   /// The length of the class name
+   size_t udoClassNameLen;
+} udo_cxxudo_source;
+//---------------------------------------------------------------------------
+/// Initialize a pipeline of C++ UDOs where each UDO consumes the output of
+/// the previous one, so the `OutputTuple` of a UDO must have the same layout
+/// as the `InputTuple` of the next one. The UDOs are compiled into a single
+/// UDO whose handle is used like a handle of a single UDO: Its input is the
+/// input of the first UDO, its output is the output of the last UDO, and its
+/// constructor takes the scalar arguments of all UDOs in order. All UDOs but
+/// the first must not have an extraWork or process function. Returns NULL if
+/// `numUDOs` is 0.
+udo_handle udo_cxxudo_init_pipeline(const udo_cxxudo_source* udos, size_t numUDOs);
+//---------------------------------------------------------------------------
+/// Destroy a handle created with `udo_cxxudo_init()` or
+/// `udo_cxxudo_init_pipeline()`
 void udo_cxxudo_destroy(udo_handle handle);
 //---------------------------------------------------------------------------
 /// Get the error message of the last function call that returned an error
 const char* udo_error_message(udo_handle handle);
 //---------------------------------------------------------------------------
-/// Cache a handle with a given key
+/// The statistics of the cache of handles
+typedef struct udo_handle_cache_stats {
+   /// The number of lookups that found a handle
+   uint64_t numHits;
+   /// The number of lookups that did not find a handle
+   uint64_t numMisses;
+   /// The number of handles that were evicted because the cache exceeded its
+   /// memory budget
+   uint64_t numEvictions;
+   /// The number of cached handles
+   uint64_t numEntries;
+   /// The memory used by the cached handles in bytes
+   uint64_t memoryUsage;
+   /// The memory budget of the cache in bytes, 0 if it is unlimited
+   uint64_t memoryBudget;
+} udo_handle_cache_stats;
+//---------------------------------------------------------------------------
+/// Cache a handle with a given key. The cache owns the handle afterwards, so
+/// it must not be destroyed by the caller. A handle that was cached with the
+/// same key before is replaced and destroyed unless it is pinned. The handle
+/// is never evicted, it stays valid until it is replaced.
 void udo_cache_handle(udo_handle handle, uint64_t cacheKey);
 //---------------------------------------------------------------------------
-/// Get a cached handle
+/// Get a cached handle without pinning it, nullptr if there is none. The
+/// handle is never evicted afterwards, it stays valid until it is replaced.
 udo_handle udo_get_cached_handle(uint64_t cacheKey);
 //---------------------------------------------------------------------------
-/// Analyze a C++ UDO
+/// Like `udo_cache_handle()`, but the handle is pinned for the caller until
+/// it is released with `udo_release_cached_handle()`. A pinned handle is
+/// never evicted or destroyed, a replaced handle is destroyed when it is
+/// released. When the memory used by the cached handles exceeds the budget
+/// (setting udoHandleCacheBudget), the least recently used handles that are
+/// not pinned are evicted, unless they were cached or looked up without
+/// pinning them.
+void udo_cache_handle_pinned(udo_handle handle, uint64_t cacheKey);
+//---------------------------------------------------------------------------
+/// Get a cached handle and pin it, nullptr if there is none. The handle must
+/// be released with `udo_release_cached_handle()`.
+udo_handle udo_get_cached_handle_pinned(uint64_t cacheKey);
+//---------------------------------------------------------------------------
+/// Release a handle that was pinned by `udo_cache_handle_pinned()` or
+/// `udo_get_cached_handle_pinned()`. Handles that are not pinned anymore are
+/// evicted when the cache exceeds its budget.
+void udo_release_cached_handle(udo_handle handle);
+//---------------------------------------------------------------------------
+/// Get the statistics of the cache of handles
+void udo_get_handle_cache_stats(udo_handle_cache_stats* stats);
+//---------------------------------------------------------------------------
+/// Analyze a C++ UDO. Does nothing if the UDO was already analyzed.
 udo_errno udo_cxxudo_analyze(udo_handle handle);
 //---------------------------------------------------------------------------
 /// Get the arguments the UDO takes
@@ -136,15 +302,112 @@ udo_errno udo_get_input_attributes(udo_handle handle, udo_attribute_descr_array*
 /// Get the size of the UDO object
 size_t udo_get_size(udo_handle handle);
 //---------------------------------------------------------------------------
-/// Compile a C++ UDO to an object file after it was analyzed
+/// Get the number of output tuples that a compiled C++ UDO buffers per thread
+/// before it calls the batch emit functor, 0 if it calls the emit functor for
+/// every tuple.
+size_t udo_cxxudo_get_emit_batch_size(udo_handle handle);
+//---------------------------------------------------------------------------
+/// Get the bitcode of the optimized module of a C++ UDO after it was
+/// analyzed. Its metadata `udo.CxxUDO.LLVMFunctions` describes the generated
+/// functions. The bitcode is valid until the handle is destroyed.
+udo_errno udo_cxxudo_get_bitcode(udo_handle handle, const char** bitcode, size_t* bitcodeSize);
+//---------------------------------------------------------------------------
+/// Let the emit function of a C++ UDO call the function `consumerName` from
+/// the given bitcode directly instead of the emit functor, so that the host's
+/// consumer is inlined into the UDO. The consumer has the signature:
+/// void consumer(udo_functor* emitFunctor, void* executionState1, void* executionState2, const void* tuple)
+/// Must be called after `udo_cxxudo_analyze()` and before `udo_cxxudo_link()`.
+udo_errno udo_cxxudo_fuse_emit(udo_handle handle, const char* bitcode, size_t bitcodeSize, const char* consumerName, size_t consumerNameLen);
+//---------------------------------------------------------------------------
+/// Specialize a C++ UDO for the constant scalar arguments of its
+/// constructor. `values` and `isConstant` contain one entry for every scalar
+/// argument as returned by `udo_get_arguments()`, the values of the arguments
+/// that are not constant are ignored. The specialized code is cached
+/// separately for every combination of constants. Must be called after
+/// `udo_cxxudo_analyze()` and before `udo_cxxudo_compile()`. The constructor
+/// must still be called with all arguments.
+udo_errno udo_cxxudo_specialize(udo_handle handle, const Datum* values, const bool* isConstant, size_t numValues);
+//---------------------------------------------------------------------------
+/// Compile a C++ UDO to an object file after it was analyzed. It keeps the
+/// output mask of an earlier call of `udo_cxxudo_compile_with_mask()`,
+/// otherwise all output attributes are computed.
 udo_errno udo_cxxudo_compile(udo_handle handle);
 //---------------------------------------------------------------------------
-/// Link a compiled C++ UDO
+/// The output mask for `udo_cxxudo_compile_with_mask()` that keeps all output
+/// attributes
+#define UDO_ALL_OUTPUT_ATTRIBUTES (~UINT64_C(0))
+//---------------------------------------------------------------------------
+/// Compile a C++ UDO to an object file after it was analyzed. Bit i of
+/// `outputMask` is set if the output attribute i (as returned by
+/// `udo_get_output_attributes()`) is used by the query, the other attributes
+/// of the emitted tuples are zero and not computed if possible. The mask
+/// cannot be changed once the UDO was compiled.
+udo_errno udo_cxxudo_compile_with_mask(udo_handle handle, uint64_t outputMask);
+//---------------------------------------------------------------------------
+/// Analyze and compile a C++ UDO in the background. The handle must not be
+/// used until the task was finished with `udo_wait()`, afterwards
+/// `udo_cxxudo_analyze()` and `udo_cxxudo_compile()` return immediately. The
+/// only exception is `udo_cxxudo_destroy()`, which cancels the task and waits
+/// until it stopped, e.g. when the query is aborted.
+udo_task udo_cxxudo_compile_async(udo_handle handle);
+//---------------------------------------------------------------------------
+/// Like `udo_cxxudo_compile_async()` but compiles the UDO with
+/// `udo_cxxudo_compile_with_mask()`
+udo_task udo_cxxudo_compile_async_with_mask(udo_handle handle, uint64_t outputMask);
+//---------------------------------------------------------------------------
+/// Check if a task is finished without blocking
+bool udo_poll(udo_task task);
+//---------------------------------------------------------------------------
+/// Wait until a task is finished and destroy it. Returns the result of the
+/// task, the error message can be retrieved with `udo_error_message()`.
+udo_errno udo_wait(udo_task task);
+//---------------------------------------------------------------------------
+/// Destroy a task without waiting for it. The task keeps running until it is
+/// finished or its handle is destroyed.
+void udo_detach(udo_task task);
+//---------------------------------------------------------------------------
+/// Link a compiled C++ UDO. With tiered compilation this switches to the
+/// optimized code once it is ready.
 udo_errno udo_cxxudo_link(udo_handle handle, udo_cxx_functors functors, udo_cxx_allocation_funcs allocationFuncs, int64_t tlsBlockOffset, uint64_t tlsBlockSize, udo_cxx_functions* functions);
 //---------------------------------------------------------------------------
 /// Get a pointer that can be used as an argument to the global constructor
 void* udo_cxxudo_get_constructor_arg(udo_handle handle);
 //---------------------------------------------------------------------------
+/// Get the statistics about the tiered compilation of a C++ UDO
+udo_errno udo_cxxudo_get_tier_stats(udo_handle handle, udo_cxx_tier_stats* stats);
+//---------------------------------------------------------------------------
+/// Get the statistics about compiling and linking a UDO
+udo_errno udo_get_stats(udo_handle handle, udo_stats* stats);
+//---------------------------------------------------------------------------
+/// Get the statistics about the allocations of a linked C++ UDO since its
+/// last initialization by `udo_cxxudo_link()`
+udo_errno udo_cxxudo_get_allocation_stats(udo_handle handle, udo_cxx_allocation_stats* stats);
+//---------------------------------------------------------------------------
+/// Set the maximum number of bytes a C++ UDO may have allocated at a time, 0
+/// for unlimited. malloc() etc. fail in the UDO when they would exceed it.
+/// The limit also applies to the instances that are created afterwards.
+void udo_cxxudo_set_allocation_limit(udo_handle handle, uint64_t limit);
+//---------------------------------------------------------------------------
+/// Create a new instance of a C++ UDO after it was linked with
+/// `udo_cxxudo_link()`. All instances share the code of the UDO but have
+/// their own data, so they can be executed concurrently. All instances and the
+/// UDO use the same TLS block, so an instance must be created on the thread
+/// that executes it, and that thread must not execute the UDO or another
+/// instance until the instance is destroyed. Creating a second instance on a
+/// thread fails with `UDO_LINK_ERROR`. The instance is independent of the
+/// handle and must be destroyed with `udo_cxxudo_instance_destroy()`.
+udo_errno udo_cxxudo_instantiate(udo_handle handle, udo_cxx_functors functors, udo_instance* instance, udo_cxx_functions* functions);
+//---------------------------------------------------------------------------
+/// Destroy an instance created with `udo_cxxudo_instantiate()`
+void udo_cxxudo_instance_destroy(udo_instance instance);
+//---------------------------------------------------------------------------
+/// Get the statistics about the allocations of an instance of a C++ UDO
+udo_errno udo_cxxudo_instance_get_allocation_stats(udo_instance instance, udo_cxx_allocation_stats* stats);
+//---------------------------------------------------------------------------
+/// Set the maximum number of bytes an instance of a C++ UDO may have
+/// allocated at a time, 0 for unlimited
+void udo_cxxudo_instance_set_allocation_limit(udo_instance instance, uint64_t limit);
+//---------------------------------------------------------------------------
 #ifdef __cplusplus
 }
 #endif
@@ -1,21 +1,30 @@
 #include "udo/ClangCompiler.hpp"
+#include "udo/CxxUDOCache.hpp"
 #include "udo/CxxUDOConfig.hpp"
 #include "udo/LLVMCompiler.hpp"
 #include "udo/ScopeGuard.hpp"
 #include "udo/Setting.hpp"
 #include "udo/UDORuntime.hpp"
+#include "udo/UDOStats.hpp"
 #include <clang/Basic/Diagnostic.h>
 #include <clang/Driver/Compilation.h>
 #include <clang/Driver/Driver.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/FrontendOptions.h>
 #include <clang/Frontend/TextDiagnosticBuffer.h>
 #include <clang/Frontend/Utils.h>
 #include <clang/Lex/HeaderSearchOptions.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/SHA256.h>
+#include <filesystem>
 #include <new>
+#include <system_error>
 //---------------------------------------------------------------------------
 // UDO runtime
 // (c) 2021 Moritz Sichert
@@ -26,6 +35,30 @@ namespace udo {
 //---------------------------------------------------------------------------
 static Setting<bool> printCxxUDOWarnings("printCxxUDOWarnings", "Print warnings of C++ UDO compilation", false);
 static Setting<string> cxxUDOClangxx("cxxUDOClangxx", "Path to clang++ to be used by C++ UDOs", {});
+static Setting<bool> cxxUDOPrecompiledHeader("cxxUDOPrecompiledHeader", "Use a precompiled header for the libc++ headers of C++ UDOs, it is stored in cxxUDOCacheDir", true);
+//---------------------------------------------------------------------------
+/// The path of the virtual source file of the precompiled header
+static constexpr const char* pchSourcePath = "/tmp/udo-runtime/udo-pch.hpp";
+//---------------------------------------------------------------------------
+/// The libc++ headers that are contained in the precompiled header. These are
+/// all headers that are included by the runtime headers and some more that
+/// are commonly used by C++ UDOs.
+static constexpr array pchHeaders = {"algorithm", "array", "atomic", "cmath", "cstddef", "cstdint", "cstdlib", "cstring", "iterator", "limits", "memory", "new", "numeric", "optional", "span", "string", "string_view", "tuple", "type_traits", "unordered_map", "unordered_set", "utility", "vector"};
+//---------------------------------------------------------------------------
+static const string& getPCHSource()
+// Get the source of the precompiled header
+{
+   static const string pchSource = [] {
+      string source;
+      for (auto* header : pchHeaders) {
+         source += "#include <";
+         source += header;
+         source += ">\n";
+      }
+      return source;
+   }();
+   return pchSource;
+}
 //---------------------------------------------------------------------------
 static string_view getClangxx()
 // Get the path to clang++ (either from the cxxUDOClangxx setting or the default)
@@ -46,6 +79,7 @@ ClangCompiler::ClangCompiler(string_view source, unsigned optimizationLevel)
       filename += header.filename;
       addVirtualFile(move(filename), header.content);
    }
+   addVirtualFile(pchSourcePath, getPCHSource());
    addVirtualFile("/tmp/udo.cpp"s, source);
 }
 //---------------------------------------------------------------------------
@@ -63,7 +97,7 @@ void ClangCompiler::addFrontendAction(clang::FrontendAction* action)
 //---------------------------------------------------------------------------
 static constexpr array cxxUDOBaseFlags = {"-xc++", "-std=c++20", "-nostdinc++", "-fPIC", "-ftls-model=initial-exec", "-march=native", "-fno-exceptions", "-Wall", "-Wextra", "-Wno-unqualified-std-cast-call"};
 //---------------------------------------------------------------------------
-static vector<const char*> getClangCmdline(unsigned optimizationLevel)
+static vector<const char*> getClangCmdline(unsigned optimizationLevel, bool precompileHeader = false)
 // Get the command line to the clang invocation
 {
    vector<const char*> clangCmdline;
@@ -87,17 +121,22 @@ static vector<const char*> getClangCmdline(unsigned optimizationLevel)
          clangCmdline.push_back("-O3");
          break;
    }
-   clangCmdline.push_back("/tmp/udo.cpp");
+   if (precompileHeader) {
+      clangCmdline.push_back("-xc++-header");
+      clangCmdline.push_back(pchSourcePath);
+   } else {
+      clangCmdline.push_back("/tmp/udo.cpp");
+   }
 
    return clangCmdline;
 }
 //---------------------------------------------------------------------------
-tl::expected<void, string> ClangCompiler::compile()
-// Compile the file
+static unique_ptr<clang::CompilerInvocation> createCxxUDOInvocation(const vector<const char*>& clangCmdline)
+// Create the compiler invocation for a clang command line
 {
-   LLVMCompiler::initializeLLVM();
-
-   auto invocation = clang::createInvocation(getClangCmdline(optimizationLevel));
+   auto invocation = clang::createInvocation(clangCmdline);
+   if (!invocation)
+      return nullptr;
 
    auto& frontendOpts = invocation->getFrontendOpts();
    // createInvocationFromCommandLine sets DisableFree to true which then
@@ -121,7 +160,134 @@ tl::expected<void, string> ClangCompiler::compile()
    diagnosticOpts.ShowCarets = false;
    diagnosticOpts.ShowFixits = false;
 
-   auto diagnosticPtr = std::make_unique<clang::TextDiagnosticBuffer>();
+   return invocation;
+}
+//---------------------------------------------------------------------------
+namespace {
+//---------------------------------------------------------------------------
+/// A diagnostic buffer that also remembers if the precompiled header could
+/// not be loaded
+class CxxUDODiagnosticBuffer : public clang::TextDiagnosticBuffer {
+   private:
+   /// Was there an error when reading the precompiled header?
+   bool pchError = false;
+
+   public:
+   /// Handle a diagnostic
+   void HandleDiagnostic(clang::DiagnosticsEngine::Level level, const clang::Diagnostic& info) override;
+
+   /// Was there an error when reading the precompiled header?
+   bool hasPCHError() const { return pchError; }
+};
+//---------------------------------------------------------------------------
+void CxxUDODiagnosticBuffer::HandleDiagnostic(clang::DiagnosticsEngine::Level level, const clang::Diagnostic& info)
+// Handle a diagnostic
+{
+   // All errors about an outdated or unreadable precompiled header are
+   // reported by the AST reader, i.e. they are serialization diagnostics
+   auto id = info.getID();
+   if (level >= clang::DiagnosticsEngine::Error && id >= clang::diag::DIAG_START_SERIALIZATION && id < clang::diag::DIAG_START_LEX)
+      pchError = true;
+   clang::TextDiagnosticBuffer::HandleDiagnostic(level, info);
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+string ClangCompiler::getPrecompiledHeader(unsigned optimizationLevel)
+// Get the path to the precompiled header, build it if necessary. Returns an
+// empty string if no precompiled header should be used.
+{
+   auto& cacheDir = CxxUDOCache::getDirectory();
+   if (!cxxUDOPrecompiledHeader.get() || cacheDir.empty())
+      return {};
+
+   auto clangCmdline = getClangCmdline(optimizationLevel, true);
+
+   // The precompiled header must only be used with exactly the same flags,
+   // compiler, target, and libc++ it was built with. System headers are not
+   // validated by clang, so we add the state of the libc++ config header to
+   // the key.
+   llvm::SHA256 hasher;
+   auto addToHash = [&](llvm::StringRef value) {
+      hasher.update(value);
+      hasher.update(llvm::StringRef("", 1));
+   };
+   for (auto* arg : clangCmdline)
+      addToHash(arg);
+   addToHash(LLVM_VERSION_STRING);
+   addToHash(llvm::StringRef(cxxUDODepsPrefix.data(), cxxUDODepsPrefix.size()));
+   addToHash(llvm::sys::getHostCPUName());
+   addToHash(getPCHSource());
+   {
+      error_code ec;
+      auto libcxxConfig = filesystem::path(cxxUDODepsPrefix) / "include/c++/v1/__config";
+      auto configSize = filesystem::file_size(libcxxConfig, ec);
+      auto configTime = filesystem::last_write_time(libcxxConfig, ec);
+      addToHash(to_string(configSize) + ":" + to_string(configTime.time_since_epoch().count()));
+   }
+
+   auto pchPath = filesystem::path(cacheDir) / ("libcxx-" + llvm::toHex(hasher.final(), true) + ".pch");
+   if (error_code ec; filesystem::exists(pchPath, ec))
+      return pchPath.string();
+   if (error_code ec; !filesystem::create_directories(cacheDir, ec) && ec)
+      return {};
+
+   auto invocation = createCxxUDOInvocation(clangCmdline);
+   if (!invocation)
+      return {};
+   // The output file is written to a temporary file and renamed by clang, so
+   // concurrent compilations never see a partially written header.
+   invocation->getFrontendOpts().OutputFile = pchPath.string();
+
+   clang::CompilerInstance compiler;
+   shared_ptr<clang::CompilerInvocation> invocationShared(invocation.release());
+   compiler.setInvocation(move(invocationShared));
+   compiler.createDiagnostics(new clang::IgnoringDiagConsumer);
+
+   createVirtualFiles(compiler, {{pchSourcePath, getPCHSource()}});
+   compiler.createSourceManager(compiler.getFileManager());
+
+   clang::GeneratePCHAction action;
+   if (!compiler.ExecuteAction(action) || compiler.getDiagnostics().hasErrorOccurred()) {
+      error_code ec;
+      filesystem::remove(pchPath, ec);
+      return {};
+   }
+
+   return pchPath.string();
+}
+//---------------------------------------------------------------------------
+tl::expected<void, string> ClangCompiler::compile()
+// Compile the file
+{
+   UDOStats::PhaseTimer timer(UDOPhase::ClangCompile);
+   LLVMCompiler::initializeLLVM();
+
+   if (auto precompiledHeader = getPrecompiledHeader(optimizationLevel); !precompiledHeader.empty()) {
+      bool precompiledHeaderFailed = false;
+      auto result = compile(precompiledHeader, precompiledHeaderFailed);
+      if (!precompiledHeaderFailed)
+         return result;
+
+      // The precompiled header is outdated, remove it so that it will be
+      // rebuilt and compile without it for now
+      error_code ec;
+      filesystem::remove(precompiledHeader, ec);
+   }
+
+   bool precompiledHeaderFailed = false;
+   return compile({}, precompiledHeaderFailed);
+}
+//---------------------------------------------------------------------------
+tl::expected<void, string> ClangCompiler::compile(string_view precompiledHeader, bool& precompiledHeaderFailed)
+// Compile the file with an optional precompiled header
+{
+   auto invocation = createCxxUDOInvocation(getClangCmdline(optimizationLevel));
+
+   if (!precompiledHeader.empty())
+      invocation->getPreprocessorOpts().ImplicitPCHInclude = precompiledHeader;
+
+   auto diagnosticPtr = std::make_unique<CxxUDODiagnosticBuffer>();
    auto& diagnostic = *diagnosticPtr;
 
    clang::CompilerInstance compiler;
@@ -129,7 +295,7 @@ tl::expected<void, string> ClangCompiler::compile()
    compiler.setInvocation(move(invocationShared));
    compiler.createDiagnostics(diagnosticPtr.release());
 
-   createVirtualFiles(compiler);
+   createVirtualFiles(compiler, virtualFiles);
 
    if (!compiler.hasSourceManager()) {
       if (!compiler.hasFileManager())
@@ -140,6 +306,10 @@ tl::expected<void, string> ClangCompiler::compile()
    for (auto* action : frontendActions) {
       if (!compiler.ExecuteAction(*action)) {
          auto& error = *diagnostic.err_begin();
+         if (!precompiledHeader.empty() && diagnostic.hasPCHError()) {
+            precompiledHeaderFailed = true;
+            return {};
+         }
          std::string message;
          llvm::raw_string_ostream message_stream{message};
          error.first.print(message_stream, compiler.getSourceManager());
@@ -169,14 +339,16 @@ static llvm::StringRef toStringRef(string_view sv) {
    return {sv.data(), sv.size()};
 }
 //---------------------------------------------------------------------------
-void ClangCompiler::createVirtualFiles(clang::CompilerInstance& compiler)
+void ClangCompiler::createVirtualFiles(clang::CompilerInstance& compiler, const vector<VirtualFile>& virtualFiles)
 // Create the virtual files in the compiler instance
 {
    llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> memFilesystem(new llvm::vfs::InMemoryFileSystem);
    for (auto& file : virtualFiles) {
       auto pathRef = toStringRef(file.path);
       auto sourceBuffer = llvm::MemoryBuffer::getMemBuffer(toStringRef(file.source), pathRef);
-      memFilesystem->addFile(pathRef, time(nullptr), move(sourceBuffer));
+      // Use a fixed modification time, the precompiled header stores the time
+      // of its virtual source file and validates it when it is loaded.
+      memFilesystem->addFile(pathRef, 0, move(sourceBuffer));
    }
 
    llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> overlayFs(new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem()));
@@ -189,6 +361,7 @@ void ClangCompiler::createVirtualFiles(clang::CompilerInstance& compiler)
 void ClangCompiler::optimizeModule(llvm::Module& module, unsigned optimizationLevel)
 // Run the optimizations on the module that clang would use
 {
+   UDOStats::PhaseTimer timer(UDOPhase::Optimize);
    llvm::OptimizationLevel optLevel;
    switch (optimizationLevel) {
       case 0:
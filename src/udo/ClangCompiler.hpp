@@ -40,7 +40,13 @@ class ClangCompiler {
    std::vector<clang::FrontendAction*> frontendActions;
 
    /// Create the virtual files in the compiler instance
-   void createVirtualFiles(clang::CompilerInstance& compiler);
+   static void createVirtualFiles(clang::CompilerInstance& compiler, const std::vector<VirtualFile>& virtualFiles);
+   /// Get the path to the precompiled header, build it if necessary. Returns
+   /// an empty string if no precompiled header should be used.
+   static std::string getPrecompiledHeader(unsigned optimizationLevel);
+   /// Compile the file with an optional precompiled header. Sets
+   /// `precompiledHeaderFailed` if the precompiled header could not be used.
+   tl::expected<void, std::string> compile(std::string_view precompiledHeader, bool& precompiledHeaderFailed);
 
    public:
    /// Constructor
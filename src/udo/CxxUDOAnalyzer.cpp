@@ -2,6 +2,7 @@
 #include "udo/ClangCompiler.hpp"
 #include "udo/LLVMMetadata.hpp"
 #include "udo/UDORuntime.hpp"
+#include "udo/UDOStats.hpp"
 #include "udo/i18n.hpp"
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/Attr.h>
@@ -27,6 +28,7 @@
 #include <clang/Sema/SemaConsumer.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
@@ -38,6 +40,7 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
 #include <llvm/Support/Casting.h>
+#include <llvm/Support/Error.h>
 #include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/VirtualFileSystem.h>
 #include <llvm/Support/raw_ostream.h>
@@ -143,6 +146,30 @@ bool isConstLvalueRefTo(clang::QualType refType, const clang::Type* expectedType
    return true;
 }
 //---------------------------------------------------------------------------
+bool isSpanOfConst(clang::QualType spanType, const clang::Type* expectedType)
+// Is `spanType` a `std::span` with dynamic extent of const `expectedType`?
+{
+   auto* specialization = llvm::dyn_cast_or_null<clang::ClassTemplateSpecializationDecl>(spanType->getAsCXXRecordDecl());
+   if (!specialization || !specialization->isInStdNamespace() || getName(specialization) != "span"sv)
+      return false;
+
+   auto& args = specialization->getTemplateArgs();
+   if (args.size() != 2 || args[0].getKind() != clang::TemplateArgument::Type || args[1].getKind() != clang::TemplateArgument::Integral)
+      return false;
+
+   auto elementType = args[0].getAsType();
+   if (!elementType.isConstQualified())
+      return false;
+   if (elementType.getCanonicalType().getTypePtr() != expectedType)
+      return false;
+
+   // Only spans with std::dynamic_extent consist of a pointer and a size
+   if (!args[1].getAsIntegral().isAllOnes())
+      return false;
+
+   return true;
+}
+//---------------------------------------------------------------------------
 }
 //---------------------------------------------------------------------------
 template <typename T>
@@ -200,6 +227,8 @@ class CxxUDOClangConsumer : public clang::SemaConsumer {
    clang::CXXDestructorDecl* destructor = nullptr;
    /// The accept function of the subclass
    clang::CXXMethodDecl* accept = nullptr;
+   /// The accept function of the subclass that takes a batch of tuples
+   clang::CXXMethodDecl* acceptBatch = nullptr;
    /// The extraWork function of the subclass
    clang::CXXMethodDecl* extraWork = nullptr;
    /// The process function of the subclass
@@ -380,6 +409,13 @@ class CxxUDOClangConsumer : public clang::SemaConsumer {
       return nullptr;
    }
 
+   /// Get the batch accept function of the UDO subclass
+   llvm::Function* getAcceptBatch() {
+      if (acceptBatch)
+         return getFunction(acceptBatch);
+      return nullptr;
+   }
+
    /// Get the extraWork function of the UDO subclass
    llvm::Function* getExtraWork() {
       if (extraWork)
@@ -433,6 +469,7 @@ class CxxUDOClangConsumer : public clang::SemaConsumer {
    }
 
    void HandleTranslationUnit(clang::ASTContext& ast_context) override {
+      UDOStats::PhaseTimer timer(UDOPhase::CodeGen);
       codegen->HandleTranslationUnit(ast_context);
       auto* module = codegen->GetModule();
       if (!error && module) {
@@ -691,6 +728,31 @@ class CxxUDOClangConsumer : public clang::SemaConsumer {
       return true;
    }
 
+   /// Check the signature of the batch accept function:
+   /// void accept(udo::ExecutionState, std::span<const InputTuple>)
+   bool checkAcceptBatchSignature(clang::CXXMethodDecl* method) const {
+      using namespace clang_utils;
+
+      // The method must not be static, but we allow it to be const
+      if (method->isStatic())
+         return false;
+
+      auto* funcType = llvm::cast<clang::FunctionProtoType>(method->getFunctionType());
+      if (!funcType->getReturnType().getTypePtr()->isVoidType())
+         return false;
+
+      auto params = funcType->getParamTypes();
+      if (params.size() != 2)
+         return false;
+
+      if (!isValidExecutionStateParam(params[0]))
+         return false;
+      if (!isSpanOfConst(params[1], inputTupleClass->getTypeForDecl()))
+         return false;
+
+      return true;
+   }
+
    /// Check the signature of the extraWork function:
    /// uint32_t extraWork(udo::ExecutionState, uint32_t)
    bool checkExtraWorkSignature(clang::CXXMethodDecl* method) const {
@@ -862,12 +924,15 @@ class CxxUDOClangConsumer : public clang::SemaConsumer {
          if (method->isUserProvided()) {
             auto methodName = getName(method);
             if (methodName == "accept"sv) {
-               if (!checkAcceptSignature(method)) {
-                  error = err(tr(tc, "invalid signature of accept function, expected signature: void accept(udo::ExecutionState, const InputTuple&)"));
+               if (checkAcceptSignature(method)) {
+                  accept = method;
+               } else if (checkAcceptBatchSignature(method)) {
+                  acceptBatch = method;
+               } else {
+                  error = err(tr(tc, "invalid signature of accept function, expected signature: void accept(udo::ExecutionState, const InputTuple&) or void accept(udo::ExecutionState, std::span<const InputTuple>)"));
                   return;
                }
                forceMemberFuncCodegen(method);
-               accept = method;
             } else if (methodName == "extraWork"sv) {
                if (!checkExtraWorkSignature(method)) {
                   error = err(tr(tc, "invalid signature of extraWork function, expected signature: uint32_t extraWork(udo::ExecutionState, uint32_t)"));
@@ -1105,6 +1170,7 @@ class CxxUDOFrontendAction : public clang::ASTFrontendAction {
       analysis.constructor = consumer->getConstructor();
       analysis.destructor = consumer->getDestructor();
       analysis.accept = consumer->getAccept();
+      analysis.acceptBatch = consumer->getAcceptBatch();
       analysis.extraWork = consumer->getExtraWork();
       analysis.process = consumer->getProcess();
       module = consumer->releaseModule();
@@ -1170,6 +1236,36 @@ tl::expected<void, std::string> CxxUDOAnalyzer::analyze(llvm::LLVMContext* conte
    return {};
 }
 //---------------------------------------------------------------------------
+tl::expected<void, std::string> CxxUDOAnalyzer::loadSerializedAnalysis(span<const char> serializedAnalysis, llvm::LLVMContext* context)
+// Load an analysis that was serialized with getSerializedAnalysis() instead
+// of analyzing the function
+{
+   impl = make_unique<Impl>();
+   if (context) {
+      impl->llvmContext = context;
+   } else {
+      impl->ownedLLVMContext = make_unique<llvm::LLVMContext>();
+      impl->llvmContext = &*impl->ownedLLVMContext;
+   }
+
+   llvm::MemoryBufferRef bufferRef(llvm::StringRef(serializedAnalysis.data(), serializedAnalysis.size()), "udo.CxxUDO.Analysis");
+   auto moduleOrError = llvm::parseBitcodeFile(bufferRef, *impl->llvmContext);
+   if (!moduleOrError) {
+      auto errorMessage = llvm::toString(moduleOrError.takeError());
+      impl.reset();
+      return tl::unexpected(trformat(tc, "invalid serialized analysis of C++ UDO: {0}", errorMessage));
+   }
+   impl->llvmModule = move(moduleOrError.get());
+
+   llvm_metadata::MetadataReader reader(*impl->llvmModule);
+   if (auto result = reader.readNamedValue("udo.CxxUDO.Analysis"sv, impl->analysis); !result) {
+      impl.reset();
+      return result;
+   }
+
+   return {};
+}
+//---------------------------------------------------------------------------
 const CxxUDOAnalysis& CxxUDOAnalyzer::getAnalysis() const
 // Get the analysis
 {
@@ -1247,6 +1343,7 @@ IOResult IO<CxxUDOAnalysis>::enumEntries(StructContext& context, CxxUDOAnalysis&
    TRY(mapMember(context, value.constructor));
    TRY(mapMember(context, value.destructor));
    TRY(mapMember(context, value.accept));
+   TRY(mapMember(context, value.acceptBatch));
    TRY(mapMember(context, value.extraWork));
    TRY(mapMember(context, value.process));
    TRY(mapMember(context, value.emitInAccept));
@@ -5,6 +5,7 @@
 #include "udo/LLVMMetadata.hpp"
 #include <llvm/ADT/SmallVector.h>
 #include <memory>
+#include <span>
 #include <string>
 #include <vector>
 //---------------------------------------------------------------------------
@@ -75,6 +76,8 @@ struct CxxUDOAnalysis {
    llvm::Function* destructor;
    /// The accept function of the UDO
    llvm::Function* accept;
+   /// The accept function of the UDO that takes a batch of tuples
+   llvm::Function* acceptBatch;
    /// The extraWork function of the UDO
    llvm::Function* extraWork;
    /// The process function of the UDO
@@ -107,8 +110,16 @@ class CxxUDOAnalyzer {
    /// Destructor
    ~CxxUDOAnalyzer();
 
+   /// Get the source code of the function
+   const std::string& getSource() const { return funcSource; }
+   /// Get the name of the class that implements the UDO
+   const std::string& getUDOClassName() const { return udoClassName; }
+
    /// Analyze the function
    tl::expected<void, std::string> analyze(llvm::LLVMContext* context = nullptr, unsigned optimizationLevel = 3);
+   /// Load an analysis that was serialized with getSerializedAnalysis()
+   /// instead of analyzing the function
+   tl::expected<void, std::string> loadSerializedAnalysis(std::span<const char> serializedAnalysis, llvm::LLVMContext* context = nullptr);
    /// Get the analysis
    const CxxUDOAnalysis& getAnalysis() const;
    /// Get the analysis
@@ -0,0 +1,313 @@
+#include "udo/CxxUDOCache.hpp"
+#include "udo/CxxUDOConfig.hpp"
+#include "udo/LLVMUtil.hpp"
+#include "udo/Setting.hpp"
+#include "udo/UDORuntime.hpp"
+#include "udo/i18n.hpp"
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA256.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+using namespace std;
+namespace fs = std::filesystem;
+//---------------------------------------------------------------------------
+static const char tc[] = "udo/CxxUDOCache";
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+static Setting<string> cxxUDOCacheDir("cxxUDOCacheDir", "Directory of the persistent cache for compiled C++ UDOs, the cache is disabled if empty", {});
+static Setting<unsigned> cxxUDOCacheLockTimeout("cxxUDOCacheLockTimeout", "The time in milliseconds a process waits for another process that compiles the same C++ UDO before it compiles the UDO itself", 10'000);
+//---------------------------------------------------------------------------
+/// The version of the cache format, must be increased whenever the format of
+/// the entries or the generated code changes in an incompatible way.
+static constexpr uint32_t cacheFormatVersion = 2;
+//---------------------------------------------------------------------------
+/// The magic bytes at the beginning of every cache entry
+static constexpr char cacheMagic[8] = {'U', 'D', 'O', 'C', 'A', 'C', 'H', 'E'};
+//---------------------------------------------------------------------------
+/// The header of a cache entry, the serialized analysis and the object file
+/// follow directly afterwards.
+struct CacheEntryHeader {
+   /// The magic bytes
+   char magic[8];
+   /// The format version
+   uint32_t version;
+   /// Padding, always zero
+   uint32_t padding;
+   /// The size of the serialized analysis
+   uint64_t serializedAnalysisSize;
+   /// The size of the object file
+   uint64_t objectFileSize;
+};
+//---------------------------------------------------------------------------
+namespace {
+//---------------------------------------------------------------------------
+/// Helper to compute the hash of multiple fields
+class KeyHasher {
+   private:
+   /// The hasher
+   llvm::SHA256 hasher;
+
+   public:
+   /// Add a field
+   void add(string_view value) {
+      uint64_t size = value.size();
+      hasher.update(llvm::StringRef(reinterpret_cast<const char*>(&size), sizeof(size)));
+      hasher.update(asStringRef(value));
+   }
+   /// Add a numeric field
+   void add(uint64_t value) {
+      add(string_view(reinterpret_cast<const char*>(&value), sizeof(value)));
+   }
+   /// Get the hex string of the hash
+   string finish() {
+      return llvm::toHex(hasher.final(), true);
+   }
+};
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+/// The keys that are locked by this process. flock() locks are held per open
+/// file, so a process would wait for itself when it locks a key twice.
+static mutex lockedKeysMutex;
+static unordered_set<string> lockedKeys;
+//---------------------------------------------------------------------------
+static fs::path getEntryPath(string_view key)
+// Get the path of a cache entry
+{
+   return fs::path(cxxUDOCacheDir.get()) / (string(key) + ".udo");
+}
+//---------------------------------------------------------------------------
+bool CxxUDOCache::isEnabled()
+// Is the cache enabled, i.e. is a cache directory set?
+{
+   return !cxxUDOCacheDir.get().empty();
+}
+//---------------------------------------------------------------------------
+const string& CxxUDOCache::getDirectory()
+// Get the cache directory, empty if the cache is disabled
+{
+   return cxxUDOCacheDir.get();
+}
+//---------------------------------------------------------------------------
+string CxxUDOCache::computeKey(string_view funcSource, string_view udoClassName, unsigned optimizationLevel, string_view extraKey)
+// Compute the key of a C++ UDO
+{
+   KeyHasher hasher;
+   hasher.add(string_view(cacheMagic, sizeof(cacheMagic)));
+   hasher.add(cacheFormatVersion);
+   hasher.add(LLVM_VERSION_STRING);
+   hasher.add(cxxUDODepsPrefix);
+
+   // The generated code depends on the features of the host CPU
+   hasher.add(asStringView(llvm::sys::getHostCPUName()));
+   if (llvm::StringMap<bool> features; llvm::sys::getHostCPUFeatures(features)) {
+      vector<string_view> enabledFeatures;
+      for (auto& feature : features)
+         if (feature.second)
+            enabledFeatures.push_back(asStringView(feature.first()));
+      sort(enabledFeatures.begin(), enabledFeatures.end());
+      hasher.add(enabledFeatures.size());
+      for (auto feature : enabledFeatures)
+         hasher.add(feature);
+   }
+
+   hasher.add(cxxUDOHeaders.size());
+   for (auto& header : cxxUDOHeaders) {
+      hasher.add(header.filename);
+      hasher.add(header.content);
+   }
+
+   hasher.add(optimizationLevel);
+   hasher.add(udoClassName);
+   hasher.add(funcSource);
+   hasher.add(extraKey);
+
+   return hasher.finish();
+}
+//---------------------------------------------------------------------------
+optional<CxxUDOCache::MappedEntry> CxxUDOCache::lookup(string_view key)
+// Look up an entry, returns nullopt if there is no valid entry
+{
+   if (!isEnabled())
+      return nullopt;
+
+   // Without a null terminator, llvm maps larger files instead of reading them
+   auto bufferOrError = llvm::MemoryBuffer::getFile(getEntryPath(key).string(), false, false);
+   if (!bufferOrError)
+      return nullopt;
+   auto& buffer = *bufferOrError;
+
+   CacheEntryHeader header;
+   if (buffer->getBufferSize() < sizeof(header))
+      return nullopt;
+   memcpy(&header, buffer->getBufferStart(), sizeof(header));
+   if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheFormatVersion)
+      return nullopt;
+   if (buffer->getBufferSize() - sizeof(header) != header.serializedAnalysisSize + header.objectFileSize)
+      return nullopt;
+
+   auto* analysisBegin = buffer->getBufferStart() + sizeof(header);
+   auto* objectFileBegin = analysisBegin + header.serializedAnalysisSize;
+
+   MappedEntry entry;
+   entry.serializedAnalysis = span(analysisBegin, header.serializedAnalysisSize);
+   entry.objectFile = span(objectFileBegin, header.objectFileSize);
+   entry.mapping = shared_ptr<const llvm::MemoryBuffer>(move(buffer));
+   return entry;
+}
+//---------------------------------------------------------------------------
+CxxUDOCache::EntryLock& CxxUDOCache::EntryLock::operator=(EntryLock&& other) noexcept
+// Move assignment
+{
+   if (this != &other) {
+      unlock();
+      fd = other.fd;
+      key = move(other.key);
+      other.fd = -1;
+   }
+   return *this;
+}
+//---------------------------------------------------------------------------
+void CxxUDOCache::EntryLock::unlock()
+// Release the lock
+{
+   if (fd >= 0) {
+      // Closing the file releases the lock
+      ::close(fd);
+      fd = -1;
+      unique_lock lockedKeysLock(lockedKeysMutex);
+      lockedKeys.erase(key);
+   }
+}
+//---------------------------------------------------------------------------
+CxxUDOCache::EntryLock CxxUDOCache::lockEntry(string_view key)
+// Lock a key, waits at most cxxUDOCacheLockTimeout milliseconds
+{
+   EntryLock lock;
+   if (!isEnabled())
+      return lock;
+
+   {
+      unique_lock lockedKeysLock(lockedKeysMutex);
+      if (!lockedKeys.emplace(key).second)
+         return lock;
+   }
+   auto releaseKey = [&] {
+      unique_lock lockedKeysLock(lockedKeysMutex);
+      lockedKeys.erase(string(key));
+   };
+
+   // The lock files are never removed, as another process could lock a file
+   // that was just unlinked otherwise
+   auto path = getEntryPath(key);
+   path += ".lock";
+   error_code ec;
+   fs::create_directories(path.parent_path(), ec);
+   int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      releaseKey();
+      return lock;
+   }
+
+   // flock() cannot wait with a timeout, so it is polled instead
+   auto deadline = chrono::steady_clock::now() + chrono::milliseconds(cxxUDOCacheLockTimeout.get());
+   while (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      if ((errno != EWOULDBLOCK && errno != EINTR) || chrono::steady_clock::now() >= deadline) {
+         ::close(fd);
+         releaseKey();
+         return lock;
+      }
+      this_thread::sleep_for(chrono::milliseconds(10));
+   }
+
+   lock.fd = fd;
+   lock.key = key;
+   return lock;
+}
+//---------------------------------------------------------------------------
+static tl::expected<void, string> writeFile(const fs::path& path, initializer_list<string_view> parts)
+// Write a file in the cache directory
+{
+   error_code ec;
+   fs::create_directories(path.parent_path(), ec);
+   if (ec)
+      return tl::unexpected(trformat(tc, "could not create the C++ UDO cache directory: {0}", ec.message()));
+
+   // Write to a temporary file first and rename it afterwards, so that
+   // concurrent readers never see a partially written file.
+   static atomic<uint64_t> tmpCounter = 0;
+   auto tmpPath = path;
+   tmpPath += ".tmp." + to_string(getpid()) + "." + to_string(tmpCounter.fetch_add(1));
+
+   {
+      ofstream output(tmpPath, ios::binary | ios::trunc);
+      for (auto part : parts)
+         output.write(part.data(), part.size());
+      output.close();
+      if (!output) {
+         fs::remove(tmpPath, ec);
+         return tl::unexpected(string(tr(tc, "could not write C++ UDO cache entry")));
+      }
+   }
+
+   fs::rename(tmpPath, path, ec);
+   if (ec) {
+      fs::remove(tmpPath, ec);
+      return tl::unexpected(trformat(tc, "could not write C++ UDO cache entry: {0}", ec.message()));
+   }
+
+   return {};
+}
+//---------------------------------------------------------------------------
+tl::expected<void, string> CxxUDOCache::store(string_view key, const Entry& entry)
+// Store an entry
+{
+   if (!isEnabled())
+      return {};
+
+   CacheEntryHeader header{};
+   memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+   header.version = cacheFormatVersion;
+   header.serializedAnalysisSize = entry.serializedAnalysis.size();
+   header.objectFileSize = entry.objectFile.size();
+
+   string_view headerData(reinterpret_cast<const char*>(&header), sizeof(header));
+   string_view serializedAnalysis(entry.serializedAnalysis.data(), entry.serializedAnalysis.size());
+   string_view objectFile(entry.objectFile.data(), entry.objectFile.size());
+   return writeFile(getEntryPath(key), {headerData, serializedAnalysis, objectFile});
+}
+//---------------------------------------------------------------------------
+tl::expected<void, string> CxxUDOCache::storeFile(string_view filename, span<const char> data)
+// Store an arbitrary file in the cache directory
+{
+   if (!isEnabled())
+      return {};
+
+   return writeFile(fs::path(cxxUDOCacheDir.get()) / filename, {string_view(data.data(), data.size())});
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,94 @@
+#ifndef H_udo_CxxUDOCache
+#define H_udo_CxxUDOCache
+//---------------------------------------------------------------------------
+#include "thirdparty/tl/expected.hpp"
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+/// A persistent cache for compiled C++ UDOs. The entries are addressed by a
+/// hash of everything that influences the generated code, so a UDO that was
+/// compiled once can be linked directly without invoking clang and llvm. The
+/// cache directory can be shared by several processes, e.g. all backends of
+/// a database, which then compile every UDO only once.
+class CxxUDOCache {
+   public:
+   /// An entry of the cache
+   struct Entry {
+      /// The analysis as returned by `CxxUDOAnalyzer::getSerializedAnalysis()`
+      std::vector<char> serializedAnalysis;
+      /// The object file as returned by `CxxUDOCompiler::compile()`
+      std::vector<char> objectFile;
+   };
+   /// An entry that was found in the cache. Its file is mapped read-only, the
+   /// spans are valid as long as the mapping exists.
+   struct MappedEntry {
+      /// The mapping of the file
+      std::shared_ptr<const void> mapping;
+      /// The analysis as returned by `CxxUDOAnalyzer::getSerializedAnalysis()`
+      std::span<const char> serializedAnalysis;
+      /// The object file as returned by `CxxUDOCompiler::compile()`
+      std::span<const char> objectFile;
+   };
+   /// An exclusive lock of a key that is shared by all processes that use the
+   /// cache directory. A process holds it while it compiles the UDO for the
+   /// key, so that the other processes wait for the entry instead of
+   /// compiling the UDO as well.
+   class EntryLock {
+      private:
+      friend CxxUDOCache;
+
+      /// The file descriptor of the locked file, -1 if not locked
+      int fd = -1;
+      /// The locked key
+      std::string key;
+
+      public:
+      /// Constructor
+      EntryLock() = default;
+      /// Move constructor
+      EntryLock(EntryLock&& other) noexcept : fd(other.fd), key(std::move(other.key)) { other.fd = -1; }
+      /// Move assignment
+      EntryLock& operator=(EntryLock&& other) noexcept;
+      /// Destructor
+      ~EntryLock() { unlock(); }
+
+      /// Is the key locked?
+      bool isLocked() const { return fd >= 0; }
+      /// Release the lock
+      void unlock();
+   };
+
+   /// Is the cache enabled, i.e. is a cache directory set?
+   static bool isEnabled();
+   /// Get the cache directory, empty if the cache is disabled
+   static const std::string& getDirectory();
+   /// Compute the key of a C++ UDO. `extraKey` can be used to add additional
+   /// data that influences the compilation.
+   static std::string computeKey(std::string_view funcSource, std::string_view udoClassName, unsigned optimizationLevel, std::string_view extraKey = {});
+
+   /// Look up an entry, returns nullopt if there is no valid entry
+   static std::optional<MappedEntry> lookup(std::string_view key);
+   /// Lock a key, waits at most cxxUDOCacheLockTimeout milliseconds for
+   /// another process that holds the lock. The returned lock is not locked if
+   /// the cache is disabled, the lock could not be acquired, or the key is
+   /// already locked by this process.
+   static EntryLock lockEntry(std::string_view key);
+   /// Store an entry
+   static tl::expected<void, std::string> store(std::string_view key, const Entry& entry);
+   /// Store an arbitrary file in the cache directory, e.g. an index that is
+   /// derived from files that are expensive to parse
+   static tl::expected<void, std::string> storeFile(std::string_view filename, std::span<const char> data);
+};
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+#endif
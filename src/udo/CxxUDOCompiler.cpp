@@ -4,7 +4,10 @@
 #include "udo/LLVMCompiler.hpp"
 #include "udo/LLVMUtil.hpp"
 #include "udo/Setting.hpp"
+#include "udo/UDOStats.hpp"
 #include "udo/i18n.hpp"
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
@@ -15,21 +18,31 @@
 #include <llvm/IR/Constant.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/GlobalAlias.h>
 #include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
 #include <llvm/Object/Archive.h>
 #include <llvm/Option/ArgList.h>
 #include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MathExtras.h>
 #include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/SmallVectorMemoryBuffer.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <fstream>
 #include <string_view>
+#include <utility>
 #include <vector>
 //---------------------------------------------------------------------------
 // UDO runtime
@@ -50,6 +63,9 @@ static constexpr unsigned defaultOptLevel = 3;
 #endif
 //---------------------------------------------------------------------------
 static Setting<unsigned> cxxUDOOptLevel("cxxUDOOptLevel", "The optimization level used for C++ UDOs", defaultOptLevel);
+static Setting<bool> cxxUDOTieredCompilation("cxxUDOTieredCompilation", "Compile C++ UDOs with cxxUDOFirstTierOptLevel first and switch to the code compiled with cxxUDOOptLevel in the background once it is ready", false);
+static Setting<unsigned> cxxUDOEmitBatchSize("cxxUDOEmitBatchSize", "The number of output tuples that C++ UDOs buffer per thread before they are passed to the host in one call, 0 passes every tuple on its own. The buffer is stored in the TLS block of the UDO.", 0);
+static Setting<unsigned> cxxUDOFirstTierOptLevel("cxxUDOFirstTierOptLevel", "The optimization level of the first tier when cxxUDOTieredCompilation is enabled", 0);
 //---------------------------------------------------------------------------
 unsigned CxxUDOCompiler::getOptLevel()
 // Get the optimization level that is used for C++ UDOs
@@ -57,9 +73,234 @@ unsigned CxxUDOCompiler::getOptLevel()
    return cxxUDOOptLevel.get();
 }
 //---------------------------------------------------------------------------
+bool CxxUDOCompiler::isTieredCompilationEnabled()
+// Is tiered compilation enabled?
+{
+   return cxxUDOTieredCompilation.get() && cxxUDOFirstTierOptLevel.get() < cxxUDOOptLevel.get();
+}
+//---------------------------------------------------------------------------
+unsigned CxxUDOCompiler::getFirstTierOptLevel()
+// Get the optimization level of the first tier
+{
+   return cxxUDOFirstTierOptLevel.get();
+}
+//---------------------------------------------------------------------------
+unsigned CxxUDOCompiler::getEmitBatchSize()
+// Get the number of output tuples that are buffered before they are emitted
+{
+   return cxxUDOEmitBatchSize.get();
+}
+//---------------------------------------------------------------------------
+namespace {
+//---------------------------------------------------------------------------
+/// The offset of an access to the UDO object that is not constant
+constexpr uint64_t unknownOffset = ~uint64_t(0);
+//---------------------------------------------------------------------------
+/// The accesses to the UDO object in a function
+struct ObjectAccesses {
+   /// A load or store at a constant offset
+   struct Access {
+      /// The instruction
+      llvm::Instruction* inst;
+      /// The offset in the object
+      uint64_t offset;
+      /// The size of the access
+      uint64_t size;
+   };
+
+   /// The loads
+   vector<Access> loads;
+   /// The stores
+   vector<Access> stores;
+   /// The ranges that may be written otherwise as pairs of offset and size
+   vector<pair<uint64_t, uint64_t>> clobbers;
+   /// Does the pointer to the object escape?
+   bool escapes = false;
+
+   /// Collect the accesses through the pointer to the object
+   void collect(llvm::Value* objectPtr, const llvm::DataLayout& dataLayout, uint64_t objectSize);
+   /// May the range be written by any access other than `except`?
+   bool isWritten(uint64_t offset, uint64_t size, const llvm::Instruction* except = nullptr) const;
+};
+//---------------------------------------------------------------------------
+void ObjectAccesses::collect(llvm::Value* objectPtr, const llvm::DataLayout& dataLayout, uint64_t objectSize)
+// Collect the accesses through the pointer to the object
+{
+   llvm::SmallVector<pair<llvm::Value*, uint64_t>, 16> worklist;
+   worklist.emplace_back(objectPtr, 0);
+   while (!worklist.empty() && !escapes) {
+      auto [ptr, offset] = worklist.pop_back_val();
+      for (auto* user : ptr->users()) {
+         if (auto* load = llvm::dyn_cast<llvm::LoadInst>(user)) {
+            if (!load->isSimple()) {
+               escapes = true;
+            } else if (offset != unknownOffset) {
+               loads.push_back({load, offset, dataLayout.getTypeStoreSize(load->getType()).getFixedSize()});
+            }
+         } else if (auto* store = llvm::dyn_cast<llvm::StoreInst>(user)) {
+            if (store->getValueOperand() == ptr || !store->isSimple()) {
+               escapes = true;
+            } else if (offset == unknownOffset) {
+               clobbers.emplace_back(0, objectSize);
+            } else {
+               stores.push_back({store, offset, dataLayout.getTypeStoreSize(store->getValueOperand()->getType()).getFixedSize()});
+            }
+         } else if (auto* gep = llvm::dyn_cast<llvm::GEPOperator>(user)) {
+            llvm::APInt gepOffset(dataLayout.getIndexTypeSizeInBits(gep->getType()), 0);
+            if (offset == unknownOffset || !gep->accumulateConstantOffset(dataLayout, gepOffset) || gepOffset.isNegative())
+               worklist.emplace_back(gep, unknownOffset);
+            else
+               worklist.emplace_back(gep, offset + gepOffset.getZExtValue());
+         } else if (llvm::isa<llvm::BitCastOperator>(user)) {
+            worklist.emplace_back(user, offset);
+         } else if (auto* call = llvm::dyn_cast<llvm::CallBase>(user)) {
+            if (call->isLifetimeStartOrEnd() || call->onlyReadsMemory())
+               continue;
+            // A pointer to a member only allows modifying the member, so the
+            // called function may write everything behind the offset.
+            if (offset == unknownOffset)
+               clobbers.emplace_back(0, objectSize);
+            else if (offset < objectSize)
+               clobbers.emplace_back(offset, objectSize - offset);
+         } else if (!llvm::isa<llvm::ICmpInst>(user)) {
+            escapes = true;
+         }
+         if (escapes)
+            break;
+      }
+   }
+}
+//---------------------------------------------------------------------------
+bool ObjectAccesses::isWritten(uint64_t offset, uint64_t size, const llvm::Instruction* except) const
+// May the range be written by any access other than `except`?
+{
+   if (escapes)
+      return true;
+
+   auto overlaps = [&](uint64_t otherOffset, uint64_t otherSize) {
+      return otherOffset < offset + size && offset < otherOffset + otherSize;
+   };
+   for (auto& store : stores)
+      if (store.inst != except && overlaps(store.offset, store.size))
+         return true;
+   for (auto& [clobberOffset, clobberSize] : clobbers)
+      if (overlaps(clobberOffset, clobberSize))
+         return true;
+
+   return false;
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+static void propagateConstantMembers(llvm::Function& constructor, span<llvm::Function* const> entryFunctions, const llvm::DataLayout& dataLayout, uint64_t objectSize)
+// Replace the loads of members in the entry functions of the UDO by the
+// constants that the constructor stores in the members
+{
+   if (constructor.isDeclaration() || constructor.arg_empty())
+      return;
+
+   ObjectAccesses constructorAccesses;
+   constructorAccesses.collect(constructor.getArg(0), dataLayout, objectSize);
+   if (constructorAccesses.escapes)
+      return;
+
+   vector<ObjectAccesses> entryAccesses(entryFunctions.size());
+   for (size_t i = 0; i < entryFunctions.size(); ++i) {
+      auto* func = entryFunctions[i];
+      if (!func || func->isDeclaration() || func->arg_empty())
+         continue;
+      entryAccesses[i].collect(func->getArg(0), dataLayout, objectSize);
+      if (entryAccesses[i].escapes)
+         return;
+   }
+
+   // A member is constant if the constructor always stores the same constant
+   // in it and it is not written anywhere else
+   llvm::DominatorTree dominatorTree(constructor);
+   llvm::SmallVector<llvm::ReturnInst*, 4> returns;
+   for (auto& bb : constructor)
+      if (auto* ret = llvm::dyn_cast<llvm::ReturnInst>(bb.getTerminator()))
+         returns.push_back(ret);
+   if (returns.empty())
+      return;
+
+   for (auto& store : constructorAccesses.stores) {
+      auto* storeInst = llvm::cast<llvm::StoreInst>(store.inst);
+      auto* value = llvm::dyn_cast<llvm::Constant>(storeInst->getValueOperand());
+      if (!value)
+         continue;
+      if (!all_of(returns.begin(), returns.end(), [&](auto* ret) { return dominatorTree.dominates(storeInst, ret); }))
+         continue;
+      if (constructorAccesses.isWritten(store.offset, store.size, storeInst))
+         continue;
+      if (any_of(entryAccesses.begin(), entryAccesses.end(), [&](auto& accesses) { return accesses.isWritten(store.offset, store.size); }))
+         continue;
+
+      for (auto& accesses : entryAccesses) {
+         for (auto& load : accesses.loads) {
+            if (load.offset == store.offset && load.inst->getType() == value->getType()) {
+               load.inst->replaceAllUsesWith(value);
+               load.inst->eraseFromParent();
+            }
+         }
+      }
+   }
+}
+//---------------------------------------------------------------------------
+static void markHotFunctions(llvm::Module& module, span<llvm::Function* const> entryFunctions)
+// Mark the functions that are reachable from the entry functions as hot and
+// all others as unlikely, so that the code generator places them in
+// .text.hot and .text.unlikely sections
+{
+   llvm::SmallPtrSet<const llvm::Function*, 32> hotFunctions;
+   llvm::SmallPtrSet<const llvm::Constant*, 32> visitedConstants;
+   llvm::SmallVector<const llvm::Function*, 32> worklist;
+
+   auto addFunction = [&](const llvm::Function* function) {
+      if (function && !function->isDeclaration() && hotFunctions.insert(function).second)
+         worklist.push_back(function);
+   };
+   // Functions are also reachable through constants, e.g. vtables
+   auto visitConstant = [&](auto& self, const llvm::Constant* constant) -> void {
+      if (!visitedConstants.insert(constant).second)
+         return;
+      if (auto* function = llvm::dyn_cast<llvm::Function>(constant)) {
+         addFunction(function);
+      } else if (auto* globalVariable = llvm::dyn_cast<llvm::GlobalVariable>(constant)) {
+         if (globalVariable->hasInitializer())
+            self(self, globalVariable->getInitializer());
+      } else if (auto* alias = llvm::dyn_cast<llvm::GlobalAlias>(constant)) {
+         self(self, alias->getAliasee());
+      } else if (!llvm::isa<llvm::GlobalValue>(constant)) {
+         for (auto& operand : constant->operands())
+            if (auto* operandConstant = llvm::dyn_cast<llvm::Constant>(operand.get()))
+               self(self, operandConstant);
+      }
+   };
+
+   for (auto* function : entryFunctions)
+      addFunction(function);
+   if (hotFunctions.empty())
+      return;
+
+   while (!worklist.empty()) {
+      auto* function = worklist.pop_back_val();
+      for (auto& bb : *function)
+         for (auto& inst : bb)
+            for (auto& operand : inst.operands())
+               if (auto* constant = llvm::dyn_cast<llvm::Constant>(operand.get()))
+                  visitConstant(visitConstant, constant);
+   }
+
+   for (auto& function : module)
+      if (!function.isDeclaration() && !function.hasSection())
+         function.setSectionPrefix(hotFunctions.count(&function) ? "hot" : "unlikely");
+}
+//---------------------------------------------------------------------------
 static llvm::SmallVector<char, 0> compileModule(llvm::TargetMachine& targetMachine, llvm::Module& module)
 // Compile an llvm module to an object file
 {
+   UDOStats::PhaseTimer timer(UDOPhase::CompileModule);
    llvm::legacy::PassManager passManager;
 
    llvm::SmallVector<char, 0> objectFileBuffer;
@@ -75,7 +316,265 @@ static llvm::SmallVector<char, 0> compileModule(llvm::TargetMachine& targetMachi
    return objectFileBuffer;
 }
 //---------------------------------------------------------------------------
-tl::expected<CxxUDOLLVMFunctions, string> CxxUDOCompiler::preprocessModule()
+static bool haveSameLayout(llvm::StructType* type1, llvm::StructType* type2, const llvm::DataLayout& dataLayout)
+// Check if two tuple types have the same attributes at the same offsets
+{
+   if (type1 == type2)
+      return true;
+   if (type1->getNumElements() != type2->getNumElements())
+      return false;
+
+   auto* layout1 = dataLayout.getStructLayout(type1);
+   auto* layout2 = dataLayout.getStructLayout(type2);
+   for (unsigned i = 0; i < type1->getNumElements(); ++i) {
+      auto* elementType1 = type1->getElementType(i);
+      auto* elementType2 = type2->getElementType(i);
+      if (layout1->getElementOffset(i) != layout2->getElementOffset(i))
+         return false;
+      if (elementType1->getTypeID() != elementType2->getTypeID() || dataLayout.getTypeStoreSize(elementType1) != dataLayout.getTypeStoreSize(elementType2))
+         return false;
+      if (elementType1->isIntegerTy() && elementType1->getIntegerBitWidth() != elementType2->getIntegerBitWidth())
+         return false;
+   }
+   return true;
+}
+//---------------------------------------------------------------------------
+tl::expected<void, string> CxxUDOCompiler::fuseConsumer(CxxUDOAnalyzer& consumer, unsigned stage)
+// Link the module of a UDO that consumes the output of this UDO into the module
+{
+   auto& analysis = analyzer.getAnalysis();
+   auto& module = analyzer.getModule();
+   auto& context = module.getContext();
+   auto& dataLayout = module.getDataLayout();
+   auto& consumerAnalysis = consumer.getAnalysis();
+
+   if (!consumerAnalysis.accept && !consumerAnalysis.acceptBatch)
+      return tl::unexpected(trformat(tc, "C++ UDO {0} has no table input and cannot consume the output of another UDO", consumerAnalysis.name));
+   if (consumerAnalysis.extraWork || consumerAnalysis.process)
+      return tl::unexpected(trformat(tc, "C++ UDO {0} cannot be fused into a pipeline because it has an extraWork or process function", consumerAnalysis.name));
+
+   auto* voidType = llvm::Type::getVoidTy(context);
+   auto* voidPtr = llvm::Type::getInt8PtrTy(context);
+   auto prefix = "udo.CxxUDO.Stage" + to_string(stage) + ".";
+
+   // Copy the module of the consumer and give the functions that are needed
+   // unique names, so that they can be found again after linking
+   vector<char> consumerBitcode;
+   {
+      llvm::ValueToValueMapTy valueMap;
+      auto consumerModule = llvm::CloneModule(consumer.getModule(), valueMap);
+
+      auto renameFunction = [&](llvm::Function* func, string_view name) {
+         if (!func)
+            return;
+         auto* clone = llvm::cast<llvm::Function>(valueMap[func]);
+         clone->setName(prefix + string(name));
+         clone->setComdat(nullptr);
+         if (!clone->isDeclaration())
+            clone->setLinkage(llvm::GlobalValue::ExternalLinkage);
+      };
+      renameFunction(consumerAnalysis.globalConstructor, "globalConstructor");
+      renameFunction(consumerAnalysis.globalDestructor, "globalDestructor");
+      renameFunction(consumerAnalysis.emit, "emit");
+      renameFunction(consumerAnalysis.constructor, "constructor");
+      renameFunction(consumerAnalysis.destructor, "destructor");
+      renameFunction(consumerAnalysis.accept, "accept");
+      renameFunction(consumerAnalysis.acceptBatch, "acceptBatch");
+
+      // The linker may map the types of the consumer to other types, so they
+      // are passed to a declaration that is removed after linking
+      llvm::SmallVector<llvm::Type*, 3> typeParams{consumerAnalysis.inputTupleType->getPointerTo(), consumerAnalysis.outputTupleType->getPointerTo()};
+      typeParams.push_back(consumerAnalysis.stringType ? consumerAnalysis.stringType->getPointerTo() : voidPtr);
+      llvm::Function::Create(llvm::FunctionType::get(voidType, typeParams, false), llvm::Function::ExternalLinkage, prefix + "types", *consumerModule);
+
+      llvm::SmallVector<char, 1> llvmBuffer;
+      llvm::raw_svector_ostream stream(llvmBuffer);
+      llvm::WriteBitcodeToFile(*consumerModule, stream);
+      consumerBitcode.assign(llvmBuffer.begin(), llvmBuffer.end());
+   }
+
+   llvm::MemoryBufferRef bufferRef(llvm::StringRef(consumerBitcode.data(), consumerBitcode.size()), "udo.CxxUDO.Stage");
+   auto consumerModuleOrError = llvm::parseBitcodeFile(bufferRef, context);
+   if (!consumerModuleOrError)
+      return tl::unexpected(trformat(tc, "invalid bitcode of C++ UDO {0}: {1}", consumerAnalysis.name, llvm::toString(consumerModuleOrError.takeError())));
+   auto consumerModule = move(consumerModuleOrError.get());
+   consumerModule->setDataLayout(dataLayout);
+   consumerModule->setTargetTriple(module.getTargetTriple());
+
+   if (llvm::Linker::linkModules(module, move(consumerModule)))
+      return tl::unexpected(trformat(tc, "could not link C++ UDO {0} into the pipeline", consumerAnalysis.name));
+
+   auto getFunction = [&](llvm::Function* original, string_view name) -> llvm::Function* {
+      if (!original)
+         return nullptr;
+      auto* func = module.getFunction(prefix + string(name));
+      if (!func->isDeclaration())
+         func->setLinkage(llvm::GlobalValue::InternalLinkage);
+      return func;
+   };
+   auto* globalConstructor = getFunction(consumerAnalysis.globalConstructor, "globalConstructor");
+   auto* globalDestructor = getFunction(consumerAnalysis.globalDestructor, "globalDestructor");
+   auto* emit = getFunction(consumerAnalysis.emit, "emit");
+   auto* constructor = getFunction(consumerAnalysis.constructor, "constructor");
+   auto* destructor = getFunction(consumerAnalysis.destructor, "destructor");
+   auto* accept = getFunction(consumerAnalysis.accept, "accept");
+   auto* acceptBatch = getFunction(consumerAnalysis.acceptBatch, "acceptBatch");
+
+   llvm::StructType* inputTupleType;
+   llvm::StructType* outputTupleType;
+   llvm::Type* stringType = nullptr;
+   {
+      auto* typesFunc = module.getFunction(prefix + "types");
+      auto* typesFuncType = typesFunc->getFunctionType();
+      inputTupleType = llvm::dyn_cast<llvm::StructType>(typesFuncType->getParamType(0)->getPointerElementType());
+      outputTupleType = llvm::dyn_cast<llvm::StructType>(typesFuncType->getParamType(1)->getPointerElementType());
+      if (consumerAnalysis.stringType)
+         stringType = typesFuncType->getParamType(2)->getPointerElementType();
+      typesFunc->eraseFromParent();
+   }
+
+   auto* producerOutputType = llvm::dyn_cast<llvm::StructType>(analysis.outputTupleType);
+   if (!producerOutputType || !inputTupleType || !haveSameLayout(producerOutputType, inputTupleType, dataLayout))
+      return tl::unexpected(trformat(tc, "the output of C++ UDO {0} does not match the input of C++ UDO {1}", analysis.name, consumerAnalysis.name));
+   if (!outputTupleType || outputTupleType->getNumElements() != consumerAnalysis.output.size())
+      return tl::unexpected(trformat(tc, "unsupported output of C++ UDO {0} in a pipeline", consumerAnalysis.name));
+   if (stringType && analysis.stringType && stringType != analysis.stringType)
+      return tl::unexpected(string(tr(tc, "the string types of the C++ UDOs in the pipeline do not match")));
+
+   auto castArgs = [](llvm::IRBuilder<>& builder, llvm::Function* callee, llvm::SmallVectorImpl<llvm::Value*>& args) {
+      for (unsigned i = 0; i < args.size(); ++i)
+         if (args[i]->getType() != callee->getFunctionType()->getParamType(i))
+            args[i] = builder.CreateBitCast(args[i], callee->getFunctionType()->getParamType(i));
+   };
+
+   // The object of the consumer is stored behind the object of this UDO. Its
+   // address is stored in a global variable, so that emit can pass it to
+   // accept of the consumer.
+   auto consumerOffset = llvm::alignTo(analysis.size, consumerAnalysis.alignment);
+   auto* consumerObjectVar = new llvm::GlobalVariable(module, voidPtr, false, llvm::GlobalValue::InternalLinkage, llvm::ConstantPointerNull::get(voidPtr), prefix + "object");
+
+   // Let emit of this UDO call accept of the consumer
+   {
+      if ((accept ? accept->arg_size() : acceptBatch->arg_size() - 1) != analysis.emit->arg_size() + 1)
+         return tl::unexpected(trformat(tc, "invalid accept function of C++ UDO {0} in a pipeline", consumerAnalysis.name));
+
+      auto* bb = llvm::BasicBlock::Create(context, "init", analysis.emit);
+      llvm::IRBuilder<> builder(bb);
+
+      llvm::SmallVector<llvm::Value*, 8> args;
+      args.push_back(builder.CreateLoad(voidPtr, consumerObjectVar));
+      for (auto& arg : analysis.emit->args())
+         args.push_back(&arg);
+      if (accept) {
+         castArgs(builder, accept, args);
+         builder.CreateCall(accept, args);
+      } else {
+         args.push_back(builder.getInt64(1));
+         castArgs(builder, acceptBatch, args);
+         builder.CreateCall(acceptBatch, args);
+      }
+      builder.CreateRetVoid();
+
+      analysis.emit->setLinkage(llvm::GlobalValue::InternalLinkage);
+   }
+
+   // Generate a constructor that takes the arguments of both UDOs and
+   // constructs both objects
+   llvm::Function* pipelineConstructor;
+   {
+      llvm::SmallVector<llvm::Type*, 8> paramTypes{voidPtr};
+      llvm::SmallVector<llvm::AttributeSet, 8> paramAttrs{llvm::AttributeSet()};
+      auto addParams = [&](llvm::Function* func) {
+         if (!func)
+            return;
+         for (unsigned i = 1; i < func->arg_size(); ++i) {
+            paramTypes.push_back(func->getFunctionType()->getParamType(i));
+            paramAttrs.push_back(func->getAttributes().getParamAttrs(i));
+         }
+      };
+      addParams(analysis.constructor);
+      addParams(constructor);
+
+      auto* constructorType = llvm::FunctionType::get(voidType, paramTypes, false);
+      pipelineConstructor = llvm::Function::Create(constructorType, llvm::Function::ExternalLinkage, prefix + "pipelineConstructor", module);
+      pipelineConstructor->setAttributes(llvm::AttributeList::get(context, llvm::AttributeSet(), llvm::AttributeSet(), paramAttrs));
+
+      auto* bb = llvm::BasicBlock::Create(context, "init", pipelineConstructor);
+      llvm::IRBuilder<> builder(bb);
+
+      auto argIt = pipelineConstructor->arg_begin();
+      auto* object = &*argIt;
+      ++argIt;
+      auto callConstructor = [&](llvm::Function* func, llvm::Value* funcObject) {
+         if (!func)
+            return;
+         llvm::SmallVector<llvm::Value*, 8> args{funcObject};
+         for (unsigned i = 1; i < func->arg_size(); ++i, ++argIt)
+            args.push_back(&*argIt);
+         castArgs(builder, func, args);
+         builder.CreateCall(func, args)->setAttributes(func->getAttributes());
+      };
+      callConstructor(analysis.constructor, object);
+      auto* consumerObject = builder.CreateConstInBoundsGEP1_64(builder.getInt8Ty(), object, consumerOffset);
+      builder.CreateStore(consumerObject, consumerObjectVar);
+      callConstructor(constructor, consumerObject);
+      builder.CreateRetVoid();
+   }
+
+   // Generate a destructor that destroys both objects
+   llvm::Function* pipelineDestructor = nullptr;
+   if (analysis.destructor || destructor) {
+      auto* destructorType = llvm::FunctionType::get(voidType, {voidPtr}, false);
+      pipelineDestructor = llvm::Function::Create(destructorType, llvm::Function::ExternalLinkage, prefix + "pipelineDestructor", module);
+
+      auto* bb = llvm::BasicBlock::Create(context, "init", pipelineDestructor);
+      llvm::IRBuilder<> builder(bb);
+
+      auto* object = &*pipelineDestructor->arg_begin();
+      auto callDestructor = [&](llvm::Function* func, llvm::Value* funcObject) {
+         if (!func)
+            return;
+         llvm::SmallVector<llvm::Value*, 1> args{funcObject};
+         castArgs(builder, func, args);
+         builder.CreateCall(func, args);
+      };
+      callDestructor(destructor, builder.CreateConstInBoundsGEP1_64(builder.getInt8Ty(), object, consumerOffset));
+      callDestructor(analysis.destructor, object);
+      builder.CreateRetVoid();
+   }
+
+   // Call the static initializers and finalizers of both modules
+   auto combineGlobalFunctions = [&](llvm::Function* first, llvm::Function* second, string_view name) -> llvm::Function* {
+      if (!first || !second)
+         return first ? first : second;
+
+      auto* func = llvm::Function::Create(llvm::FunctionType::get(voidType, {}, false), llvm::Function::InternalLinkage, prefix + string(name), module);
+      auto* bb = llvm::BasicBlock::Create(context, "init", func);
+      llvm::IRBuilder<> builder(bb);
+      builder.CreateCall(first, {});
+      builder.CreateCall(second, {});
+      builder.CreateRetVoid();
+      return func;
+   };
+
+   analysis.globalConstructor = combineGlobalFunctions(analysis.globalConstructor, globalConstructor, "pipelineGlobalConstructor");
+   analysis.globalDestructor = combineGlobalFunctions(globalDestructor, analysis.globalDestructor, "pipelineGlobalDestructor");
+   analysis.constructor = pipelineConstructor;
+   analysis.destructor = pipelineDestructor;
+   analysis.emit = emit;
+   analysis.outputTupleType = outputTupleType;
+   analysis.output.clear();
+   for (unsigned i = 0; i < outputTupleType->getNumElements(); ++i)
+      analysis.output.push_back({consumerAnalysis.output[i].name, outputTupleType->getElementType(i)});
+   if (!analysis.stringType)
+      analysis.stringType = stringType;
+   analysis.size = consumerOffset + consumerAnalysis.size;
+   analysis.alignment = max(analysis.alignment, consumerAnalysis.alignment);
+
+   return {};
+}
+//---------------------------------------------------------------------------
+tl::expected<CxxUDOLLVMFunctions, string> CxxUDOCompiler::preprocessModule(uint64_t outputMask, unsigned emitBatchSize)
 // Preprocess the llvm module by creating all special extra functions that
 // are used by the UDO execution.
 {
@@ -93,6 +592,7 @@ tl::expected<CxxUDOLLVMFunctions, string> CxxUDOCompiler::preprocessModule()
    functions.destructor = analysis.destructor;
    functions.emit = analysis.emit;
    functions.accept = analysis.accept;
+   functions.acceptBatch = analysis.acceptBatch;
    functions.extraWork = analysis.extraWork;
    functions.process = analysis.process;
 
@@ -105,10 +605,68 @@ tl::expected<CxxUDOLLVMFunctions, string> CxxUDOCompiler::preprocessModule()
    N(destructor)
    N(emit)
    N(accept)
+   N(acceptBatch)
    N(extraWork)
    N(process)
 #undef N
 
+   // Generate the accept function that is missing. The batch accept gets the
+   // same arguments as accept but a pointer to the first tuple and the number
+   // of tuples instead of a pointer to a single tuple.
+   if (functions.accept && !functions.acceptBatch) {
+      // Loop over the tuples and call accept for each of them, so that accept
+      // can be inlined into the loop.
+      auto* acceptType = functions.accept->getFunctionType();
+      llvm::SmallVector<llvm::Type*, 8> paramTypes(acceptType->param_begin(), acceptType->param_end());
+      paramTypes.push_back(llvm::Type::getInt64Ty(context));
+      auto* acceptBatchType = llvm::FunctionType::get(acceptType->getReturnType(), paramTypes, false);
+      auto* acceptBatch = llvm::Function::Create(acceptBatchType, llvm::Function::ExternalLinkage, asStringRef(acceptBatchName), module);
+
+      auto* entryBB = llvm::BasicBlock::Create(context, "entry", acceptBatch);
+      auto* loopBB = llvm::BasicBlock::Create(context, "loop", acceptBatch);
+      auto* exitBB = llvm::BasicBlock::Create(context, "exit", acceptBatch);
+      llvm::IRBuilder<> builder(entryBB);
+
+      llvm::SmallVector<llvm::Value*, 8> args;
+      for (auto& arg : acceptBatch->args())
+         args.push_back(&arg);
+      auto* numTuples = args.pop_back_val();
+      auto* tuples = args.pop_back_val();
+      builder.CreateCondBr(builder.CreateICmpEQ(numTuples, builder.getInt64(0)), exitBB, loopBB);
+
+      builder.SetInsertPoint(loopBB);
+      auto* index = builder.CreatePHI(builder.getInt64Ty(), 2);
+      index->addIncoming(builder.getInt64(0), entryBB);
+      args.push_back(builder.CreateInBoundsGEP(analysis.inputTupleType, tuples, index));
+      builder.CreateCall(functions.accept, args);
+      auto* nextIndex = builder.CreateAdd(index, builder.getInt64(1));
+      index->addIncoming(nextIndex, loopBB);
+      builder.CreateCondBr(builder.CreateICmpEQ(nextIndex, numTuples), exitBB, loopBB);
+
+      builder.SetInsertPoint(exitBB);
+      builder.CreateRetVoid();
+
+      functions.acceptBatch = acceptBatch;
+   } else if (functions.acceptBatch && !functions.accept) {
+      // Call the batch accept with a single tuple
+      auto* acceptBatchType = functions.acceptBatch->getFunctionType();
+      llvm::SmallVector<llvm::Type*, 8> paramTypes(acceptBatchType->param_begin(), acceptBatchType->param_end() - 1);
+      auto* acceptType = llvm::FunctionType::get(acceptBatchType->getReturnType(), paramTypes, false);
+      auto* accept = llvm::Function::Create(acceptType, llvm::Function::ExternalLinkage, asStringRef(acceptName), module);
+
+      auto* bb = llvm::BasicBlock::Create(context, "init", accept);
+      llvm::IRBuilder<> builder(bb);
+
+      llvm::SmallVector<llvm::Value*, 8> args;
+      for (auto& arg : accept->args())
+         args.push_back(&arg);
+      args.push_back(builder.getInt64(1));
+      builder.CreateCall(functions.acceptBatch, args);
+      builder.CreateRetVoid();
+
+      functions.accept = accept;
+   }
+
    // Create a global constructor that takes a pointer to struct { int argc; char** argv; } as an argument.
    {
       auto* voidType = llvm::Type::getVoidTy(context);
@@ -190,19 +748,29 @@ tl::expected<CxxUDOLLVMFunctions, string> CxxUDOCompiler::preprocessModule()
    // Create the emit function so that it calls the functor that contains the
    // generated code for the parent operator
    {
-      // Make sure that the function is not duplicated or inlined because we
-      // want to do that manually in the CxxUDOLogic
-      analysis.emit->addFnAttr(llvm::Attribute::NoDuplicate);
-      analysis.emit->addFnAttr(llvm::Attribute::NoInline);
+      // Only the output attributes that are needed are copied to the tuple
+      // that is passed on, the others are left zero-initialized.
+      auto* outputTupleType = llvm::dyn_cast<llvm::StructType>(analysis.outputTupleType);
+      bool pruneOutput = false;
+      if (outputTupleType && outputTupleType->getNumElements() == analysis.output.size())
+         for (unsigned i = 0; i < outputTupleType->getNumElements() && i < 64; ++i)
+            if (!(outputMask & (uint64_t(1) << i)))
+               pruneOutput = true;
 
-      // Create the global variable that holds the functor
-      auto* callbackPtrVar = new llvm::GlobalVariable(module, functions.udoFunctorType, false, llvm::GlobalVariable::ExternalLinkage, nullptr, emitFunctorName);
+      // Make sure that the function is not duplicated or inlined because we
+      // want to do that manually in the CxxUDOLogic. When the tuples are
+      // buffered, emit only appends to the buffer and should be inlined.
+      // When output attributes are pruned, emit must be inlined so that the
+      // stores of the unused attributes in the UDO become dead.
+      if (emitBatchSize == 0 && !pruneOutput) {
+         analysis.emit->addFnAttr(llvm::Attribute::NoDuplicate);
+         analysis.emit->addFnAttr(llvm::Attribute::NoInline);
+      }
 
       auto* bb = llvm::BasicBlock::Create(context, "init", analysis.emit);
       llvm::IRBuilder<> builder(bb);
       builder.SetInsertPoint(bb);
 
-      // Generate the code to call the functor
       llvm::Value* executionState1;
       llvm::Value* executionState2;
       llvm::Value* tuple;
@@ -216,14 +784,136 @@ tl::expected<CxxUDOLLVMFunctions, string> CxxUDOCompiler::preprocessModule()
          ++argIt;
          assert(argIt == analysis.emit->arg_end());
       }
-      auto* functorFuncPtr = builder.CreateConstGEP2_32(functions.udoFunctorType, callbackPtrVar, 0, 0);
-      auto* functorFunc = builder.CreateLoad(voidPtr, functorFuncPtr);
-      auto* functorFuncType = llvm::FunctionType::get(llvm::Type::getVoidTy(context), {functions.udoFunctorType->getPointerTo(), voidPtr, voidPtr, voidPtr}, false);
-      builder.CreateCall(functorFuncType, functorFunc, {callbackPtrVar, executionState1, executionState2, tuple});
 
-      builder.CreateRetVoid();
+      if (pruneOutput) {
+         auto& dataLayout = module.getDataLayout();
+         auto* structLayout = dataLayout.getStructLayout(outputTupleType);
+         auto tupleAlign = dataLayout.getABITypeAlign(outputTupleType);
+         auto* prunedTuple = builder.CreateAlloca(outputTupleType, nullptr, "prunedTuple");
+         builder.CreateStore(llvm::Constant::getNullValue(outputTupleType), prunedTuple);
+         auto* sourceTuple = builder.CreateBitCast(tuple, outputTupleType->getPointerTo());
+         for (unsigned i = 0; i < outputTupleType->getNumElements(); ++i) {
+            if (i < 64 && !(outputMask & (uint64_t(1) << i)))
+               continue;
+            auto* elementType = outputTupleType->getElementType(i);
+            auto elementAlign = llvm::commonAlignment(tupleAlign, structLayout->getElementOffset(i));
+            auto* source = builder.CreateStructGEP(outputTupleType, sourceTuple, i);
+            auto* target = builder.CreateStructGEP(outputTupleType, prunedTuple, i);
+            builder.CreateMemCpy(target, elementAlign, source, elementAlign, dataLayout.getTypeStoreSize(elementType).getFixedSize());
+         }
+         tuple = builder.CreateBitCast(prunedTuple, tuple->getType());
+      }
+
+      if (emitBatchSize == 0) {
+         // Create the global variable that holds the functor
+         auto* callbackPtrVar = new llvm::GlobalVariable(module, functions.udoFunctorType, false, llvm::GlobalVariable::ExternalLinkage, nullptr, emitFunctorName);
+
+         // Generate the code to call the functor
+         auto* functorFuncPtr = builder.CreateConstGEP2_32(functions.udoFunctorType, callbackPtrVar, 0, 0);
+         auto* functorFunc = builder.CreateLoad(voidPtr, functorFuncPtr);
+         auto* functorFuncType = llvm::FunctionType::get(llvm::Type::getVoidTy(context), {functions.udoFunctorType->getPointerTo(), voidPtr, voidPtr, voidPtr}, false);
+         builder.CreateCall(functorFuncType, functorFunc, {callbackPtrVar, executionState1, executionState2, tuple});
+
+         builder.CreateRetVoid();
+
+         functions.emitFunctor = callbackPtrVar;
+      } else {
+         // The tuples are collected in a buffer per thread which is passed to
+         // the batch functor when it is full and at the end of a phase. The
+         // host calls accept for every tuple, so the buffer is not flushed
+         // after accept but by the host with the flushEmit function.
+         auto& dataLayout = module.getDataLayout();
+         auto* voidType = llvm::Type::getVoidTy(context);
+         auto* i64Type = llvm::Type::getInt64Ty(context);
+         auto* bufferType = llvm::ArrayType::get(analysis.outputTupleType, emitBatchSize);
+
+         auto* batchCallbackPtrVar = new llvm::GlobalVariable(module, functions.udoFunctorType, false, llvm::GlobalVariable::ExternalLinkage, nullptr, asStringRef(emitBatchFunctorName));
+
+         auto createThreadLocal = [&](llvm::Type* type, const llvm::Twine& name) {
+            return new llvm::GlobalVariable(module, type, false, llvm::GlobalVariable::InternalLinkage, llvm::Constant::getNullValue(type), name, nullptr, llvm::GlobalVariable::GeneralDynamicTLSModel);
+         };
+         auto* bufferVar = createThreadLocal(bufferType, "udo.CxxUDO.emitBuffer");
+         auto* numTuplesVar = createThreadLocal(i64Type, "udo.CxxUDO.emitBufferSize");
+         auto* executionState1Var = createThreadLocal(executionState1->getType(), "udo.CxxUDO.emitExecutionState1");
+         auto* executionState2Var = createThreadLocal(executionState2->getType(), "udo.CxxUDO.emitExecutionState2");
+
+         // Generate the function that passes the buffered tuples to the functor
+         auto* flushType = llvm::FunctionType::get(voidType, {}, false);
+         auto* flush = llvm::Function::Create(flushType, llvm::Function::ExternalLinkage, asStringRef(flushEmitName), module);
+         {
+            auto* entryBB = llvm::BasicBlock::Create(context, "entry", flush);
+            auto* callBB = llvm::BasicBlock::Create(context, "call", flush);
+            auto* exitBB = llvm::BasicBlock::Create(context, "exit", flush);
+            llvm::IRBuilder<> flushBuilder(entryBB);
+            auto* numTuples = flushBuilder.CreateLoad(i64Type, numTuplesVar);
+            flushBuilder.CreateCondBr(flushBuilder.CreateICmpEQ(numTuples, flushBuilder.getInt64(0)), exitBB, callBB);
+
+            flushBuilder.SetInsertPoint(callBB);
+            auto* state1 = flushBuilder.CreateLoad(executionState1->getType(), executionState1Var);
+            auto* state2 = flushBuilder.CreateLoad(executionState2->getType(), executionState2Var);
+            auto* tuples = flushBuilder.CreateBitCast(flushBuilder.CreateConstInBoundsGEP2_32(bufferType, bufferVar, 0, 0), voidPtr);
+            auto* functorFuncPtr = flushBuilder.CreateConstGEP2_32(functions.udoFunctorType, batchCallbackPtrVar, 0, 0);
+            auto* functorFuncVoidPtr = flushBuilder.CreateLoad(voidPtr, functorFuncPtr, "functorPtr");
+            auto* functorFuncType = llvm::FunctionType::get(voidType, {functions.udoFunctorType->getPointerTo(), executionState1->getType(), executionState2->getType(), voidPtr, i64Type}, false);
+            auto* functorFunc = flushBuilder.CreateBitCast(functorFuncVoidPtr, functorFuncType->getPointerTo());
+            flushBuilder.CreateCall(functorFuncType, functorFunc, {batchCallbackPtrVar, state1, state2, tuples, numTuples});
+            flushBuilder.CreateStore(flushBuilder.getInt64(0), numTuplesVar);
+            flushBuilder.CreateBr(exitBB);
+
+            flushBuilder.SetInsertPoint(exitBB);
+            flushBuilder.CreateRetVoid();
+         }
+
+         // Generate the code that appends the tuple to the buffer
+         auto* fullBB = llvm::BasicBlock::Create(context, "full", analysis.emit);
+         auto* exitBB = llvm::BasicBlock::Create(context, "exit", analysis.emit);
+         builder.CreateStore(executionState1, executionState1Var);
+         builder.CreateStore(executionState2, executionState2Var);
+         auto* numTuples = builder.CreateLoad(i64Type, numTuplesVar);
+         auto* slot = builder.CreateInBoundsGEP(bufferType, bufferVar, {builder.getInt64(0), numTuples});
+         auto tupleAlign = dataLayout.getABITypeAlign(analysis.outputTupleType);
+         builder.CreateMemCpy(slot, tupleAlign, tuple, tupleAlign, dataLayout.getTypeAllocSize(analysis.outputTupleType).getFixedSize());
+         auto* newNumTuples = builder.CreateAdd(numTuples, builder.getInt64(1));
+         builder.CreateStore(newNumTuples, numTuplesVar);
+         builder.CreateCondBr(builder.CreateICmpEQ(newNumTuples, builder.getInt64(emitBatchSize)), fullBB, exitBB);
 
-      functions.emitFunctor = callbackPtrVar;
+         builder.SetInsertPoint(fullBB);
+         builder.CreateCall(flush);
+         builder.CreateBr(exitBB);
+
+         builder.SetInsertPoint(exitBB);
+         builder.CreateRetVoid();
+
+         // Flush the buffer at the end of the extraWork and process phase
+         auto flushOnReturn = [&](llvm::Function*& func) {
+            if (!func)
+               return;
+
+            auto* wrapper = llvm::Function::Create(func->getFunctionType(), llvm::Function::ExternalLinkage, "", module);
+            wrapper->takeName(func);
+            func->setName(wrapper->getName() + ".unbuffered");
+            wrapper->setAttributes(func->getAttributes());
+
+            auto* wrapperBB = llvm::BasicBlock::Create(context, "init", wrapper);
+            llvm::IRBuilder<> wrapperBuilder(wrapperBB);
+            llvm::SmallVector<llvm::Value*, 8> args;
+            for (auto& arg : wrapper->args())
+               args.push_back(&arg);
+            auto* call = wrapperBuilder.CreateCall(func, args);
+            call->setAttributes(func->getAttributes());
+            wrapperBuilder.CreateCall(flush);
+            if (call->getType()->isVoidTy())
+               wrapperBuilder.CreateRetVoid();
+            else
+               wrapperBuilder.CreateRet(call);
+
+            func = wrapper;
+         };
+         flushOnReturn(functions.extraWork);
+         flushOnReturn(functions.process);
+
+         functions.emitBatchFunctor = batchCallbackPtrVar;
+      }
    }
 
    // Generate the getThreadId function
@@ -343,18 +1033,182 @@ tl::expected<CxxUDOLLVMFunctions, string> CxxUDOCompiler::preprocessModule()
       globalValue->setLinkage(llvm::GlobalValue::ExternalLinkage);
    });
 
-   ClangCompiler::optimizeModule(module, cxxUDOOptLevel.get());
+   ClangCompiler::optimizeModule(module, optimizationLevel);
+
+   return functions;
+}
+//---------------------------------------------------------------------------
+vector<char> CxxUDOCompiler::getBitcode() const
+// Get the bitcode of the preprocessed module
+{
+   llvm::SmallVector<char, 1> llvmBuffer;
+   llvm::raw_svector_ostream stream(llvmBuffer);
+   llvm::WriteBitcodeToFile(analyzer.getModule(), stream);
 
+   vector<char> buffer(llvmBuffer.begin(), llvmBuffer.end());
+   return buffer;
+}
+//---------------------------------------------------------------------------
+tl::expected<CxxUDOLLVMFunctions, string> CxxUDOCompiler::readLLVMFunctions(llvm::Module& module)
+// Read the CxxUDOLLVMFunctions from the metadata of a preprocessed module
+{
+   CxxUDOLLVMFunctions functions{};
+   llvm_metadata::MetadataReader reader(module);
+   if (auto result = reader.readNamedValue("udo.CxxUDO.LLVMFunctions"sv, functions); !result)
+      return tl::unexpected(move(result).error());
+   functions.udoFunctorType = llvm::StructType::getTypeByName(module.getContext(), asStringRef(functorTypeName));
    return functions;
 }
 //---------------------------------------------------------------------------
+tl::expected<void, string> CxxUDOCompiler::fuseEmit(span<const char> consumerBitcode, string_view consumerName)
+// Let emit call a function of the host directly instead of the emit callback
+{
+   auto& analysis = analyzer.getAnalysis();
+   auto& module = analyzer.getModule();
+   auto& context = module.getContext();
+   auto* emit = analysis.emit;
+
+   llvm::MemoryBufferRef bufferRef(llvm::StringRef(consumerBitcode.data(), consumerBitcode.size()), "udo.CxxUDO.Consumer");
+   auto consumerModuleOrError = llvm::parseBitcodeFile(bufferRef, context);
+   if (!consumerModuleOrError)
+      return tl::unexpected(trformat(tc, "invalid bitcode of the emit consumer: {0}", llvm::toString(consumerModuleOrError.takeError())));
+   auto consumerModule = move(consumerModuleOrError.get());
+   consumerModule->setDataLayout(module.getDataLayout());
+   consumerModule->setTargetTriple(module.getTargetTriple());
+
+   if (llvm::Linker::linkModules(module, move(consumerModule)))
+      return tl::unexpected(string(tr(tc, "could not link the emit consumer into the C++ UDO")));
+
+   auto* consumer = module.getFunction(asStringRef(consumerName));
+   if (!consumer || consumer->isDeclaration())
+      return tl::unexpected(trformat(tc, "emit consumer {0} is not defined", consumerName));
+
+   // The emit callback functor is passed as first argument, so that the
+   // consumer can access the state argument
+   auto* functorType = llvm::StructType::getTypeByName(context, asStringRef(functorTypeName));
+   auto* emitFunctorVar = module.getNamedGlobal(asStringRef(emitFunctorName));
+   if (!emitFunctorVar)
+      emitFunctorVar = new llvm::GlobalVariable(module, functorType, false, llvm::GlobalVariable::ExternalLinkage, nullptr, asStringRef(emitFunctorName));
+
+   llvm::SmallVector<llvm::Value*, 4> args;
+   args.push_back(emitFunctorVar);
+   for (auto& arg : emit->args())
+      args.push_back(&arg);
+
+   auto* consumerType = consumer->getFunctionType();
+   if (!consumerType->getReturnType()->isVoidTy() || consumerType->getNumParams() != args.size())
+      return tl::unexpected(string(tr(tc, "invalid signature of the emit consumer")));
+   for (unsigned i = 0; i < args.size(); ++i) {
+      auto* paramType = consumerType->getParamType(i);
+      if (args[i]->getType() != paramType && !(args[i]->getType()->isPointerTy() && paramType->isPointerTy()))
+         return tl::unexpected(string(tr(tc, "invalid signature of the emit consumer")));
+   }
+
+   // Replace the body of emit by a call to the consumer, emit and the
+   // consumer can now be inlined into the UDO
+   auto* bb = llvm::BasicBlock::Create(context, "init");
+   llvm::IRBuilder<> builder(bb);
+   for (unsigned i = 0; i < args.size(); ++i)
+      args[i] = builder.CreateBitCast(args[i], consumerType->getParamType(i));
+   builder.CreateCall(consumer, args);
+   builder.CreateRetVoid();
+
+   emit->deleteBody();
+   bb->insertInto(emit);
+   emit->removeFnAttr(llvm::Attribute::NoDuplicate);
+   emit->removeFnAttr(llvm::Attribute::NoInline);
+   consumer->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+   ClangCompiler::optimizeModule(module, optimizationLevel);
+
+   return {};
+}
+//---------------------------------------------------------------------------
+tl::expected<void, string> CxxUDOCompiler::specializeConstructor(span<const optional<uint64_t>> constructorArguments)
+// Specialize the UDO for constant scalar arguments of its constructor
+{
+   auto& analysis = analyzer.getAnalysis();
+   auto& module = analyzer.getModule();
+   auto& context = module.getContext();
+   auto* constructor = analysis.constructor;
+
+   if (!constructor) {
+      if (any_of(constructorArguments.begin(), constructorArguments.end(), [](auto& argument) { return argument.has_value(); }))
+         return tl::unexpected(string(tr(tc, "C++ UDO has no constructor arguments that can be specialized")));
+      return {};
+   }
+
+   auto* constructorType = constructor->getFunctionType();
+   if (constructorArguments.size() + 1 != constructorType->getNumParams())
+      return tl::unexpected(string(tr(tc, "wrong number of constructor arguments for the specialization of C++ UDO")));
+
+   llvm::SmallVector<llvm::Constant*, 8> constants;
+   for (size_t i = 0; i < constructorArguments.size(); ++i) {
+      auto& argument = constructorArguments[i];
+      auto* type = constructorType->getParamType(i + 1);
+      if (!argument) {
+         constants.push_back(nullptr);
+      } else if (type->isIntegerTy()) {
+         constants.push_back(llvm::ConstantInt::get(type, *argument));
+      } else if (type->isFloatTy()) {
+         constants.push_back(llvm::ConstantFP::get(type, bit_cast<float>(static_cast<uint32_t>(*argument))));
+      } else if (type->isDoubleTy()) {
+         constants.push_back(llvm::ConstantFP::get(type, bit_cast<double>(*argument)));
+      } else {
+         return tl::unexpected(trformat(tc, "constructor argument {0} of C++ UDO cannot be specialized", i + 1));
+      }
+   }
+
+   // Move the body of the constructor to a new function and let the
+   // constructor call it with the constants, so that the host can still call
+   // the constructor in the same way
+   auto* generic = llvm::Function::Create(constructorType, llvm::Function::InternalLinkage, constructor->getName() + ".generic", module);
+   generic->setAttributes(constructor->getAttributes());
+   generic->getBasicBlockList().splice(generic->end(), constructor->getBasicBlockList());
+   for (auto& arg : constructor->args()) {
+      auto* genericArg = generic->getArg(arg.getArgNo());
+      genericArg->takeName(&arg);
+      arg.replaceAllUsesWith(genericArg);
+   }
+   {
+      auto* bb = llvm::BasicBlock::Create(context, "init", constructor);
+      llvm::IRBuilder<> builder(bb);
+      llvm::SmallVector<llvm::Value*, 8> args;
+      for (auto& arg : constructor->args()) {
+         auto argNo = arg.getArgNo();
+         if (argNo > 0 && constants[argNo - 1])
+            args.push_back(constants[argNo - 1]);
+         else
+            args.push_back(&arg);
+      }
+      auto* call = builder.CreateCall(generic, args);
+      call->setAttributes(generic->getAttributes());
+      if (call->getType()->isVoidTy())
+         builder.CreateRetVoid();
+      else
+         builder.CreateRet(call);
+   }
+
+   // Inline the original constructor so that it stores the constants in the
+   // members, then propagate the members into the functions that are called
+   // after the constructor
+   ClangCompiler::optimizeModule(module, optimizationLevel);
+   if (optimizationLevel > 0) {
+      array entryFunctions{module.getFunction(asStringRef(acceptName)), module.getFunction(asStringRef(acceptBatchName)), module.getFunction(asStringRef(extraWorkName)), module.getFunction(asStringRef(processName))};
+      propagateConstantMembers(*constructor, entryFunctions, module.getDataLayout(), analysis.size);
+      ClangCompiler::optimizeModule(module, optimizationLevel);
+   }
+
+   return {};
+}
+//---------------------------------------------------------------------------
 tl::expected<vector<char>, string> CxxUDOCompiler::compile()
 // Compile the UDO to machine code.
 {
    auto& module = analyzer.getModule();
 
    llvm::EngineBuilder builder;
-   auto targetMachinePtr = LLVMCompiler::setupBuilder(builder, false).setRelocationModel(llvm::Reloc::PIC_).setCodeModel(llvm::CodeModel::Small).selectTarget();
+   auto targetMachinePtr = LLVMCompiler::setupBuilder(builder, optimizationLevel == 0).setRelocationModel(llvm::Reloc::PIC_).setCodeModel(llvm::CodeModel::Small).selectTarget();
    unique_ptr<remove_pointer_t<decltype(targetMachinePtr)>> targetMachine(targetMachinePtr);
 
    if (targetMachine->getTargetTriple().getArch() != llvm::Triple::x86_64)
@@ -368,6 +1222,11 @@ tl::expected<vector<char>, string> CxxUDOCompiler::compile()
 
    assert(!llvm::verifyModule(module));
 
+   // The linker keeps the code that accept, extraWork and process need
+   // together and places the rest, e.g. the global constructors, apart
+   array entryFunctions{module.getFunction(asStringRef(acceptName)), module.getFunction(asStringRef(acceptBatchName)), module.getFunction(asStringRef(extraWorkName)), module.getFunction(asStringRef(processName)), module.getFunction(asStringRef(flushEmitName))};
+   markHotFunctions(module, entryFunctions);
+
    auto objectFile = compileModule(*targetMachine, module);
 
    if (dumpCxxUDOObject) {
@@ -381,6 +1240,23 @@ tl::expected<vector<char>, string> CxxUDOCompiler::compile()
    return objectFileVec;
 }
 //---------------------------------------------------------------------------
+tl::expected<vector<char>, string> CxxUDOCompiler::compileSerializedAnalysis(string funcSource, string udoClassName, span<const char> serializedAnalysis, unsigned optimizationLevel, span<const optional<uint64_t>> constructorArguments, uint64_t outputMask, unsigned emitBatchSize)
+// Compile a UDO from a serialized analysis
+{
+   CxxUDOAnalyzer analyzer(move(funcSource), move(udoClassName));
+   if (auto result = analyzer.loadSerializedAnalysis(serializedAnalysis); !result)
+      return tl::unexpected(move(result).error());
+
+   CxxUDOCompiler compiler(analyzer, optimizationLevel);
+   if (auto result = compiler.preprocessModule(outputMask, emitBatchSize); !result)
+      return tl::unexpected(move(result).error());
+   if (!constructorArguments.empty())
+      if (auto result = compiler.specializeConstructor(constructorArguments); !result)
+         return tl::unexpected(move(result).error());
+
+   return compiler.compile();
+}
+//---------------------------------------------------------------------------
 namespace llvm_metadata {
 //---------------------------------------------------------------------------
 #define TRY(x) \
@@ -392,11 +1268,13 @@ IOResult IO<CxxUDOLLVMFunctions>::enumEntries(StructContext& context, CxxUDOLLVM
    TRY(mapMember(context, value.threadInit));
    TRY(mapMember(context, value.emit));
    TRY(mapMember(context, value.emitFunctor));
+   TRY(mapMember(context, value.emitBatchFunctor));
    TRY(mapMember(context, value.printDebugFunctor));
    TRY(mapMember(context, value.getRandomFunctor));
    TRY(mapMember(context, value.constructor));
    TRY(mapMember(context, value.destructor));
    TRY(mapMember(context, value.accept));
+   TRY(mapMember(context, value.acceptBatch));
    TRY(mapMember(context, value.extraWork));
    TRY(mapMember(context, value.process));
    return {};
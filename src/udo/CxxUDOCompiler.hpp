@@ -3,6 +3,9 @@
 //---------------------------------------------------------------------------
 #include "thirdparty/tl/expected.hpp"
 #include "udo/LLVMMetadata.hpp"
+#include <cstdint>
+#include <optional>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -13,6 +16,7 @@
 namespace llvm {
 class Function;
 class GlobalVariable;
+class Module;
 class StructType;
 }
 //---------------------------------------------------------------------------
@@ -35,6 +39,9 @@ struct CxxUDOLLVMFunctions {
    llvm::Function* emit;
    /// The global variable that contains the functor to the callback for emit
    llvm::GlobalVariable* emitFunctor;
+   /// The global variable that contains the functor to the callback for a
+   /// batch of emitted tuples
+   llvm::GlobalVariable* emitBatchFunctor;
    /// The global variable that contains the functor to the printDebug function
    llvm::GlobalVariable* printDebugFunctor;
    /// The global variable that contains the functor to the getRandom function
@@ -45,6 +52,8 @@ struct CxxUDOLLVMFunctions {
    llvm::Function* destructor;
    /// The wrapper for accept
    llvm::Function* accept;
+   /// The wrapper for the batch accept
+   llvm::Function* acceptBatch;
    /// The extraWork function
    llvm::Function* extraWork;
    /// The wrapper for process
@@ -60,6 +69,7 @@ struct CxxUDOLLVMFunctions {
       mapFunc(&CxxUDOLLVMFunctions::constructor);
       mapFunc(&CxxUDOLLVMFunctions::destructor);
       mapFunc(&CxxUDOLLVMFunctions::accept);
+      mapFunc(&CxxUDOLLVMFunctions::acceptBatch);
       mapFunc(&CxxUDOLLVMFunctions::extraWork);
       mapFunc(&CxxUDOLLVMFunctions::process);
       mapFunc(&CxxUDOLLVMFunctions::globalConstructor);
@@ -69,6 +79,7 @@ struct CxxUDOLLVMFunctions {
       mapFunc(&CxxUDOLLVMFunctions::constructor);
       mapFunc(&CxxUDOLLVMFunctions::destructor);
       mapFunc(&CxxUDOLLVMFunctions::accept);
+      mapFunc(&CxxUDOLLVMFunctions::acceptBatch);
       mapFunc(&CxxUDOLLVMFunctions::extraWork);
       mapFunc(&CxxUDOLLVMFunctions::process);
    }
@@ -89,6 +100,7 @@ struct CxxUDOLLVMFunctions {
       mapGlobal(constructor);
       mapGlobal(destructor);
       mapGlobal(accept);
+      mapGlobal(acceptBatch);
       mapGlobal(extraWork);
       mapGlobal(process);
       mapGlobal(globalConstructor);
@@ -96,11 +108,13 @@ struct CxxUDOLLVMFunctions {
       mapGlobal(threadInit);
       mapGlobal(emit);
       mapGlobal(emitFunctor);
+      mapGlobal(emitBatchFunctor);
       mapGlobal(printDebugFunctor);
       mapGlobal(getRandomFunctor);
       mapGlobal(constructor);
       mapGlobal(destructor);
       mapGlobal(accept);
+      mapGlobal(acceptBatch);
       mapGlobal(extraWork);
       mapGlobal(process);
    }
@@ -125,6 +139,8 @@ class CxxUDOCompiler {
    static constexpr std::string_view emitName = "udo.CxxUDO.emit";
    /// The name of the emit callback functor
    static constexpr std::string_view emitFunctorName = "udo.CxxUDO.emitCallback";
+   /// The name of the batch emit callback functor
+   static constexpr std::string_view emitBatchFunctorName = "udo.CxxUDO.emitBatchCallback";
    /// The name of the functor for printDebug
    static constexpr std::string_view printDebugFunctorName = "udo.CxxUDO.printDebug";
    /// The name of the functor for getRandom
@@ -135,28 +151,86 @@ class CxxUDOCompiler {
    static constexpr std::string_view destructorName = "udo.CxxUDO.Destructor";
    /// The name of the accept function of the UDO class
    static constexpr std::string_view acceptName = "udo.CxxUDO.accept";
+   /// The name of the batch accept function of the UDO class
+   static constexpr std::string_view acceptBatchName = "udo.CxxUDO.acceptBatch";
    /// The name of the extraWork function of the UDO class
    static constexpr std::string_view extraWorkName = "udo.CxxUDO.extraWork";
    /// The name of the process function of the UDO class
    static constexpr std::string_view processName = "udo.CxxUDO.process";
+   /// The name of the function that passes the buffered output tuples of the
+   /// current thread to the batch emit callback
+   static constexpr std::string_view flushEmitName = "udo.CxxUDO.flushEmit";
 
    private:
    /// The analyzer
    CxxUDOAnalyzer& analyzer;
+   /// The optimization level
+   unsigned optimizationLevel;
 
    public:
    /// Get the optimization level that is used for C++ UDOs
    static unsigned getOptLevel();
+   /// Is tiered compilation enabled? Then, C++ UDOs are compiled with
+   /// getFirstTierOptLevel() first and with getOptLevel() in the background.
+   static bool isTieredCompilationEnabled();
+   /// Get the optimization level of the first tier
+   static unsigned getFirstTierOptLevel();
+   /// Get the number of output tuples that are buffered per thread before
+   /// they are passed to the emit batch functor, 0 if they are not buffered
+   static unsigned getEmitBatchSize();
 
    /// Constructor
-   explicit CxxUDOCompiler(CxxUDOAnalyzer& analyzer) : analyzer(analyzer) {}
+   explicit CxxUDOCompiler(CxxUDOAnalyzer& analyzer, unsigned optimizationLevel = getOptLevel()) : analyzer(analyzer), optimizationLevel(optimizationLevel) {}
+
+   /// Link the module of a UDO that consumes the output of this UDO into the
+   /// module, so that both are executed as one UDO. emit of this UDO calls
+   /// accept of the consumer directly and the tuples that are emitted by the
+   /// consumer are the output of the fused UDO. The object of the consumer is
+   /// stored behind the object of this UDO and the constructor takes the
+   /// arguments of this UDO followed by the arguments of the consumer. The
+   /// consumer must not have an extraWork or process function. `stage` is
+   /// used to make the names of the consumer unique when several consumers
+   /// are fused. Must be called before preprocessModule().
+   tl::expected<void, std::string> fuseConsumer(CxxUDOAnalyzer& consumer, unsigned stage);
 
    /// Preprocess the llvm module by creating all special extra functions that
-   /// are used by the UDO execution.
-   tl::expected<CxxUDOLLVMFunctions, std::string> preprocessModule();
+   /// are used by the UDO execution. Bit i of `outputMask` is set if the
+   /// output attribute i is needed, emit only stores the needed attributes in
+   /// the tuple so that the computation of the others can be removed.
+   /// `emitBatchSize` is the number of output tuples that are buffered, see
+   /// getEmitBatchSize().
+   tl::expected<CxxUDOLLVMFunctions, std::string> preprocessModule(uint64_t outputMask = ~uint64_t(0), unsigned emitBatchSize = getEmitBatchSize());
+
+   /// Get the bitcode of the module after preprocessModule() was called. The
+   /// CxxUDOLLVMFunctions are stored in its metadata and can be read with
+   /// readLLVMFunctions().
+   std::vector<char> getBitcode() const;
+   /// Read the CxxUDOLLVMFunctions from the metadata of a preprocessed module
+   static tl::expected<CxxUDOLLVMFunctions, std::string> readLLVMFunctions(llvm::Module& module);
+
+   /// Link the function `consumerName` from `consumerBitcode` into the
+   /// preprocessed module and let emit call it directly instead of the emit
+   /// callback, then optimize the module again. The consumer has the
+   /// signature of the emit callback:
+   /// void consumer(CxxUDOFunctor* emitFunctor, void* executionState1, void* executionState2, const void* tuple)
+   /// Must be called after preprocessModule() and before compile().
+   tl::expected<void, std::string> fuseEmit(std::span<const char> consumerBitcode, std::string_view consumerName);
+
+   /// Specialize the UDO for constant scalar arguments of its constructor.
+   /// The constructor ignores the arguments that have a value and uses the
+   /// constant instead, members that are initialized with constants are
+   /// propagated into the other functions of the UDO. The values are given
+   /// as the raw bits of the argument, i.e. like a Postgres Datum. Must be
+   /// called after preprocessModule() and before compile().
+   tl::expected<void, std::string> specializeConstructor(std::span<const std::optional<uint64_t>> constructorArguments);
 
    /// Compile the UDO to an object file.
    tl::expected<std::vector<char>, std::string> compile();
+
+   /// Compile a UDO from an analysis that was serialized with
+   /// `CxxUDOAnalyzer::getSerializedAnalysis()`. This only uses its own
+   /// llvm context, so it can be called from any thread.
+   static tl::expected<std::vector<char>, std::string> compileSerializedAnalysis(std::string funcSource, std::string udoClassName, std::span<const char> serializedAnalysis, unsigned optimizationLevel, std::span<const std::optional<uint64_t>> constructorArguments = {}, uint64_t outputMask = ~uint64_t(0), unsigned emitBatchSize = getEmitBatchSize());
 };
 //---------------------------------------------------------------------------
 namespace llvm_metadata {
@@ -6,7 +6,9 @@
 #include "udo/DynamicTLS.hpp"
 #include "udo/LLVMUtil.hpp"
 #include "udo/Setting.hpp"
+#include "udo/StaticLibraryIndex.hpp"
 #include "udo/UDOMemoryManager.hpp"
+#include "udo/UDOStats.hpp"
 #include "udo/i18n.hpp"
 #include "udo/out.hpp"
 #include <clang/Driver/Compilation.h>
@@ -20,16 +22,31 @@
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/LLVMContext.h>
-#include <llvm/Object/Archive.h>
 #include <llvm/Object/ELFObjectFile.h>
 #include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/SymbolSize.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/Format.h>
 #include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cerrno>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <mutex>
 #include <optional>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <unistd.h>
 //---------------------------------------------------------------------------
 // UDO runtime
 // (c) 2021 Moritz Sichert
@@ -41,9 +58,401 @@ static const char tc[] = "udo/CxxUDOExecution";
 namespace udo {
 //---------------------------------------------------------------------------
 static Setting<bool> debugCxxUDO("debugCxxUDO", "Print debug information for the compilation of C++ UDOs", false);
+static Setting<bool> cxxUDORuntimeImage("cxxUDORuntimeImage", "Link the objects of the static libraries that all C++ UDOs need only once into an image that is shared by all C++ UDOs", false);
+static Setting<bool> cxxUDOHotColdLayout("cxxUDOHotColdLayout", "Place the code of C++ UDOs that is reachable from accept, extraWork and process, and the library objects it calls, apart from the code that is rarely executed", true);
+static Setting<bool> cxxUDOAllocationAccounting("cxxUDOAllocationAccounting", "Account the allocations of C++ UDOs per linked UDO and instance so that they can be limited. The runtime image is not used when this is enabled.", false);
+static Setting<bool> cxxUDOPerfMap("cxxUDOPerfMap", "Write the addresses of the functions of linked C++ UDOs and the library objects they use to /tmp/perf-<pid>.map so that perf can attribute samples to them", false);
+//---------------------------------------------------------------------------
+static bool isColdSection(llvm::StringRef name)
+// Does a code section contain only code that is rarely executed?
+{
+   return name.startswith(".text.unlikely") || name.startswith(".text.startup") || name.startswith(".text.exit") || name == ".init" || name == ".fini";
+}
 //---------------------------------------------------------------------------
 namespace {
 //---------------------------------------------------------------------------
+/// A function in the perf map
+struct PerfMapEntry {
+   /// The address of the function, or its offset in an image
+   uint64_t address;
+   /// The size of the function
+   uint64_t size;
+   /// The name of the function
+   string name;
+};
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+static void collectPerfMapEntries(const llvm::object::ObjectFile& objectFile, const llvm::RuntimeDyld::LoadedObjectInfo& objectInfo, vector<PerfMapEntry>& entries)
+// Collect the functions of an object file that was loaded by the linker
+{
+   for (auto& [symbol, size] : llvm::object::computeSymbolSizes(objectFile)) {
+      auto type = symbol.getType();
+      auto name = symbol.getName();
+      auto section = symbol.getSection();
+      auto value = symbol.getValue();
+      if (!type || !name || !section || !value || *type != llvm::object::SymbolRef::ST_Function || *section == objectFile.section_end() || size == 0) {
+         llvm::consumeError(type.takeError());
+         llvm::consumeError(name.takeError());
+         llvm::consumeError(section.takeError());
+         llvm::consumeError(value.takeError());
+         continue;
+      }
+
+      auto sectionAddress = objectInfo.getSectionLoadAddress(**section);
+      if (sectionAddress == 0)
+         continue;
+      entries.push_back({sectionAddress + *value - (*section)->getAddress(), size, name->str()});
+   }
+}
+//---------------------------------------------------------------------------
+static void writePerfMap(const vector<PerfMapEntry>& entries, uint64_t baseAddress)
+// Append functions to the perf map of the process, their addresses are
+// relative to the base address
+{
+   static mutex perfMapMutex;
+
+   if (entries.empty())
+      return;
+
+   string lines;
+   llvm::raw_string_ostream stream(lines);
+   for (auto& entry : entries)
+      stream << llvm::format_hex_no_prefix(baseAddress + entry.address, 1) << ' ' << llvm::format_hex_no_prefix(entry.size, 1) << ' ' << entry.name << '\n';
+   stream.flush();
+
+   unique_lock lock(perfMapMutex);
+   ofstream perfMap("/tmp/perf-" + to_string(getpid()) + ".map", ios::app);
+   perfMap << lines;
+}
+//---------------------------------------------------------------------------
+namespace {
+//---------------------------------------------------------------------------
+struct CxxUDOImage;
+//---------------------------------------------------------------------------
+/// The accounted allocations of a linked C++ UDO. The table is owned by the
+/// host and lives outside of the memory of the UDO, so that initialize() does
+/// not reset it and pointers that were allocated in another way are never
+/// mistaken for accounted ones. It is split into shards by the hash of the
+/// pointer, so that threads that allocate concurrently rarely wait for each
+/// other.
+class AllocationTable {
+   private:
+   /// A shard of the table
+   struct alignas(64) Shard {
+      /// The mutex
+      mutex shardMutex;
+      /// The sizes of the accounted allocations
+      unordered_map<const void*, uint64_t> sizes;
+   };
+   /// The number of shards
+   static constexpr size_t numShards = 64;
+
+   /// The shards
+   array<Shard, numShards> shards;
+
+   /// Get the shard of an allocation
+   Shard& getShard(const void* ptr);
+
+   public:
+   /// Add an allocation
+   void insert(const void* ptr, uint64_t size);
+   /// Get the size of an allocation, nullopt if it is not accounted
+   optional<uint64_t> find(const void* ptr);
+   /// Remove an allocation. Returns its size, nullopt if it is not accounted.
+   optional<uint64_t> erase(const void* ptr);
+   /// Remove all allocations
+   void clear();
+};
+//---------------------------------------------------------------------------
+AllocationTable::Shard& AllocationTable::getShard(const void* ptr)
+// Get the shard of an allocation
+{
+   // The low bits of allocations are mostly zero, so the address is mixed
+   auto hash = (reinterpret_cast<uintptr_t>(ptr) >> 4) * 0x9e3779b97f4a7c15ull;
+   return shards[hash >> (64 - countr_zero(numShards))];
+}
+//---------------------------------------------------------------------------
+void AllocationTable::insert(const void* ptr, uint64_t size)
+// Add an allocation
+{
+   auto& shard = getShard(ptr);
+   unique_lock lock(shard.shardMutex);
+   shard.sizes.insert_or_assign(ptr, size);
+}
+//---------------------------------------------------------------------------
+optional<uint64_t> AllocationTable::find(const void* ptr)
+// Get the size of an allocation, nullopt if it is not accounted
+{
+   auto& shard = getShard(ptr);
+   unique_lock lock(shard.shardMutex);
+   if (auto it = shard.sizes.find(ptr); it != shard.sizes.end())
+      return it->second;
+   return nullopt;
+}
+//---------------------------------------------------------------------------
+optional<uint64_t> AllocationTable::erase(const void* ptr)
+// Remove an allocation
+{
+   auto& shard = getShard(ptr);
+   unique_lock lock(shard.shardMutex);
+   auto it = shard.sizes.find(ptr);
+   if (it == shard.sizes.end())
+      return nullopt;
+   auto size = it->second;
+   shard.sizes.erase(it);
+   return size;
+}
+//---------------------------------------------------------------------------
+void AllocationTable::clear()
+// Remove all allocations
+{
+   for (auto& shard : shards) {
+      unique_lock lock(shard.shardMutex);
+      shard.sizes.clear();
+   }
+}
+//---------------------------------------------------------------------------
+/// The accounting of the allocations of a linked C++ UDO. It is stored in the
+/// data pages of the UDO, so every instance has its own and initialize()
+/// resets it. The accounted allocations are tracked in the table of the
+/// instance that initialize() attaches.
+struct AllocationAccounting {
+   /// The allocation functions of the host
+   CxxUDOAllocationFuncs funcs;
+   /// The table of the accounted allocations, nullptr until the UDO was
+   /// initialized. Allocations are not accounted without a table.
+   AllocationTable* table = nullptr;
+   /// The maximum number of live bytes, 0 for unlimited
+   atomic<uint64_t> limit = 0;
+   /// The number of bytes that are currently allocated
+   atomic<uint64_t> liveBytes = 0;
+   /// The maximum of liveBytes
+   atomic<uint64_t> peakBytes = 0;
+   /// The number of successful allocations
+   atomic<uint64_t> numAllocations = 0;
+   /// The number of freed allocations
+   atomic<uint64_t> numFrees = 0;
+   /// The number of failed allocations
+   atomic<uint64_t> numFailedAllocations = 0;
+   /// The number of allocations by size class
+   array<atomic<uint64_t>, CxxUDOAllocationStats::numSizeClasses> sizeHistogram = {};
+
+   /// Constructor
+   explicit AllocationAccounting(CxxUDOAllocationFuncs funcs) : funcs(funcs) {}
+
+   /// Attach the table after the accounting was reset by initialize()
+   void attach(AllocationTable& newTable);
+   /// Reserve the bytes of an allocation that replaces `replacedSize` bytes.
+   /// Returns false if the limit would be exceeded.
+   bool reserve(uint64_t size, uint64_t replacedSize = 0);
+   /// Cancel a reservation because the host could not allocate the memory
+   void cancel(uint64_t size);
+   /// Count a successful allocation
+   void record(uint64_t size);
+   /// Count a freed allocation
+   void release(uint64_t size);
+   /// Get the statistics
+   CxxUDOAllocationStats getStats() const;
+};
+//---------------------------------------------------------------------------
+void AllocationAccounting::attach(AllocationTable& newTable)
+// Attach the table after the accounting was reset by initialize()
+{
+   // The allocations of the previous execution are not accounted anymore,
+   // just like the counters were reset
+   newTable.clear();
+   table = &newTable;
+}
+//---------------------------------------------------------------------------
+bool AllocationAccounting::reserve(uint64_t size, uint64_t replacedSize)
+// Reserve the bytes of an allocation that replaces `replacedSize` bytes
+{
+   auto live = liveBytes.fetch_add(size, memory_order_relaxed) + size - replacedSize;
+   auto maxBytes = limit.load(memory_order_relaxed);
+   if (maxBytes != 0 && live > maxBytes) {
+      liveBytes.fetch_sub(size, memory_order_relaxed);
+      numFailedAllocations.fetch_add(1, memory_order_relaxed);
+      return false;
+   }
+
+   auto peak = peakBytes.load(memory_order_relaxed);
+   while (live > peak && !peakBytes.compare_exchange_weak(peak, live, memory_order_relaxed)) {
+   }
+   return true;
+}
+//---------------------------------------------------------------------------
+void AllocationAccounting::cancel(uint64_t size)
+// Cancel a reservation because the host could not allocate the memory
+{
+   liveBytes.fetch_sub(size, memory_order_relaxed);
+   numFailedAllocations.fetch_add(1, memory_order_relaxed);
+}
+//---------------------------------------------------------------------------
+void AllocationAccounting::record(uint64_t size)
+// Count a successful allocation
+{
+   unsigned sizeClass = size <= 1 ? 0 : min<unsigned>(bit_width(size) - 1, CxxUDOAllocationStats::numSizeClasses - 1);
+   numAllocations.fetch_add(1, memory_order_relaxed);
+   sizeHistogram[sizeClass].fetch_add(1, memory_order_relaxed);
+}
+//---------------------------------------------------------------------------
+void AllocationAccounting::release(uint64_t size)
+// Count a freed allocation
+{
+   liveBytes.fetch_sub(size, memory_order_relaxed);
+   numFrees.fetch_add(1, memory_order_relaxed);
+}
+//---------------------------------------------------------------------------
+CxxUDOAllocationStats AllocationAccounting::getStats() const
+// Get the statistics
+{
+   CxxUDOAllocationStats stats;
+   stats.liveBytes = liveBytes.load(memory_order_relaxed);
+   stats.peakBytes = peakBytes.load(memory_order_relaxed);
+   stats.numAllocations = numAllocations.load(memory_order_relaxed);
+   stats.numFrees = numFrees.load(memory_order_relaxed);
+   stats.numFailedAllocations = numFailedAllocations.load(memory_order_relaxed);
+   for (unsigned i = 0; i < CxxUDOAllocationStats::numSizeClasses; ++i)
+      stats.sizeHistogram[i] = sizeHistogram[i].load(memory_order_relaxed);
+   return stats;
+}
+//---------------------------------------------------------------------------
+void* accountedMalloc(size_t size, AllocationAccounting* accounting)
+// malloc() with accounting
+{
+   auto* table = accounting->table;
+   if (!table)
+      return accounting->funcs.malloc(size);
+   if (!accounting->reserve(size))
+      return nullptr;
+   auto* ptr = accounting->funcs.malloc(size);
+   if (!ptr) {
+      accounting->cancel(size);
+      return nullptr;
+   }
+   accounting->record(size);
+   table->insert(ptr, size);
+   return ptr;
+}
+//---------------------------------------------------------------------------
+void* accountedCalloc(size_t count, size_t size, AllocationAccounting* accounting)
+// calloc() with accounting
+{
+   auto* table = accounting->table;
+   if (!table)
+      return accounting->funcs.calloc(count, size);
+   if (size != 0 && count > numeric_limits<size_t>::max() / size)
+      return nullptr;
+   auto totalSize = count * size;
+   if (!accounting->reserve(totalSize))
+      return nullptr;
+   auto* ptr = accounting->funcs.calloc(count, size);
+   if (!ptr) {
+      accounting->cancel(totalSize);
+      return nullptr;
+   }
+   accounting->record(totalSize);
+   table->insert(ptr, totalSize);
+   return ptr;
+}
+//---------------------------------------------------------------------------
+void accountedFree(void* ptr, AllocationAccounting* accounting)
+// free() with accounting
+{
+   if (!ptr)
+      return;
+   // Memory that was allocated by the host or by the libraries in another
+   // way is passed through without accounting
+   if (auto* table = accounting->table)
+      if (auto size = table->erase(ptr))
+         accounting->release(*size);
+   accounting->funcs.free(ptr);
+}
+//---------------------------------------------------------------------------
+void* accountedRealloc(void* ptr, size_t size, AllocationAccounting* accounting)
+// realloc() with accounting
+{
+   if (!ptr)
+      return accountedMalloc(size, accounting);
+   auto* table = accounting->table;
+   auto oldSize = table ? table->find(ptr) : nullopt;
+   if (!oldSize)
+      return accounting->funcs.realloc(ptr, size);
+   if (size == 0) {
+      accountedFree(ptr, accounting);
+      return nullptr;
+   }
+
+   if (!accounting->reserve(size, *oldSize))
+      return nullptr;
+   auto* newPtr = accounting->funcs.realloc(ptr, size);
+   if (!newPtr) {
+      accounting->cancel(size);
+      return nullptr;
+   }
+   table->erase(ptr);
+   accounting->liveBytes.fetch_sub(*oldSize, memory_order_relaxed);
+   accounting->record(size);
+   table->insert(newPtr, size);
+   return newPtr;
+}
+//---------------------------------------------------------------------------
+int accountedPosixMemalign(void** memptr, size_t alignment, size_t size, AllocationAccounting* accounting)
+// posix_memalign() with accounting
+{
+   auto* table = accounting->table;
+   if (!table)
+      return accounting->funcs.posixMemalign(memptr, alignment, size);
+   if (alignment < sizeof(void*) || popcount(alignment) != 1)
+      return EINVAL;
+   if (!accounting->reserve(size))
+      return ENOMEM;
+   void* ptr = nullptr;
+   if (auto result = accounting->funcs.posixMemalign(&ptr, alignment, size); result != 0) {
+      accounting->cancel(size);
+      return result;
+   }
+   accounting->record(size);
+   table->insert(ptr, size);
+   *memptr = ptr;
+   return 0;
+}
+//---------------------------------------------------------------------------
+/// The registers of the x86_64 arguments that are used by the thunks
+enum class ThunkRegister : uint8_t {
+   Rcx = 1,
+   Rdx = 2,
+   Rsi = 6
+};
+/// The size of an allocation thunk
+constexpr uint64_t allocationThunkSize = 32;
+//---------------------------------------------------------------------------
+void writeAllocationThunk(byte* thunk, const AllocationAccounting* accounting, ThunkRegister argumentRegister, const void* target)
+// Write a thunk that passes the accounting as the next argument to an
+// accounted allocation function. The accounting is addressed relative to the
+// thunk, so every instance of the UDO passes its own.
+{
+   array<uint8_t, 21> code = {};
+   // lea reg, [rip + displacement]
+   code[0] = 0x48;
+   code[1] = 0x8d;
+   code[2] = static_cast<uint8_t>(0x05 | (static_cast<uint8_t>(argumentRegister) << 3));
+   auto displacement = reinterpret_cast<const byte*>(accounting) - (thunk + 7);
+   assert(displacement == static_cast<int32_t>(displacement));
+   auto displacement32 = static_cast<int32_t>(displacement);
+   memcpy(code.data() + 3, &displacement32, sizeof(displacement32));
+   // jmp [rip + 0], followed by the absolute address of the target
+   code[7] = 0xff;
+   code[8] = 0x25;
+   auto targetAddress = reinterpret_cast<uintptr_t>(target);
+   memcpy(code.data() + 13, &targetAddress, sizeof(targetAddress));
+
+   memcpy(thunk, code.data(), code.size());
+   // Pad with int3
+   memset(thunk + code.size(), 0xcc, allocationThunkSize - code.size());
+}
+//---------------------------------------------------------------------------
 /// The memory manager for C++ UDOs that can handle TLS allocations
 class CxxUDOMemoryManager : public llvm::RuntimeDyld::MemoryManager {
    private:
@@ -51,6 +460,8 @@ class CxxUDOMemoryManager : public llvm::RuntimeDyld::MemoryManager {
    UDOMemoryManager memoryManager;
    /// The TLS allocations
    DynamicTLS tlsAllocations;
+   /// Is the code of the object file that is currently loaded hot?
+   bool isLoadingHotObject = true;
 
    public:
    /// Constructor
@@ -73,6 +484,12 @@ class CxxUDOMemoryManager : public llvm::RuntimeDyld::MemoryManager {
    /// Finalize the memory by applying the correct permissions. Returns true if an error occurred.
    bool finalizeMemory(std::string* errMsg) override;
 
+   /// Map an image into the memory and allocate its TLS sections. Must be
+   /// called before anything else is allocated.
+   bool mapImage(const CxxUDOImage& image);
+   /// Set if the code of the object file that is loaded next is hot
+   void setLoadingHotObject(bool value) { isLoadingHotObject = value; }
+
    /// Get the memory manager
    const UDOMemoryManager& getMemoryManager() const {
       return memoryManager;
@@ -83,10 +500,11 @@ class CxxUDOMemoryManager : public llvm::RuntimeDyld::MemoryManager {
    }
 };
 //---------------------------------------------------------------------------
-uint8_t* CxxUDOMemoryManager::allocateCodeSection(uintptr_t size, unsigned alignment, unsigned /*sectionID*/, llvm::StringRef /*sectionName*/)
+uint8_t* CxxUDOMemoryManager::allocateCodeSection(uintptr_t size, unsigned alignment, unsigned /*sectionID*/, llvm::StringRef sectionName)
 // Allocate space for a code section
 {
-   return reinterpret_cast<uint8_t*>(memoryManager.allocate(size, alignment, UDOMemoryManager::AllocationType::Code));
+   bool isCold = cxxUDOHotColdLayout.get() && (!isLoadingHotObject || isColdSection(sectionName));
+   return reinterpret_cast<uint8_t*>(memoryManager.allocate(size, alignment, isCold ? UDOMemoryManager::AllocationType::ColdCode : UDOMemoryManager::AllocationType::Code));
 }
 //---------------------------------------------------------------------------
 uint8_t* CxxUDOMemoryManager::allocateDataSection(uintptr_t size, unsigned alignment, unsigned /*sectionID*/, llvm::StringRef /*sectionName*/, bool isReadOnly)
@@ -112,35 +530,20 @@ CxxUDOMemoryManager::TLSSection CxxUDOMemoryManager::allocateTLSSection(uintptr_
 bool CxxUDOMemoryManager::finalizeMemory(std::string* /*errMsg*/)
 // Finalize the memory by applying the correct permissions. Returns true if an error occurred.
 {
+   UDOStats::PhaseTimer timer(UDOPhase::Freeze);
+   UDOStats::count(&UDOStats::numHugePages, memoryManager.getNumHugePages());
    return !memoryManager.freeze();
 }
 //---------------------------------------------------------------------------
-/// The JIT symbol resolver for the precompiled C++ UDOs
-class PrecompiledCxxUDOResolver : public llvm::JITSymbolResolver {
-   private:
-   /// An object file of a static library
-   struct ObjectFile {
-      /// The actual object file
-      unique_ptr<llvm::object::ObjectFile> objectFile;
-      /// Was the object already loaded into the linker?
-      bool isLoaded = false;
-   };
-
-   /// A loaded static library
-   struct StaticLibrary {
-      /// The memory buffer of the file
-      unique_ptr<llvm::MemoryBuffer> memoryBuffer;
-      /// The archive representing the library
-      unique_ptr<llvm::object::Archive> archive;
-      /// The object files of the archive. Use a deque so that pointers to its
-      /// elements will not be invalidated.
-      deque<ObjectFile> objectFiles;
-   };
-
+/// The static libraries that are used to link C++ UDOs. Parsing the archives
+/// and building the symbol table is expensive, so this is done only once per
+/// process and the result is shared by all resolvers.
+class CxxUDOStaticLibraries {
+   public:
    /// A symbol from an object file
    struct ObjectSymbol {
       /// The object file the symbol belongs to
-      ObjectFile* objectFile = nullptr;
+      const llvm::object::ObjectFile* objectFile = nullptr;
       /// The name of the symbol
       string_view name;
       /// The flags of the symbol
@@ -149,24 +552,140 @@ class PrecompiledCxxUDOResolver : public llvm::JITSymbolResolver {
       bool undefined = false;
    };
 
+   private:
+   /// A loaded static library
+   struct StaticLibrary {
+      /// The memory buffer of the file
+      unique_ptr<llvm::MemoryBuffer> memoryBuffer;
+      /// The symbol index of the library
+      unique_ptr<StaticLibraryIndex> index;
+      /// The object files of the archive members, they are only created when
+      /// one of their symbols is used
+      mutable vector<unique_ptr<llvm::object::ObjectFile>> objectFiles;
+   };
+
+   /// The loaded libraries. Use a deque so that pointers to its elements will
+   /// not be invalidated.
+   deque<StaticLibrary> staticLibs;
+   /// The mutex that protects the creation of the object files
+   mutable mutex objectFilesMutex;
+
+   /// Add a library
+   tl::expected<void, string> addLibrary(string_view path);
+   /// Get the object file of a member, returns nullptr if it is invalid
+   const llvm::object::ObjectFile* getObjectFile(const StaticLibrary& staticLib, uint32_t memberIndex) const;
+
+   public:
+   /// Get the libraries with the given paths. They are loaded only once and
+   /// stay valid until the process exits.
+   static tl::expected<const CxxUDOStaticLibraries*, string> get(span<const string> paths);
+
+   /// Find a symbol, returns nullopt if no library contains it
+   optional<ObjectSymbol> findSymbol(string_view name) const;
+};
+//---------------------------------------------------------------------------
+/// A relocatable image of linked objects together with their TLS sections.
+/// It can be mapped into the memory of a CxxUDOMemoryManager.
+struct CxxUDOImage {
+   /// A TLS section of the image
+   struct TLSSection {
+      /// The offset of the section in the TLS storage
+      uint64_t storageOffset;
+      /// The size of the section
+      uint64_t size;
+      /// The initialization image
+      unique_ptr<char[]> initializationImage;
+      /// The offsets of the addresses in the initialization image that must
+      /// be relocated
+      vector<uint64_t> relocations;
+   };
+
+   /// The memory image, nullptr if the image could not be created
+   unique_ptr<UDOMemoryManager::Image> memoryImage;
+   /// The TLS sections of the image
+   vector<TLSSection> tlsSections;
+   /// The functions in the image for the perf map, relative to the image
+   vector<PerfMapEntry> perfMapEntries;
+};
+//---------------------------------------------------------------------------
+/// An image of the objects from the static libraries that all C++ UDOs
+/// need. It is linked only once and then mapped into the memory of every
+/// C++ UDO so that its code is shared.
+struct CxxUDORuntimeImage : CxxUDOImage {
+   /// A symbol that is defined in the image
+   struct Symbol {
+      /// The offset of the symbol in the image or its absolute value
+      uint64_t value;
+      /// Is the value absolute (e.g. a TLS offset) or relative to the image?
+      bool isAbsolute;
+   };
+
+   /// The static libraries the image was linked from
+   const CxxUDOStaticLibraries* staticLibs;
+   /// The allocation functions the image was linked with
+   CxxUDOAllocationFuncs allocationFuncs;
+   /// The offset of the TLS block the image was linked with
+   int64_t tlsBlockOffset;
+   /// The size of the TLS block the image was linked with
+   uint64_t tlsBlockSize;
+   /// The symbols defined in the image
+   unordered_map<string_view, Symbol> symbols;
+   /// The object files that are contained in the image
+   unordered_set<const llvm::object::ObjectFile*> loadedObjects;
+};
+//---------------------------------------------------------------------------
+/// The JIT symbol resolver for the precompiled C++ UDOs
+class PrecompiledCxxUDOResolver : public llvm::JITSymbolResolver {
+   private:
+   using ObjectSymbol = CxxUDOStaticLibraries::ObjectSymbol;
+
+   /// The memory manager of the linker
+   CxxUDOMemoryManager& memoryManager;
    /// The linker
    llvm::RuntimeDyld& linker;
    /// The predefined, "external" symbols
    unordered_map<string_view, void*> predefinedSymbols;
-   /// The loaded libraries
-   unordered_map<string_view, StaticLibrary> staticLibs;
-   /// The mapping from a symbol to its object file
-   unordered_map<string_view, ObjectSymbol> symbolObjects;
+   /// The static libraries
+   const CxxUDOStaticLibraries* staticLibs = nullptr;
+   /// The runtime image that is mapped into the memory (if any)
+   const CxxUDORuntimeImage* runtimeImage = nullptr;
+   /// The address the runtime image is mapped at
+   uintptr_t runtimeImageAddress = 0;
+   /// The object files that were already loaded into the linker
+   unordered_set<const llvm::object::ObjectFile*> loadedObjects;
+   /// The functions of the loaded object files for the perf map
+   vector<PerfMapEntry> perfMapEntries;
+   /// The symbols that are referenced by hot code
+   unordered_set<string> hotSymbols;
 
    /// Try to load a symbol from the loaded libraries
-   llvm::JITEvaluatedSymbol loadSymbol(ObjectSymbol& symbol);
+   llvm::JITEvaluatedSymbol loadSymbol(const ObjectSymbol& symbol);
 
    public:
    /// Constructor
-   PrecompiledCxxUDOResolver(llvm::RuntimeDyld& linker, CxxUDOFunctors* functorStorage, CxxUDOAllocationFuncs allocationFuncs);
-
-   /// Add a library
-   tl::expected<void, string> addLibrary(string_view path);
+   PrecompiledCxxUDOResolver(CxxUDOMemoryManager& memoryManager, llvm::RuntimeDyld& linker, CxxUDOAllocationFuncs allocationFuncs);
+
+   /// Set the storage of the functors that are used by the C++ UDO
+   void setFunctorStorage(CxxUDOFunctors* functorStorage);
+   /// Replace the address of an allocation function
+   void setAllocationFunction(string_view name, void* address) { predefinedSymbols.insert_or_assign(name, address); }
+   /// Set the static libraries
+   void setStaticLibraries(const CxxUDOStaticLibraries* libraries) { staticLibs = libraries; }
+   /// Resolve the symbols of the runtime image that is mapped at the given address
+   void setRuntimeImage(const CxxUDORuntimeImage* image, uintptr_t address) {
+      runtimeImage = image;
+      runtimeImageAddress = address;
+   }
+   /// Get the object files that were loaded into the linker
+   const unordered_set<const llvm::object::ObjectFile*>& getLoadedObjects() const { return loadedObjects; }
+   /// Get the functions of the loaded object files for the perf map. They
+   /// are only collected if cxxUDOPerfMap is set.
+   vector<PerfMapEntry>& getPerfMapEntries() { return perfMapEntries; }
+   /// Get the functions of the loaded object files for the perf map
+   const vector<PerfMapEntry>& getPerfMapEntries() const { return perfMapEntries; }
+   /// Add the undefined symbols that are referenced by the hot code sections
+   /// of an object file to the hot symbols
+   void addHotReferences(const llvm::object::ObjectFile& objectFile);
 
    /// Lookup an individual symbol
    bool lookup(string_view name, optional_out<llvm::JITEvaluatedSymbol> symbol = {});
@@ -183,7 +702,6 @@ class PrecompiledCxxUDOResolver : public llvm::JITSymbolResolver {
    /// undefined weak symbols.
    bool allowsZeroSymbols() override { return true; }
 };
-//---------------------------------------------------------------------------
 namespace {
 //---------------------------------------------------------------------------
 extern "C" int udoDlFindObject(void* address, void* result)
@@ -199,8 +717,8 @@ extern "C" int udoDlFindObject(void* address, void* result)
 //---------------------------------------------------------------------------
 }
 //---------------------------------------------------------------------------
-PrecompiledCxxUDOResolver::PrecompiledCxxUDOResolver(llvm::RuntimeDyld& linker, CxxUDOFunctors* functorStorage, CxxUDOAllocationFuncs allocationFuncs)
-   : linker(linker)
+PrecompiledCxxUDOResolver::PrecompiledCxxUDOResolver(CxxUDOMemoryManager& memoryManager, llvm::RuntimeDyld& linker, CxxUDOAllocationFuncs allocationFuncs)
+   : memoryManager(memoryManager), linker(linker)
 // Constructor
 {
    // Our custom glibc enables its "Umbra mode" only if the symbol
@@ -216,184 +734,175 @@ PrecompiledCxxUDOResolver::PrecompiledCxxUDOResolver(llvm::RuntimeDyld& linker,
    predefinedSymbols.emplace("posix_memalign", reinterpret_cast<void*>(allocationFuncs.posixMemalign));
    predefinedSymbols.emplace("free", reinterpret_cast<void*>(allocationFuncs.free));
 
-   // Register the functor symbols
+   // Define the dl_find_object symbol. See the udoDlFindObject function for
+   // more information.
+   predefinedSymbols.emplace("_dl_find_object", reinterpret_cast<void*>(&udoDlFindObject));
+}
+//---------------------------------------------------------------------------
+void PrecompiledCxxUDOResolver::setFunctorStorage(CxxUDOFunctors* functorStorage)
+// Set the storage of the functors that are used by the C++ UDO
+{
    predefinedSymbols.emplace(CxxUDOCompiler::emitFunctorName, &functorStorage->emitFunctor);
+   predefinedSymbols.emplace(CxxUDOCompiler::emitBatchFunctorName, &functorStorage->emitBatchFunctor);
    predefinedSymbols.emplace(CxxUDOCompiler::printDebugFunctorName, &functorStorage->printDebugFunctor);
    predefinedSymbols.emplace(CxxUDOCompiler::getRandomFunctorName, &functorStorage->getRandomFunctor);
+}
+//---------------------------------------------------------------------------
+void PrecompiledCxxUDOResolver::addHotReferences(const llvm::object::ObjectFile& objectFile)
+// Add the undefined symbols that are referenced by the hot code sections of an
+// object file to the hot symbols
+{
+   for (auto& relocationSection : objectFile.sections()) {
+      auto section = relocationSection.getRelocatedSection();
+      if (!section) {
+         llvm::consumeError(section.takeError());
+         continue;
+      }
+      if (*section == objectFile.section_end() || !(*section)->isText())
+         continue;
+      auto sectionName = (*section)->getName();
+      if (!sectionName || isColdSection(*sectionName)) {
+         llvm::consumeError(sectionName.takeError());
+         continue;
+      }
 
-   // Define the dl_find_object symbol. See the udoDlFindObject function for
-   // more information.
-   predefinedSymbols.emplace("_dl_find_object", reinterpret_cast<void*>(&udoDlFindObject));
+      for (auto& relocation : relocationSection.relocations()) {
+         auto symbol = relocation.getSymbol();
+         if (symbol == objectFile.symbol_end())
+            continue;
+         auto flags = symbol->getFlags();
+         auto name = symbol->getName();
+         if (!flags || !name || !(*flags & llvm::object::SymbolRef::SF_Undefined)) {
+            llvm::consumeError(flags.takeError());
+            llvm::consumeError(name.takeError());
+            continue;
+         }
+         hotSymbols.emplace(name->str());
+      }
+   }
 }
 //---------------------------------------------------------------------------
-tl::expected<void, string> PrecompiledCxxUDOResolver::addLibrary(string_view path)
+tl::expected<void, string> CxxUDOStaticLibraries::addLibrary(string_view path)
 // Add a library
 {
-   if (staticLibs.count(path))
-      // We assume that the libraries never change once loaded, so skip loading
-      // it if it already exists.
-      return {};
-
+   UDOStats::PhaseTimer timer(UDOPhase::AddLibrary);
    if (debugCxxUDO)
       llvm::errs() << "opening static library " << asStringRef(path) << '\n';
 
    unique_ptr<llvm::MemoryBuffer> libBuffer;
    {
-      auto result = llvm::MemoryBuffer::getFile(string(path));
+      auto result = llvm::MemoryBuffer::getFile(string(path), false, false);
       if (!result)
          return tl::unexpected(trformat(tc, "couldn't open static library {0}: {1}", path, result.getError().message()));
       libBuffer = move(*result);
    }
 
-   unique_ptr<llvm::object::Archive> libArchive;
-   {
-      auto result = llvm::object::Archive::create(*libBuffer);
-      if (!result)
-         return tl::unexpected(trformat(tc, "error while reading static library {0}", path));
-      libArchive = move(*result);
-   }
-
-   deque<ObjectFile> objectFiles;
-   llvm::Error error = llvm::Error::success();
-   for (auto& child : libArchive->children(error)) {
-      unique_ptr<llvm::object::ObjectFile> libObject;
-      {
-         auto result = child.getAsBinary();
-         if (!result)
-            return tl::unexpected(trformat(tc, "error while reading object from static library {0}", path));
-         // Ignore archive contents that are not object files
-         if (auto objectFilePtr = llvm::dyn_cast<llvm::object::ObjectFile>(result->get()); objectFilePtr) {
-            result->release();
-            libObject.reset(objectFilePtr);
-         }
-      }
-      if (!libObject)
-         continue;
+   auto index = StaticLibraryIndex::get(path, *libBuffer);
+   if (!index)
+      return tl::unexpected(move(index).error());
 
-      auto& objectFile = objectFiles.emplace_back();
-      objectFile.objectFile = move(libObject);
-      bool isElf = objectFile.objectFile->isELF();
+   auto& staticLib = staticLibs.emplace_back();
+   staticLib.memoryBuffer = move(libBuffer);
+   staticLib.index = move(*index);
+   staticLib.objectFiles.resize(staticLib.index->getNumMembers());
 
-      if (debugCxxUDO) {
-         uint64_t tlsSize = 0;
-         if (isElf) {
-            for (auto& section : objectFile.objectFile->sections()) {
-               llvm::object::ELFSectionRef elfSection(section);
-               if (elfSection.getFlags() & llvm::ELF::SHF_TLS) {
-                  tlsSize += elfSection.getSize();
-               }
-            }
+   return {};
+}
+//---------------------------------------------------------------------------
+const llvm::object::ObjectFile* CxxUDOStaticLibraries::getObjectFile(const StaticLibrary& staticLib, uint32_t memberIndex) const
+// Get the object file of a member, returns nullptr if it is invalid
+{
+   unique_lock lock(objectFilesMutex);
+   auto& objectFile = staticLib.objectFiles[memberIndex];
+   if (objectFile)
+      return objectFile.get();
+
+   auto member = staticLib.index->getMember(memberIndex);
+   llvm::MemoryBufferRef memberBuffer(llvm::StringRef(staticLib.memoryBuffer->getBufferStart() + member.offset, member.size), asStringRef(member.name));
+   auto result = llvm::object::ObjectFile::createObjectFile(memberBuffer);
+   if (!result) {
+      llvm::consumeError(result.takeError());
+      return nullptr;
+   }
+   objectFile = move(*result);
+
+   if (debugCxxUDO && objectFile->isELF()) {
+      uint64_t tlsSize = 0;
+      for (auto& section : objectFile->sections()) {
+         llvm::object::ELFSectionRef elfSection(section);
+         if (elfSection.getFlags() & llvm::ELF::SHF_TLS) {
+            tlsSize += elfSection.getSize();
          }
-         if (tlsSize > 0)
-            llvm::errs() << "Need " << tlsSize << "B of TLS storage for " << objectFile.objectFile->getFileName() << '\n';
       }
+      if (tlsSize > 0)
+         llvm::errs() << "Need " << tlsSize << "B of TLS storage for " << objectFile->getFileName() << '\n';
+   }
 
-      for (auto& symbol : objectFile.objectFile->symbols()) {
-         // If we can't determine the name of a symbol, then of course we can't
-         // use it for linking
-         auto name = [&] {
-            auto result = symbol.getName();
-            if (result)
-               return asStringView(*result);
-            else
-               return string_view();
-         }();
-         if (name.empty())
-            continue;
+   return objectFile.get();
+}
+//---------------------------------------------------------------------------
+tl::expected<const CxxUDOStaticLibraries*, string> CxxUDOStaticLibraries::get(span<const string> paths)
+// Get the libraries with the given paths
+{
+   static mutex librariesMutex;
+   static unordered_map<string, unique_ptr<CxxUDOStaticLibraries>> loadedLibraries;
 
-         bool isUndefined = false;
-         if (auto section = symbol.getSection())
-            if (*section == objectFile.objectFile->section_end())
-               isUndefined = true;
-
-         if (isElf) {
-            llvm::object::ELFSymbolRef elfSymbol(symbol);
-            switch (elfSymbol.getBinding()) {
-               case llvm::ELF::STB_GLOBAL:
-               case llvm::ELF::STB_WEAK:
-               case llvm::ELF::STB_GNU_UNIQUE:
-                  // STB_GNU_UNIQUE is a GNU extension for global symbols
-                  break;
-               default:
-                  // Only global symbols (weak symbols are also considered
-                  // global) should be used to link multiple object files
-                  continue;
-            }
-            switch (elfSymbol.getELFType()) {
-               case llvm::ELF::STT_NOTYPE: {
-                  if (elfSymbol.getBinding() == llvm::ELF::STB_WEAK) {
-                     // Remember undefined weak symbols as they should resolve
-                     // to 0 if they are never defined.
-                     isUndefined = true;
-                     break;
-                  } else {
-                     continue;
-                  }
-               }
-               case llvm::ELF::STT_FUNC:
-               case llvm::ELF::STT_OBJECT:
-                  // Regular global function or data symbol
-               case llvm::ELF::STT_TLS:
-                  // Thread-local symbol that CxxUDOMemoryManager can also handle
-               case llvm::ELF::STT_GNU_IFUNC:
-                  // IFUNC symbols are handled by RuntimeDyld
-
-                  // Skip all other symbols if they are undefined
-                  if (isUndefined)
-                     continue;
-                  break;
-               default:
-                  continue;
-            }
-         } else {
-            // We are only interested in functions and data
-            auto symbolType = symbol.getType();
-            if (!symbolType)
-               continue;
-            switch (*symbolType) {
-               case llvm::object::SymbolRef::ST_Data:
-               case llvm::object::SymbolRef::ST_Function:
-                  break;
-               default:
-                  continue;
-            }
-         }
+   string key;
+   for (auto& path : paths) {
+      key += path;
+      key += '\0';
+   }
 
-         llvm::JITSymbolFlags flags;
-         if (auto result = llvm::JITSymbolFlags::fromObjectSymbol(symbol)) {
-            flags = *result;
-         } else {
-            // Ignore symbols with unknown flags
-            continue;
-         }
+   unique_lock lock(librariesMutex);
+   if (auto it = loadedLibraries.find(key); it != loadedLibraries.end())
+      return it->second.get();
 
-         ObjectSymbol newSymbol;
-         newSymbol.objectFile = &objectFile;
-         newSymbol.name = name;
-         newSymbol.undefined = isUndefined;
-         newSymbol.flags = flags;
-
-         if (auto it = symbolObjects.find(name); it == symbolObjects.end()) {
-            symbolObjects.emplace(name, newSymbol);
-         } else {
-            auto& symbol = it->second;
-            // Overwrite the existing symbol only if it's weak and undefined or
-            // if it's weak and the new one isn't.
-            if ((symbol.undefined && symbol.flags.isWeak()) || (!newSymbol.flags.isWeak() && symbol.flags.isWeak()))
-               symbol = newSymbol;
-         }
-      }
-   }
+   auto libraries = make_unique<CxxUDOStaticLibraries>();
+   for (auto& path : paths)
+      if (auto result = libraries->addLibrary(path); !result)
+         return tl::unexpected(move(result).error());
 
-   if (error)
-      return tl::unexpected(trformat(tc, "error while reading object file from static library {0}", path));
+   auto* librariesPtr = libraries.get();
+   loadedLibraries.emplace(move(key), move(libraries));
+   return librariesPtr;
+}
+//---------------------------------------------------------------------------
+optional<CxxUDOStaticLibraries::ObjectSymbol> CxxUDOStaticLibraries::findSymbol(string_view name) const
+// Find a symbol, returns nullopt if no library contains it
+{
+   const StaticLibrary* foundLib = nullptr;
+   optional<StaticLibraryIndex::Symbol> foundSymbol;
+   for (auto& staticLib : staticLibs) {
+      auto symbol = staticLib.index->findSymbol(name);
+      if (!symbol)
+         continue;
 
-   auto& staticLib = staticLibs[path];
-   staticLib.memoryBuffer = move(libBuffer);
-   staticLib.archive = move(libArchive);
-   staticLib.objectFiles = move(objectFiles);
+      if (!foundSymbol) {
+         foundLib = &staticLib;
+         foundSymbol = symbol;
+         continue;
+      }
 
-   return {};
+      // Overwrite the existing symbol only if it's weak and undefined or if
+      // it's weak and the new one isn't.
+      llvm::JITSymbolFlags foundFlags(static_cast<llvm::JITSymbolFlags::FlagNames>(foundSymbol->flags));
+      llvm::JITSymbolFlags newFlags(static_cast<llvm::JITSymbolFlags::FlagNames>(symbol->flags));
+      if ((foundSymbol->undefined && foundFlags.isWeak()) || (!newFlags.isWeak() && foundFlags.isWeak())) {
+         foundLib = &staticLib;
+         foundSymbol = symbol;
+      }
+   }
+   if (!foundSymbol)
+      return nullopt;
+
+   ObjectSymbol objectSymbol;
+   objectSymbol.objectFile = getObjectFile(*foundLib, foundSymbol->memberIndex);
+   if (!objectSymbol.objectFile)
+      return nullopt;
+   objectSymbol.name = foundSymbol->name;
+   objectSymbol.flags = llvm::JITSymbolFlags(static_cast<llvm::JITSymbolFlags::FlagNames>(foundSymbol->flags));
+   objectSymbol.undefined = foundSymbol->undefined;
+   return objectSymbol;
 }
 //---------------------------------------------------------------------------
 bool PrecompiledCxxUDOResolver::lookup(string_view name, optional_out<llvm::JITEvaluatedSymbol> symbol)
@@ -411,11 +920,10 @@ bool PrecompiledCxxUDOResolver::lookup(string_view name, optional_out<llvm::JITE
       }
    }
 
-   {
-      auto it = symbolObjects.find(name);
-      if (it != symbolObjects.end()) {
+   if (staticLibs) {
+      if (auto objectSymbol = staticLibs->findSymbol(name)) {
          if (symbol.has_value()) {
-            auto resolvedSymbol = loadSymbol(it->second);
+            auto resolvedSymbol = loadSymbol(*objectSymbol);
             symbol.report(move(resolvedSymbol));
          }
          return true;
@@ -425,23 +933,48 @@ bool PrecompiledCxxUDOResolver::lookup(string_view name, optional_out<llvm::JITE
    return false;
 }
 //---------------------------------------------------------------------------
-llvm::JITEvaluatedSymbol PrecompiledCxxUDOResolver::loadSymbol(ObjectSymbol& symbol)
+llvm::JITEvaluatedSymbol PrecompiledCxxUDOResolver::loadSymbol(const ObjectSymbol& symbol)
 // Try to load a symbol from the loaded libraries
 {
+   // Symbols from the runtime image are already linked
+   if (runtimeImage && !symbol.undefined) {
+      if (auto it = runtimeImage->symbols.find(symbol.name); it != runtimeImage->symbols.end()) {
+         auto value = it->second.value;
+         if (!it->second.isAbsolute)
+            value += runtimeImageAddress;
+         return llvm::JITEvaluatedSymbol(value, symbol.flags);
+      }
+   }
+
    // The object file only needs to be loaded if the symbol is actually defined in there
-   if (!symbol.undefined && !symbol.objectFile->isLoaded) {
+   if (!symbol.undefined && !loadedObjects.count(symbol.objectFile)) {
       if (debugCxxUDO)
-         llvm::errs() << "loading object file " << symbol.objectFile->objectFile->getFileName() << " for symbol " << symbol.name << '\n';
+         llvm::errs() << "loading object file " << symbol.objectFile->getFileName() << " for symbol " << symbol.name << '\n';
 
-      auto objectFileInfo = linker.loadObject(*symbol.objectFile->objectFile);
-      symbol.objectFile->isLoaded = true;
+      // An object file that is called from hot code is hot as well, the
+      // code it calls is then also hot
+      bool isHot = hotSymbols.count(string(symbol.name)) > 0;
+      if (isHot)
+         addHotReferences(*symbol.objectFile);
+
+      unique_ptr<llvm::RuntimeDyld::LoadedObjectInfo> objectFileInfo;
+      {
+         UDOStats::PhaseTimer timer(UDOPhase::LoadObject);
+         memoryManager.setLoadingHotObject(isHot);
+         objectFileInfo = linker.loadObject(*symbol.objectFile);
+         memoryManager.setLoadingHotObject(true);
+      }
+      loadedObjects.insert(symbol.objectFile);
+      UDOStats::count(&UDOStats::numArchiveMembersLoaded);
+      if (cxxUDOPerfMap && objectFileInfo)
+         collectPerfMapEntries(*symbol.objectFile, *objectFileInfo, perfMapEntries);
 
       if (debugCxxUDO) {
-         for (auto& section : symbol.objectFile->objectFile->sections()) {
+         for (auto& section : symbol.objectFile->sections()) {
             if (section.isText() && section.getSize() > 0) {
                auto beginAddress = objectFileInfo->getSectionLoadAddress(section);
                auto endAddress = beginAddress + section.getSize();
-               llvm::errs() << reinterpret_cast<void*>(beginAddress) << '\t' << reinterpret_cast<void*>(endAddress) << '\t' << symbol.objectFile->objectFile->getFileName() << '\n';
+               llvm::errs() << reinterpret_cast<void*>(beginAddress) << '\t' << reinterpret_cast<void*>(endAddress) << '\t' << symbol.objectFile->getFileName() << '\n';
             }
          }
       }
@@ -468,15 +1001,22 @@ void PrecompiledCxxUDOResolver::lookup(const LookupSet& symbols, OnResolvedFunct
 {
    LookupResult lookupResult;
 
-   for (auto& symbol : symbols) {
-      llvm::JITEvaluatedSymbol jitSymbol;
-      if (!lookup(asStringView(symbol), out(jitSymbol))) {
-         onResolved(llvm::Error(::make_unique<llvm::StringError>(llvm::Twine("Can't find symbol ") + symbol, error_code())));
-         return;
+   // The hot symbols are resolved first, so that an object file that defines
+   // hot and cold symbols is loaded as hot
+   for (bool resolveHot : {true, false}) {
+      for (auto& symbol : symbols) {
+         if ((hotSymbols.count(symbol.str()) > 0) != resolveHot)
+            continue;
+         llvm::JITEvaluatedSymbol jitSymbol;
+         if (!lookup(asStringView(symbol), out(jitSymbol))) {
+            onResolved(llvm::Error(::make_unique<llvm::StringError>(llvm::Twine("Can't find symbol ") + symbol, error_code())));
+            return;
+         }
+         lookupResult.emplace(symbol, move(jitSymbol));
       }
-      lookupResult.emplace(symbol, move(jitSymbol));
    }
 
+   UDOStats::count(&UDOStats::numSymbolsResolved, lookupResult.size());
    onResolved(move(lookupResult));
 }
 //---------------------------------------------------------------------------
@@ -500,10 +1040,14 @@ struct CompiledData {
    llvm::RuntimeDyld linker;
    /// The resolver for the C++ UDO functions
    PrecompiledCxxUDOResolver precompiledResolver;
+   /// The accounting of the allocations, nullptr if they are not accounted
+   AllocationAccounting* allocationAccounting = nullptr;
+   /// The accounted allocations
+   AllocationTable allocationTable;
 
    /// Constructor
-   CompiledData(CxxUDOFunctors* functorStorage, CxxUDOAllocationFuncs allocationFuncs, int64_t tlsBlockOffset, uint64_t tlsBlockSize)
-      : memoryManager(tlsBlockOffset, tlsBlockSize), linker(memoryManager, precompiledResolver), precompiledResolver(linker, functorStorage, allocationFuncs) {}
+   CompiledData(CxxUDOAllocationFuncs allocationFuncs, int64_t tlsBlockOffset, uint64_t tlsBlockSize)
+      : memoryManager(tlsBlockOffset, tlsBlockSize), linker(memoryManager, precompiledResolver), precompiledResolver(memoryManager, linker, allocationFuncs) {}
 
    // Get the address of a symbol
    void* lookup(string_view name);
@@ -519,6 +1063,413 @@ void* CompiledData::lookup(string_view name)
    return reinterpret_cast<void*>(symbol.getAddress());
 }
 //---------------------------------------------------------------------------
+bool CxxUDOMemoryManager::mapImage(const CxxUDOImage& image)
+// Map an image into the memory and allocate its TLS sections
+{
+   if (!memoryManager.mapImage(*image.memoryImage))
+      return false;
+
+   uint64_t delta = reinterpret_cast<uintptr_t>(memoryManager.getBaseAddress()) - image.memoryImage->getBaseAddress();
+   for (auto& section : image.tlsSections) {
+      auto* allocatedSection = tlsAllocations.allocateAt(section.storageOffset, section.size);
+      if (!allocatedSection)
+         return false;
+
+      auto* initializationImage = allocatedSection->initializationImage.get();
+      memcpy(initializationImage, section.initializationImage.get(), section.size);
+      for (auto offset : section.relocations) {
+         uint64_t value;
+         memcpy(&value, initializationImage + offset, sizeof(value));
+         value += delta;
+         memcpy(initializationImage + offset, &value, sizeof(value));
+      }
+   }
+
+   return true;
+}
+//---------------------------------------------------------------------------
+static tl::expected<const CxxUDOStaticLibraries*, string> getStaticLibraries()
+// Get the static libraries required for C++
+{
+   static mutex pathsMutex;
+   static unordered_map<unsigned, vector<string>> staticLibPaths;
+
+   auto optLevel = CxxUDOCompiler::getOptLevel();
+
+   unique_lock lock(pathsMutex);
+   auto& staticLibs = staticLibPaths[optLevel];
+   if (staticLibs.empty()) {
+      auto compilation = ClangCompiler::createCompilation(optLevel);
+      auto& args = compilation->getArgs();
+      auto& toolChain = compilation->getDefaultToolChain();
+
+      bool needsLibunwind = false;
+      switch (toolChain.GetRuntimeLibType(args)) {
+         case clang::driver::ToolChain::RLT_CompilerRT:
+            staticLibs.push_back(toolChain.getCompilerRT(args, "builtins"));
+            needsLibunwind = true;
+            break;
+         case clang::driver::ToolChain::RLT_Libgcc:
+            staticLibs.push_back(toolChain.GetFilePath("libgcc_eh.a"));
+            staticLibs.push_back(toolChain.GetFilePath("libgcc.a"));
+            needsLibunwind = toolChain.GetUnwindLibType(args) == clang::driver::ToolChain::UNW_CompilerRT;
+            break;
+      }
+
+      if (needsLibunwind)
+         staticLibs.push_back(toolChain.GetFilePath("libunwind.a"));
+
+      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libm-2.33.a");
+      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libmvec.a");
+
+      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libc.a");
+      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libpthread.a");
+
+      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libc++abi.a");
+      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libc++.a");
+   }
+
+   return CxxUDOStaticLibraries::get(staticLibs);
+}
+//---------------------------------------------------------------------------
+/// The symbols whose objects (and their dependencies) are linked into the
+/// runtime image. These are used by the generated code of every C++ UDO or
+/// by almost all C++ code.
+static constexpr array runtimeImageRoots = {
+   // libc initialization, see CxxUDOCompiler::preprocessModule()
+   "__libc_start_main",
+   "__ctype_init",
+   // Functions that the compiler emits calls to
+   "memcpy",
+   "memmove",
+   "memset",
+   "memcmp",
+   "strlen",
+   "abort",
+   // The C++ ABI
+   "__cxa_atexit",
+   "__cxa_guard_acquire",
+   "__cxa_guard_release",
+   "__cxa_pure_virtual",
+   "_Znwm",
+   "_Znam",
+   "_ZdlPv",
+   "_ZdaPv",
+   "_ZdlPvm",
+   "_ZnwmSt11align_val_t",
+   "_ZdlPvSt11align_val_t",
+};
+//---------------------------------------------------------------------------
+static unique_ptr<UDOMemoryManager::Image> createImage(const CompiledData& first, const CompiledData& second, vector<CxxUDOImage::TLSSection>& tlsSections, vector<PerfMapEntry>& perfMapEntries)
+// Create an image from two linked objects that contain the same objects at
+// different addresses. Returns nullptr if they differ in any other way. The
+// functions of the first one are added to the perf map entries relative to
+// the image.
+{
+   auto memoryImage = UDOMemoryManager::createImage(first.memoryManager.getMemoryManager(), second.memoryManager.getMemoryManager());
+   if (!memoryImage)
+      return nullptr;
+
+   auto firstBase = reinterpret_cast<uintptr_t>(first.memoryManager.getMemoryManager().getBaseAddress());
+   auto secondBase = reinterpret_cast<uintptr_t>(second.memoryManager.getMemoryManager().getBaseAddress());
+
+   auto firstSections = first.memoryManager.getTLSAllocations().getAllocatedTLSSections();
+   auto secondSections = second.memoryManager.getTLSAllocations().getAllocatedTLSSections();
+   if (firstSections.size() != secondSections.size())
+      return nullptr;
+   for (size_t i = 0; i < firstSections.size(); ++i) {
+      auto& firstSection = firstSections[i];
+      auto& secondSection = secondSections[i];
+      if (firstSection.storageOffset != secondSection.storageOffset || firstSection.size != secondSection.size)
+         return nullptr;
+
+      auto& section = tlsSections.emplace_back();
+      section.storageOffset = firstSection.storageOffset;
+      section.size = firstSection.size;
+      section.initializationImage = make_unique<char[]>(firstSection.size);
+      memcpy(section.initializationImage.get(), firstSection.initializationImage.get(), firstSection.size);
+      auto firstBytes = as_bytes(span(firstSection.initializationImage.get(), firstSection.size));
+      auto secondBytes = as_bytes(span(secondSection.initializationImage.get(), secondSection.size));
+      if (!UDOMemoryManager::findRelocations(firstBytes, secondBytes, secondBase - firstBase, section.relocations))
+         return nullptr;
+   }
+
+   // The functions are stored relative to the image, so that they can be
+   // written to the perf map wherever the image is mapped
+   for (auto& entry : first.precompiledResolver.getPerfMapEntries())
+      if (entry.address >= firstBase && entry.address < firstBase + memoryImage->getSize())
+         perfMapEntries.push_back({entry.address - firstBase, entry.size, entry.name});
+
+   return memoryImage;
+}
+//---------------------------------------------------------------------------
+static unique_ptr<CxxUDORuntimeImage> createRuntimeImage(const CxxUDOStaticLibraries& staticLibs, CxxUDOAllocationFuncs allocationFuncs, int64_t tlsBlockOffset, uint64_t tlsBlockSize)
+// Create the runtime image. The objects are linked twice at different
+// addresses so that the absolute addresses can be found that must be relocated
+// when the image is mapped at another address.
+{
+   auto image = make_unique<CxxUDORuntimeImage>();
+   image->staticLibs = &staticLibs;
+   image->allocationFuncs = allocationFuncs;
+   image->tlsBlockOffset = tlsBlockOffset;
+   image->tlsBlockSize = tlsBlockSize;
+
+   array<optional<CompiledData>, 2> linkedData;
+   for (auto& compiledData : linkedData) {
+      compiledData.emplace(allocationFuncs, tlsBlockOffset, tlsBlockSize);
+      compiledData->precompiledResolver.setStaticLibraries(&staticLibs);
+      for (auto* root : runtimeImageRoots) {
+         llvm::JITEvaluatedSymbol symbol;
+         compiledData->precompiledResolver.lookup(root, out(symbol));
+      }
+      compiledData->linker.finalizeWithMemoryManagerLocking();
+      if (compiledData->linker.hasError())
+         return image;
+   }
+
+   auto& first = *linkedData[0];
+   auto& second = *linkedData[1];
+   if (first.precompiledResolver.getLoadedObjects() != second.precompiledResolver.getLoadedObjects())
+      return image;
+
+   auto memoryImage = createImage(first, second, image->tlsSections, image->perfMapEntries);
+   if (!memoryImage)
+      return image;
+
+   auto firstBase = reinterpret_cast<uintptr_t>(first.memoryManager.getMemoryManager().getBaseAddress());
+
+   image->loadedObjects = first.precompiledResolver.getLoadedObjects();
+   for (auto* objectFile : image->loadedObjects) {
+      for (auto& objectSymbol : objectFile->symbols()) {
+         auto nameResult = objectSymbol.getName();
+         if (!nameResult)
+            continue;
+         auto name = asStringView(*nameResult);
+         // Only use the symbols that are resolved to this object file
+         auto symbol = staticLibs.findSymbol(name);
+         if (!symbol || symbol->undefined || symbol->objectFile != objectFile)
+            continue;
+
+         auto address = first.linker.getSymbol(asStringRef(name)).getAddress();
+         if (address >= firstBase && address < firstBase + memoryImage->getSize())
+            image->symbols.emplace(symbol->name, CxxUDORuntimeImage::Symbol{address - firstBase, false});
+         else
+            image->symbols.emplace(symbol->name, CxxUDORuntimeImage::Symbol{address, true});
+      }
+   }
+
+   if (debugCxxUDO)
+      llvm::errs() << "created C++ UDO runtime image with " << image->loadedObjects.size() << " objects, " << memoryImage->getSize() << "B\n";
+
+   image->memoryImage = move(memoryImage);
+   return image;
+}
+//---------------------------------------------------------------------------
+static const CxxUDORuntimeImage* getRuntimeImage(const CxxUDOStaticLibraries& staticLibs, CxxUDOAllocationFuncs allocationFuncs, int64_t tlsBlockOffset, uint64_t tlsBlockSize)
+// Get the runtime image for the given parameters, returns nullptr if no image
+// could be created
+{
+   static mutex imagesMutex;
+   static vector<unique_ptr<CxxUDORuntimeImage>> images;
+
+   unique_lock lock(imagesMutex);
+   for (auto& image : images)
+      if (image->staticLibs == &staticLibs && memcmp(&image->allocationFuncs, &allocationFuncs, sizeof(allocationFuncs)) == 0 && image->tlsBlockOffset == tlsBlockOffset && image->tlsBlockSize == tlsBlockSize)
+         return image->memoryImage ? image.get() : nullptr;
+
+   // Remember images that could not be created so that this is not retried
+   auto& image = images.emplace_back(createRuntimeImage(staticLibs, allocationFuncs, tlsBlockOffset, tlsBlockSize));
+   return image->memoryImage ? image.get() : nullptr;
+}
+//---------------------------------------------------------------------------
+static tl::expected<CxxUDOFunctors*, string> linkObjectFile(CompiledData& compiledData, span<const char> objectFileData, CxxUDOAllocationFuncs allocationFuncs, int64_t tlsBlockOffset, uint64_t tlsBlockSize)
+// Link an object file of a C++ UDO, returns the storage of its functors
+{
+   auto staticLibs = getStaticLibraries();
+   if (!staticLibs)
+      return tl::unexpected(move(staticLibs).error());
+
+   auto& memoryManager = compiledData.memoryManager;
+   compiledData.precompiledResolver.setStaticLibraries(*staticLibs);
+
+   // The libraries in the runtime image call the allocation functions
+   // directly, so it cannot be used when the allocations are accounted
+   if (cxxUDORuntimeImage.get() && !cxxUDOAllocationAccounting.get()) {
+      if (auto* image = getRuntimeImage(**staticLibs, allocationFuncs, tlsBlockOffset, tlsBlockSize)) {
+         if (!memoryManager.mapImage(*image))
+            return tl::unexpected(string(tr(tc, "could not map the runtime image for C++ UDO")));
+         auto imageAddress = reinterpret_cast<uintptr_t>(memoryManager.getMemoryManager().getBaseAddress());
+         compiledData.precompiledResolver.setRuntimeImage(image, imageAddress);
+         // The functions of the runtime image are written to the perf map
+         // together with the ones of the UDO at the address they are mapped at
+         if (cxxUDOPerfMap)
+            for (auto& entry : image->perfMapEntries)
+               compiledData.precompiledResolver.getPerfMapEntries().push_back({imageAddress + entry.address, entry.size, entry.name});
+      }
+   }
+
+   // The functors are stored in the data pages of the UDO so that every
+   // instance of the UDO gets its own copy
+   auto* functorStorage = reinterpret_cast<CxxUDOFunctors*>(memoryManager.allocateDataSection(sizeof(CxxUDOFunctors), alignof(CxxUDOFunctors), 0, {}, false));
+   if (!functorStorage)
+      return tl::unexpected(string(tr(tc, "could not allocate memory for C++ UDO")));
+   compiledData.precompiledResolver.setFunctorStorage(functorStorage);
+
+   if (cxxUDOAllocationAccounting.get()) {
+      // The accounting is also stored in the data pages, so every instance
+      // has its own. The UDO calls the allocation functions through thunks
+      // that pass the accounting that is next to them.
+      auto* accountingStorage = memoryManager.allocateDataSection(sizeof(AllocationAccounting), alignof(AllocationAccounting), 0, {}, false);
+      auto* thunks = reinterpret_cast<byte*>(memoryManager.allocateCodeSection(5 * allocationThunkSize, 16, 0, {}));
+      if (!accountingStorage || !thunks)
+         return tl::unexpected(string(tr(tc, "could not allocate memory for C++ UDO")));
+      auto* accounting = new (accountingStorage) AllocationAccounting(allocationFuncs);
+      compiledData.allocationAccounting = accounting;
+
+      auto addThunk = [&](string_view name, ThunkRegister argumentRegister, const void* target) {
+         writeAllocationThunk(thunks, accounting, argumentRegister, target);
+         compiledData.precompiledResolver.setAllocationFunction(name, thunks);
+         thunks += allocationThunkSize;
+      };
+      addThunk("malloc", ThunkRegister::Rsi, reinterpret_cast<const void*>(&accountedMalloc));
+      addThunk("calloc", ThunkRegister::Rdx, reinterpret_cast<const void*>(&accountedCalloc));
+      addThunk("realloc", ThunkRegister::Rdx, reinterpret_cast<const void*>(&accountedRealloc));
+      addThunk("posix_memalign", ThunkRegister::Rcx, reinterpret_cast<const void*>(&accountedPosixMemalign));
+      addThunk("free", ThunkRegister::Rsi, reinterpret_cast<const void*>(&accountedFree));
+   }
+
+   llvm::MemoryBufferRef objectFileBufferRef({objectFileData.data(), objectFileData.size()}, "cxxudo.o");
+   unique_ptr<llvm::object::ObjectFile> objectFile;
+   {
+      auto result = llvm::object::ObjectFile::createObjectFile(objectFileBufferRef);
+      if (!result)
+         return tl::unexpected(string(tr(tc, "invalid object file for C++ UDO")));
+      objectFile = move(*result);
+   }
+
+   // The code of the UDO itself is hot, except for the functions that the
+   // compiler placed in cold sections
+   if (cxxUDOHotColdLayout.get())
+      compiledData.precompiledResolver.addHotReferences(*objectFile);
+
+   auto& linker = compiledData.linker;
+   unique_ptr<llvm::RuntimeDyld::LoadedObjectInfo> objectFileInfo;
+   {
+      UDOStats::PhaseTimer timer(UDOPhase::LoadObject);
+      objectFileInfo = linker.loadObject(*objectFile);
+   }
+   if (cxxUDOPerfMap && objectFileInfo)
+      collectPerfMapEntries(*objectFile, *objectFileInfo, compiledData.precompiledResolver.getPerfMapEntries());
+   {
+      UDOStats::PhaseTimer timer(UDOPhase::Finalize);
+      linker.finalizeWithMemoryManagerLocking();
+   }
+
+   if (linker.hasError()) {
+      auto error = asStringView(linker.getErrorString());
+      return tl::unexpected(trformat(tc, "error when linking C++ UDO: {0}", error));
+   }
+
+   return functorStorage;
+}
+//---------------------------------------------------------------------------
+static CxxUDOFunctions lookupFunctions(CompiledData& compiledData)
+// Get the function pointers of a linked C++ UDO
+{
+   CxxUDOFunctions functions;
+#define R(name) \
+   functions.name = reinterpret_cast<decltype(functions.name)>(compiledData.lookup(CxxUDOCompiler::name##Name));
+   R(globalConstructor)
+   R(globalDestructor)
+   R(threadInit)
+   R(constructor)
+   R(destructor)
+   R(accept)
+   R(acceptBatch)
+   R(flushEmit)
+   R(extraWork)
+   R(process)
+#undef R
+
+   return functions;
+}
+//---------------------------------------------------------------------------
+template <typename T>
+static T* relocatePointer(T* ptr, uintptr_t oldBase, uintptr_t newBase)
+// Move a pointer into an image from one base address to another
+{
+   if (!ptr)
+      return nullptr;
+   return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(ptr) - oldBase + newBase);
+}
+//---------------------------------------------------------------------------
+/// The threads on which the instances of C++ UDOs were initialized. All
+/// instances use the same TLS block of the host, so a thread can only be used
+/// by one instance at a time.
+class InstanceThreads {
+   private:
+   /// The mutex that protects the owners
+   mutex ownersMutex;
+   /// The instance that currently uses the TLS of a thread
+   unordered_map<thread::id, const CxxUDOInstance*> owners;
+
+   public:
+   /// Use the TLS of the current thread for an instance and release the
+   /// thread it used before. Returns false if another instance uses it.
+   bool claim(const CxxUDOInstance* instance, thread::id& ownedThread);
+   /// Release the thread used by an instance
+   void release(thread::id& ownedThread);
+
+   /// Get the instance
+   static InstanceThreads& get();
+};
+//---------------------------------------------------------------------------
+bool InstanceThreads::claim(const CxxUDOInstance* instance, thread::id& ownedThread)
+// Use the TLS of the current thread for an instance
+{
+   auto currentThread = this_thread::get_id();
+   if (ownedThread == currentThread)
+      return true;
+
+   unique_lock lock(ownersMutex);
+   auto [it, inserted] = owners.try_emplace(currentThread, instance);
+   if (!inserted)
+      return false;
+   if (ownedThread != thread::id())
+      owners.erase(ownedThread);
+   ownedThread = currentThread;
+   return true;
+}
+//---------------------------------------------------------------------------
+void InstanceThreads::release(thread::id& ownedThread)
+// Release the thread used by an instance
+{
+   if (ownedThread == thread::id())
+      return;
+   unique_lock lock(ownersMutex);
+   owners.erase(ownedThread);
+   ownedThread = thread::id();
+}
+//---------------------------------------------------------------------------
+InstanceThreads& InstanceThreads::get()
+// Get the instance
+{
+   // Intentionally leaked, instances may be destroyed during process exit
+   static auto* instanceThreads = new InstanceThreads();
+   return *instanceThreads;
+}
+//---------------------------------------------------------------------------
+/// The image of a linked C++ UDO from which its instances are created
+struct CxxUDOInstanceImage : CxxUDOImage {
+   /// The functors in the image
+   CxxUDOFunctors* functorStorage;
+   /// The function pointers in the image
+   CxxUDOFunctions functions;
+   /// The accounting of the allocations in the image, nullptr if they are not
+   /// accounted
+   AllocationAccounting* allocationAccounting;
+};
+//---------------------------------------------------------------------------
 } // namespace
 //---------------------------------------------------------------------------
 unique_ptr<byte[]> CxxUDOExecution::createLibcConstructorArg()
@@ -560,17 +1511,52 @@ unique_ptr<byte[]> CxxUDOExecution::createLibcConstructorArg()
 //---------------------------------------------------------------------------
 /// The implementation of `CxxUDOExecution`
 struct CxxUDOExecution::Impl {
-   /// The functors. The pointer of this value will be linked into the UDO
-   /// object file, so we put it in a unique_ptr to make sure that its address
-   /// doesn't change.
+   /// The functors that are copied into the UDO on every execution
    unique_ptr<CxxUDOFunctors> functorStorage;
+   /// The functors that are linked into the UDO
+   CxxUDOFunctors* linkedFunctors = nullptr;
    /// The compiled data
    optional<CompiledData> compiledData;
    /// The pointers to the compiled functions
    CxxUDOFunctions compiledFunctions;
+   /// The allocation functions the UDO was linked with
+   CxxUDOAllocationFuncs allocationFuncs;
+   /// The offset of the TLS block the UDO was linked with
+   int64_t tlsBlockOffset = 0;
+   /// The size of the TLS block the UDO was linked with
+   uint64_t tlsBlockSize = 0;
+   /// The limit of the allocations, 0 for unlimited
+   uint64_t allocationLimit = 0;
+   /// The mutex that protects the instance image
+   mutex instanceImageMutex;
+   /// The image for the instances, created by the first call to instantiate()
+   unique_ptr<CxxUDOInstanceImage> instanceImage;
 };
 //---------------------------------------------------------------------------
-CxxUDOExecution::CxxUDOExecution(span<char> objectFile)
+/// The implementation of `CxxUDOInstance`
+struct CxxUDOInstance::Impl {
+   /// The memory manager of the instance
+   CxxUDOMemoryManager memoryManager;
+   /// The functors that are copied into the UDO on every execution
+   CxxUDOFunctors functors = {};
+   /// The functors in the memory of the instance
+   CxxUDOFunctors* linkedFunctors = nullptr;
+   /// The function pointers of the instance
+   CxxUDOFunctions functions = {};
+   /// The accounting of the allocations in the memory of the instance
+   AllocationAccounting* allocationAccounting = nullptr;
+   /// The accounted allocations of the instance
+   AllocationTable allocationTable;
+   /// The limit of the allocations, 0 for unlimited
+   uint64_t allocationLimit = 0;
+   /// The thread whose TLS the instance uses
+   thread::id ownedThread;
+
+   /// Constructor
+   Impl(int64_t tlsBlockOffset, uint64_t tlsBlockSize) : memoryManager(tlsBlockOffset, tlsBlockSize) {}
+};
+//---------------------------------------------------------------------------
+CxxUDOExecution::CxxUDOExecution(span<const char> objectFile)
    : objectFile(objectFile), impl(make_unique<Impl>())
 // Construct from a compiled UDO object file
 {
@@ -585,63 +1571,19 @@ tl::expected<void, std::string> CxxUDOExecution::link(CxxUDOAllocationFuncs allo
 // Link the object file
 {
    impl->functorStorage = make_unique<CxxUDOFunctors>();
-
-   impl->compiledData.emplace(impl->functorStorage.get(), allocationFuncs, tlsBlockOffset, tlsBlockSize);
-
-   // Add the static libraries required for C++
-   vector<string> staticLibs;
-   {
-      auto compilation = ClangCompiler::createCompilation(CxxUDOCompiler::getOptLevel());
-      auto& args = compilation->getArgs();
-      auto& toolChain = compilation->getDefaultToolChain();
-
-      bool needsLibunwind = false;
-      switch (toolChain.GetRuntimeLibType(args)) {
-         case clang::driver::ToolChain::RLT_CompilerRT:
-            staticLibs.push_back(toolChain.getCompilerRT(args, "builtins"));
-            needsLibunwind = true;
-            break;
-         case clang::driver::ToolChain::RLT_Libgcc:
-            staticLibs.push_back(toolChain.GetFilePath("libgcc_eh.a"));
-            staticLibs.push_back(toolChain.GetFilePath("libgcc.a"));
-            needsLibunwind = toolChain.GetUnwindLibType(args) == clang::driver::ToolChain::UNW_CompilerRT;
-            break;
-      }
-
-      if (needsLibunwind)
-         staticLibs.push_back(toolChain.GetFilePath("libunwind.a"));
-
-      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libm-2.33.a");
-      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libmvec.a");
-
-      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libc.a");
-      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libpthread.a");
-
-      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libc++abi.a");
-      staticLibs.push_back(string(cxxUDODepsPrefix) + "/lib/libc++.a");
-   }
-
-   for (auto& lib : staticLibs)
-      if (auto result = impl->compiledData->precompiledResolver.addLibrary(lib); !result)
-         return result;
-
-   llvm::MemoryBufferRef objectFileBufferRef({objectFile.data(), objectFile.size()}, "cxxudo.o");
-   unique_ptr<llvm::object::ObjectFile> objectFile;
-   {
-      auto result = llvm::object::ObjectFile::createObjectFile(objectFileBufferRef);
-      if (!result)
-         return tl::unexpected(string(tr(tc, "invalid object file for C++ UDO")));
-      objectFile = move(*result);
-   }
-
-   auto& linker = impl->compiledData->linker;
-   linker.loadObject(*objectFile);
-   linker.finalizeWithMemoryManagerLocking();
-
-   if (linker.hasError()) {
-      auto error = asStringView(linker.getErrorString());
-      return tl::unexpected(trformat(tc, "error when linking C++ UDO: {0}", error));
-   }
+   impl->allocationFuncs = allocationFuncs;
+   impl->tlsBlockOffset = tlsBlockOffset;
+   impl->tlsBlockSize = tlsBlockSize;
+
+   impl->compiledData.emplace(allocationFuncs, tlsBlockOffset, tlsBlockSize);
+   auto result = linkObjectFile(*impl->compiledData, objectFile, allocationFuncs, tlsBlockOffset, tlsBlockSize);
+   if (!result)
+      return tl::unexpected(move(result).error());
+   impl->linkedFunctors = *result;
+   // Only this link is written to the perf map, the links for the images are
+   // at temporary addresses that are reused later
+   if (cxxUDOPerfMap)
+      writePerfMap(impl->compiledData->precompiledResolver.getPerfMapEntries(), 0);
 
    return {};
 }
@@ -659,21 +1601,161 @@ CxxUDOFunctions CxxUDOExecution::initialize()
    auto& compiledData = *impl->compiledData;
    compiledData.memoryManager.getMemoryManager().initialize();
    compiledData.memoryManager.getTLSAllocations().initializeTLS();
+   *impl->linkedFunctors = *impl->functorStorage;
+   if (compiledData.allocationAccounting) {
+      compiledData.allocationAccounting->attach(compiledData.allocationTable);
+      compiledData.allocationAccounting->limit.store(impl->allocationLimit, memory_order_relaxed);
+   }
 
-   CxxUDOFunctions functions;
+   return lookupFunctions(compiledData);
+}
+//---------------------------------------------------------------------------
+void CxxUDOExecution::initializeThread() const
+// Initialize the thread-local storage of the UDO for the current thread
+{
+   impl->compiledData->memoryManager.getTLSAllocations().initializeTLS();
+}
+//---------------------------------------------------------------------------
+uint64_t CxxUDOExecution::getMemoryUsage() const
+// Get the memory that is used by the linked UDO in bytes
+{
+   if (!impl->compiledData)
+      return 0;
+   auto& memoryManager = impl->compiledData->memoryManager.getMemoryManager();
+   uint64_t usage = memoryManager.getAllocatedSize() + memoryManager.getFrozenDataSize();
+
+   unique_lock lock(impl->instanceImageMutex);
+   if (impl->instanceImage && impl->instanceImage->memoryImage)
+      usage += impl->instanceImage->memoryImage->getSize();
+   return usage;
+}
+//---------------------------------------------------------------------------
+optional<CxxUDOAllocationStats> CxxUDOExecution::getAllocationStats() const
+// Get the statistics about the allocations of the UDO
+{
+   if (!impl->compiledData || !impl->compiledData->allocationAccounting)
+      return nullopt;
+   return impl->compiledData->allocationAccounting->getStats();
+}
+//---------------------------------------------------------------------------
+void CxxUDOExecution::setAllocationLimit(uint64_t limit)
+// Set the maximum number of bytes the UDO may have allocated at a time
+{
+   impl->allocationLimit = limit;
+   if (impl->compiledData && impl->compiledData->allocationAccounting)
+      impl->compiledData->allocationAccounting->limit.store(limit, memory_order_relaxed);
+}
+//---------------------------------------------------------------------------
+tl::expected<unique_ptr<CxxUDOInstance>, string> CxxUDOExecution::instantiate()
+// Create a new instance of the linked UDO
+{
+   unique_lock lock(impl->instanceImageMutex);
+   if (!impl->instanceImage) {
+      // The UDO is linked twice at different addresses so that the absolute
+      // addresses can be found that must be relocated for every instance.
+      array<optional<CompiledData>, 2> linkedData;
+      array<CxxUDOFunctors*, 2> functorStorages;
+      for (size_t i = 0; i < linkedData.size(); ++i) {
+         linkedData[i].emplace(impl->allocationFuncs, impl->tlsBlockOffset, impl->tlsBlockSize);
+         auto result = linkObjectFile(*linkedData[i], objectFile, impl->allocationFuncs, impl->tlsBlockOffset, impl->tlsBlockSize);
+         if (!result)
+            return tl::unexpected(move(result).error());
+         functorStorages[i] = *result;
+      }
+
+      auto instanceImage = make_unique<CxxUDOInstanceImage>();
+      instanceImage->memoryImage = createImage(*linkedData[0], *linkedData[1], instanceImage->tlsSections, instanceImage->perfMapEntries);
+      if (!instanceImage->memoryImage)
+         return tl::unexpected(string(tr(tc, "could not create an image for the instances of C++ UDO")));
+      instanceImage->functorStorage = functorStorages[0];
+      instanceImage->functions = lookupFunctions(*linkedData[0]);
+      instanceImage->allocationAccounting = linkedData[0]->allocationAccounting;
+      impl->instanceImage = move(instanceImage);
+   }
+   auto& instanceImage = *impl->instanceImage;
+   lock.unlock();
+
+   unique_ptr<CxxUDOInstance> instance(new CxxUDOInstance());
+   instance->impl = make_unique<CxxUDOInstance::Impl>(impl->tlsBlockOffset, impl->tlsBlockSize);
+   auto& instanceImpl = *instance->impl;
+   if (!instanceImpl.memoryManager.mapImage(instanceImage) || instanceImpl.memoryManager.finalizeMemory(nullptr))
+      return tl::unexpected(string(tr(tc, "could not map the image of C++ UDO")));
+
+   auto oldBase = instanceImage.memoryImage->getBaseAddress();
+   auto newBase = reinterpret_cast<uintptr_t>(instanceImpl.memoryManager.getMemoryManager().getBaseAddress());
+   if (cxxUDOPerfMap)
+      writePerfMap(instanceImage.perfMapEntries, newBase);
+   instanceImpl.linkedFunctors = relocatePointer(instanceImage.functorStorage, oldBase, newBase);
+   instanceImpl.allocationAccounting = relocatePointer(instanceImage.allocationAccounting, oldBase, newBase);
+   auto& functions = instanceImpl.functions;
+   auto& imageFunctions = instanceImage.functions;
 #define R(name) \
-   functions.name = reinterpret_cast<decltype(functions.name)>(compiledData.lookup(CxxUDOCompiler::name##Name));
+   functions.name = relocatePointer(imageFunctions.name, oldBase, newBase);
    R(globalConstructor)
    R(globalDestructor)
    R(threadInit)
    R(constructor)
    R(destructor)
    R(accept)
+   R(acceptBatch)
+   R(flushEmit)
    R(extraWork)
    R(process)
 #undef R
 
-   return functions;
+   return instance;
+}
+//---------------------------------------------------------------------------
+CxxUDOInstance::CxxUDOInstance()
+// Constructor
+{
+}
+//---------------------------------------------------------------------------
+CxxUDOInstance::~CxxUDOInstance()
+// Destructor
+{
+   if (impl)
+      InstanceThreads::get().release(impl->ownedThread);
+}
+//---------------------------------------------------------------------------
+CxxUDOFunctors& CxxUDOInstance::getFunctors() const
+// Get the the functors. The may be modified for a new execution.
+{
+   return impl->functors;
+}
+//---------------------------------------------------------------------------
+tl::expected<CxxUDOFunctions, string> CxxUDOInstance::initialize()
+// Initialize the memory and return the function pointers that are ready to
+// be called.
+{
+   if (!InstanceThreads::get().claim(this, impl->ownedThread))
+      return tl::unexpected(string(tr(tc, "the thread already executes another instance of a C++ UDO")));
+
+   impl->memoryManager.getMemoryManager().initialize();
+   impl->memoryManager.getTLSAllocations().initializeTLS();
+   *impl->linkedFunctors = impl->functors;
+   if (impl->allocationAccounting) {
+      impl->allocationAccounting->attach(impl->allocationTable);
+      impl->allocationAccounting->limit.store(impl->allocationLimit, memory_order_relaxed);
+   }
+
+   return impl->functions;
+}
+//---------------------------------------------------------------------------
+optional<CxxUDOAllocationStats> CxxUDOInstance::getAllocationStats() const
+// Get the statistics about the allocations of the instance
+{
+   if (!impl->allocationAccounting)
+      return nullopt;
+   return impl->allocationAccounting->getStats();
+}
+//---------------------------------------------------------------------------
+void CxxUDOInstance::setAllocationLimit(uint64_t limit)
+// Set the maximum number of bytes the instance may have allocated at a time
+{
+   impl->allocationLimit = limit;
+   if (impl->allocationAccounting)
+      impl->allocationAccounting->limit.store(limit, memory_order_relaxed);
 }
 //---------------------------------------------------------------------------
 }
@@ -2,8 +2,10 @@
 #define H_udo_CxxUDOExecution
 //---------------------------------------------------------------------------
 #include "thirdparty/tl/expected.hpp"
+#include <array>
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <span>
 #include <string>
 #include <type_traits>
@@ -30,6 +32,10 @@ struct CxxUDOFunctors {
    CxxUDOFunctor<void(void*, const char*, uint64_t)> printDebugFunctor;
    /// The functor for getRandom
    CxxUDOFunctor<uint64_t(void*)> getRandomFunctor;
+   /// The functor for the batch emit callback that is used instead of
+   /// emitFunctor when output tuples are buffered. It gets the execution
+   /// state, a pointer to the first tuple and the number of tuples.
+   CxxUDOFunctor<void(void*, void*, void*, const void*, uint64_t)> emitBatchFunctor;
 };
 //---------------------------------------------------------------------------
 /// The allocation functions that will be used to link the C++ UDO
@@ -41,6 +47,28 @@ struct CxxUDOAllocationFuncs {
    std::add_pointer_t<void(void*)> free;
 };
 //---------------------------------------------------------------------------
+/// The statistics about the memory that a C++ UDO allocated with the
+/// allocation functions since it was initialized
+struct CxxUDOAllocationStats {
+   /// The number of size classes of the histogram
+   static constexpr unsigned numSizeClasses = 32;
+
+   /// The number of bytes that are currently allocated
+   uint64_t liveBytes = 0;
+   /// The maximum of liveBytes
+   uint64_t peakBytes = 0;
+   /// The number of successful allocations, including reallocations
+   uint64_t numAllocations = 0;
+   /// The number of freed allocations
+   uint64_t numFrees = 0;
+   /// The number of allocations that failed because of the limit or the host
+   uint64_t numFailedAllocations = 0;
+   /// The number of allocations by size. Class i counts the sizes in
+   /// [2^i, 2^(i+1)), class 0 also contains 0 and the last class all larger
+   /// sizes.
+   std::array<uint64_t, numSizeClasses> sizeHistogram = {};
+};
+//---------------------------------------------------------------------------
 /// The function pointers to a compiled and linked C++ UDO. Set to nullptr if a
 /// function does not exist.
 struct CxxUDOFunctions {
@@ -66,6 +94,51 @@ struct CxxUDOFunctions {
    std::add_pointer_t<uint32_t(void*, void*, void*, uint32_t)> extraWork;
    /// The process function pointer
    std::add_pointer_t<uint8_t(void*, void*, void*)> process;
+   /// The consume function pointer for a batch of tuples, takes a pointer to
+   /// the first tuple and the number of tuples
+   std::add_pointer_t<void(void*, void*, void*, const void*, uint64_t)> acceptBatch;
+   /// The function that passes the output tuples that the current thread
+   /// buffered to the batch emit functor, nullptr if they are not buffered.
+   /// Must be called by every thread after its last call of accept.
+   std::add_pointer_t<void()> flushEmit;
+};
+//---------------------------------------------------------------------------
+class CxxUDOExecution;
+//---------------------------------------------------------------------------
+/// An instance of a linked C++ UDO. All instances of a UDO share its code and
+/// read-only data but have their own data pages and functors, so they can be
+/// executed concurrently on different threads. All instances and the UDO
+/// itself use the same TLS block of the host, so a thread can only execute one
+/// instance until the instance is destroyed, and it must not execute the UDO
+/// itself in the meantime.
+class CxxUDOInstance {
+   private:
+   friend CxxUDOExecution;
+   struct Impl;
+
+   /// The implementation
+   std::unique_ptr<Impl> impl;
+
+   /// Constructor
+   CxxUDOInstance();
+
+   public:
+   /// Destructor
+   ~CxxUDOInstance();
+
+   /// Get the the functors. The may be modified for a new execution.
+   CxxUDOFunctors& getFunctors() const;
+   /// Initialize the memory and the TLS of the current thread and return the
+   /// function pointers that are ready to be called. The instance is bound to
+   /// the current thread, this fails if another instance is bound to it. The
+   /// instance releases the thread it was bound to before.
+   tl::expected<CxxUDOFunctions, std::string> initialize();
+   /// Get the statistics about the allocations of the instance, nullopt if
+   /// the UDO was linked without cxxUDOAllocationAccounting
+   std::optional<CxxUDOAllocationStats> getAllocationStats() const;
+   /// Set the maximum number of bytes the instance may have allocated at a
+   /// time, 0 for unlimited. Allocations that would exceed it fail.
+   void setAllocationLimit(uint64_t limit);
 };
 //---------------------------------------------------------------------------
 /// Link and execute a compiled C++ UDO
@@ -74,13 +147,13 @@ class CxxUDOExecution {
    struct Impl;
 
    /// The compiled UDO object file
-   std::span<char> objectFile;
+   std::span<const char> objectFile;
    /// The implementation
    std::unique_ptr<Impl> impl;
 
    public:
    /// Construct from a compiled UDO object file
-   explicit CxxUDOExecution(std::span<char> objectFile);
+   explicit CxxUDOExecution(std::span<const char> objectFile);
    /// Destructor
    ~CxxUDOExecution();
 
@@ -91,6 +164,24 @@ class CxxUDOExecution {
    /// Initialize the memory and return the function pointers that are ready to
    /// be called.
    CxxUDOFunctions initialize();
+   /// Initialize the thread-local storage of the UDO for the current thread.
+   /// initialize() only does this for the thread that calls it, so this must
+   /// be called on every other thread before it calls the UDO.
+   void initializeThread() const;
+   /// Get the memory that is used by the linked UDO in bytes, i.e. its pages,
+   /// the saved copy of its rw-pages, and the image for the instances
+   uint64_t getMemoryUsage() const;
+   /// Get the statistics about the allocations of the UDO, nullopt if it was
+   /// linked without cxxUDOAllocationAccounting
+   std::optional<CxxUDOAllocationStats> getAllocationStats() const;
+   /// Set the maximum number of bytes the UDO may have allocated at a time, 0
+   /// for unlimited. Allocations that would exceed it fail. The instances
+   /// have their own limits.
+   void setAllocationLimit(uint64_t limit);
+   /// Create a new instance of the UDO after it was linked. The instances
+   /// share the TLS block with the UDO, so every instance must be executed on
+   /// its own thread, see CxxUDOInstance.
+   tl::expected<std::unique_ptr<CxxUDOInstance>, std::string> instantiate();
 
    /// Create the constructor arguments that can be passed to libc. Return
    /// value is a pointer to a struct { int argc; char** argv; } that also
@@ -0,0 +1,370 @@
+#include "udo/CxxUDOExecutor.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <memory>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+using namespace std;
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+namespace {
+//---------------------------------------------------------------------------
+/// The value returned by extraWork() when all work is done, see UDOperator
+constexpr uint32_t extraWorkDone = -1;
+//---------------------------------------------------------------------------
+/// A worker of an execution. The first pointer of the ExecutionState points
+/// to the local state, the second one points to the worker.
+struct alignas(64) Worker {
+   /// The local state of the UDO. It is aligned to 16B and is set to zero
+   /// initially.
+   alignas(16) byte localState[16] = {};
+   /// The thread id, the generated getThreadId() expects it behind the local
+   /// state
+   uint32_t threadId = 0;
+   /// The sink for the emitted tuples
+   CxxUDOEmitSink* sink = nullptr;
+   /// The next tuple of the input range of this worker
+   atomic<uint64_t> nextTuple = 0;
+   /// The end of the input range of this worker
+   uint64_t endTuple = 0;
+   /// The result of the last call of extraWork
+   uint32_t extraWorkResult = extraWorkDone;
+   /// The number of morsels that were passed to accept
+   uint64_t numMorsels = 0;
+   /// The number of morsels that were stolen from another worker
+   uint64_t numStolenMorsels = 0;
+   /// The latencies of the morsels passed to accept
+   vector<uint64_t> acceptLatencies;
+   /// The latencies of the calls of extraWork
+   vector<uint64_t> extraWorkLatencies;
+   /// The latencies of the calls of process
+   vector<uint64_t> processLatencies;
+};
+//---------------------------------------------------------------------------
+static_assert(offsetof(Worker, threadId) == 16);
+//---------------------------------------------------------------------------
+void emitCallback(void* /*functor*/, void* /*executionState1*/, void* executionState2, const void* tuple)
+// The emit callback that passes the tuple to the sink of the worker
+{
+   auto* worker = static_cast<Worker*>(executionState2);
+   if (worker->sink)
+      worker->sink->consume(worker->threadId, tuple, 1);
+}
+//---------------------------------------------------------------------------
+void emitBatchCallback(void* /*functor*/, void* /*executionState1*/, void* executionState2, const void* tuples, uint64_t numTuples)
+// The batch emit callback that passes the tuples to the sink of the worker
+{
+   auto* worker = static_cast<Worker*>(executionState2);
+   if (worker->sink)
+      worker->sink->consume(worker->threadId, tuples, numTuples);
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+/// The state of an execution that is shared by all workers
+struct CxxUDOExecutor::Run {
+   /// The phases of the execution
+   enum class Phase {
+      Init,
+      Accept,
+      ExtraWork,
+      Process,
+      Done,
+   };
+
+   /// The completion function of the barrier, runs when all workers arrived
+   struct PhaseCompletion {
+      /// The run
+      Run* run;
+
+      /// Complete the current phase
+      void operator()() noexcept { run->completePhase(); }
+   };
+
+   /// The linked UDO
+   const CxxUDOExecution& execution;
+   /// The functions of the UDO
+   const CxxUDOFunctions& functions;
+   /// The UDO object
+   void* object;
+   /// The input
+   CxxUDOInput input;
+   /// The number of tuples in a morsel
+   uint64_t morselSize;
+   /// Record the latencies?
+   bool recordLatencies;
+   /// The number of workers
+   unsigned numWorkers;
+   /// The workers
+   unique_ptr<Worker[]> workers;
+   /// The barrier that separates the phases and the stages of extraWork
+   barrier<PhaseCompletion> phaseBarrier;
+   /// The current phase, only changed by the completion of the barrier
+   Phase phase = Phase::Init;
+   /// The current stage of extraWork
+   uint32_t stage = extraWorkDone;
+   /// The number of stages of extraWork
+   uint64_t numStages = 0;
+   /// The start time of the accept, extraWork, and process phase and the end
+   /// time of the process phase
+   array<chrono::steady_clock::time_point, 4> phaseTimes;
+
+   /// Constructor
+   Run(const CxxUDOExecution& execution, const CxxUDOFunctions& functions, void* object, CxxUDOInput input, CxxUDOEmitSink* sink, uint64_t morselSize, bool recordLatencies, unsigned numWorkers);
+
+   /// Complete the current phase or stage of extraWork
+   void completePhase();
+   /// Claim a morsel from the input range of a worker
+   bool claimMorsel(Worker& victim, uint64_t& begin, uint64_t& end);
+   /// Pass the morsels to accept
+   void accept(Worker& worker);
+   /// The loop of a worker
+   void work(unsigned workerId);
+   /// Collect the measurements of all workers
+   CxxUDOExecutorStats collectStats();
+};
+//---------------------------------------------------------------------------
+CxxUDOExecutor::Run::Run(const CxxUDOExecution& execution, const CxxUDOFunctions& functions, void* object, CxxUDOInput input, CxxUDOEmitSink* sink, uint64_t morselSize, bool recordLatencies, unsigned numWorkers)
+   : execution(execution), functions(functions), object(object), input(input), morselSize(max<uint64_t>(morselSize, 1)), recordLatencies(recordLatencies), numWorkers(numWorkers), workers(make_unique<Worker[]>(numWorkers)), phaseBarrier(numWorkers, PhaseCompletion{this})
+// Constructor
+{
+   // Every worker starts with a contiguous range of the input
+   for (unsigned i = 0; i < numWorkers; ++i) {
+      auto& worker = workers[i];
+      worker.threadId = i;
+      worker.sink = sink;
+      worker.nextTuple.store(input.numTuples * i / numWorkers, memory_order_relaxed);
+      worker.endTuple = input.numTuples * (i + 1) / numWorkers;
+   }
+}
+//---------------------------------------------------------------------------
+void CxxUDOExecutor::Run::completePhase()
+// Complete the current phase or stage of extraWork
+{
+   auto now = chrono::steady_clock::now();
+   switch (phase) {
+      case Phase::Init:
+         phaseTimes[0] = now;
+         phase = Phase::Accept;
+         break;
+      case Phase::Accept:
+         phaseTimes[1] = now;
+         if (functions.extraWork) {
+            stage = 0;
+            phase = Phase::ExtraWork;
+         } else {
+            phaseTimes[2] = now;
+            phase = Phase::Process;
+         }
+         break;
+      case Phase::ExtraWork: {
+         // All workers run the same stage, the next stage is the smallest
+         // one that was returned by any worker. extraWorkDone is the largest
+         // value, so the work is done once every worker returned it.
+         ++numStages;
+         stage = extraWorkDone;
+         for (unsigned i = 0; i < numWorkers; ++i)
+            stage = min(stage, workers[i].extraWorkResult);
+         if (stage == extraWorkDone) {
+            phaseTimes[2] = now;
+            phase = Phase::Process;
+         }
+         break;
+      }
+      case Phase::Process:
+         phaseTimes[3] = now;
+         phase = Phase::Done;
+         break;
+      case Phase::Done:
+         break;
+   }
+}
+//---------------------------------------------------------------------------
+bool CxxUDOExecutor::Run::claimMorsel(Worker& victim, uint64_t& begin, uint64_t& end)
+// Claim a morsel from the input range of a worker
+{
+   if (victim.nextTuple.load(memory_order_relaxed) >= victim.endTuple)
+      return false;
+   begin = victim.nextTuple.fetch_add(morselSize, memory_order_relaxed);
+   if (begin >= victim.endTuple)
+      return false;
+   end = min(begin + morselSize, victim.endTuple);
+   return true;
+}
+//---------------------------------------------------------------------------
+void CxxUDOExecutor::Run::accept(Worker& worker)
+// Pass the morsels to accept, first from the range of the worker and then
+// from the ranges of the others
+{
+   void* executionState1 = &worker;
+   void* executionState2 = &worker;
+   for (unsigned i = 0; i < numWorkers; ++i) {
+      auto& victim = workers[(worker.threadId + i) % numWorkers];
+      uint64_t begin, end;
+      while (claimMorsel(victim, begin, end)) {
+         ++worker.numMorsels;
+         if (i > 0)
+            ++worker.numStolenMorsels;
+
+         chrono::steady_clock::time_point start;
+         if (recordLatencies)
+            start = chrono::steady_clock::now();
+         const byte* tuples = input.tuples + begin * input.tupleSize;
+         if (functions.acceptBatch) {
+            functions.acceptBatch(object, executionState1, executionState2, tuples, end - begin);
+         } else {
+            for (uint64_t j = begin; j < end; ++j, tuples += input.tupleSize)
+               functions.accept(object, executionState1, executionState2, const_cast<byte*>(tuples));
+         }
+         if (recordLatencies)
+            worker.acceptLatencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+      }
+   }
+}
+//---------------------------------------------------------------------------
+void CxxUDOExecutor::Run::work(unsigned workerId)
+// The loop of a worker
+{
+   auto& worker = workers[workerId];
+   void* executionState1 = &worker;
+   void* executionState2 = &worker;
+
+   // The TLS block may have been used by another UDO on this thread
+   execution.initializeThread();
+   if (functions.threadInit)
+      functions.threadInit();
+
+   phaseBarrier.arrive_and_wait();
+   if (functions.accept || functions.acceptBatch)
+      accept(worker);
+   if (functions.flushEmit)
+      functions.flushEmit();
+
+   phaseBarrier.arrive_and_wait();
+   while (stage != extraWorkDone) {
+      chrono::steady_clock::time_point start;
+      if (recordLatencies)
+         start = chrono::steady_clock::now();
+      worker.extraWorkResult = functions.extraWork(object, executionState1, executionState2, stage);
+      if (recordLatencies)
+         worker.extraWorkLatencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+      phaseBarrier.arrive_and_wait();
+   }
+
+   if (functions.process) {
+      while (true) {
+         chrono::steady_clock::time_point start;
+         if (recordLatencies)
+            start = chrono::steady_clock::now();
+         bool more = functions.process(object, executionState1, executionState2);
+         if (recordLatencies)
+            worker.processLatencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+         if (!more)
+            break;
+      }
+   }
+   phaseBarrier.arrive_and_wait();
+}
+//---------------------------------------------------------------------------
+CxxUDOExecutorStats CxxUDOExecutor::Run::collectStats()
+// Collect the measurements of all workers
+{
+   CxxUDOExecutorStats stats;
+   auto durationNs = [&](unsigned phaseIndex) -> uint64_t {
+      return chrono::duration_cast<chrono::nanoseconds>(phaseTimes[phaseIndex + 1] - phaseTimes[phaseIndex]).count();
+   };
+   stats.acceptNs = durationNs(0);
+   stats.extraWorkNs = durationNs(1);
+   stats.processNs = durationNs(2);
+   stats.numExtraWorkStages = numStages;
+   for (unsigned i = 0; i < numWorkers; ++i) {
+      auto& worker = workers[i];
+      stats.numMorsels += worker.numMorsels;
+      stats.numStolenMorsels += worker.numStolenMorsels;
+      stats.acceptLatencies.insert(stats.acceptLatencies.end(), worker.acceptLatencies.begin(), worker.acceptLatencies.end());
+      stats.extraWorkLatencies.insert(stats.extraWorkLatencies.end(), worker.extraWorkLatencies.begin(), worker.extraWorkLatencies.end());
+      stats.processLatencies.insert(stats.processLatencies.end(), worker.processLatencies.begin(), worker.processLatencies.end());
+   }
+   return stats;
+}
+//---------------------------------------------------------------------------
+CxxUDOExecutor::CxxUDOExecutor(unsigned numWorkers)
+// Constructor
+{
+   if (numWorkers == 0)
+      numWorkers = max(thread::hardware_concurrency(), 1u);
+   workers.reserve(numWorkers);
+   for (unsigned i = 0; i < numWorkers; ++i)
+      workers.emplace_back([this, i] { work(i); });
+}
+//---------------------------------------------------------------------------
+CxxUDOExecutor::~CxxUDOExecutor()
+// Destructor
+{
+   {
+      unique_lock lock(jobMutex);
+      stopping = true;
+   }
+   jobChanged.notify_all();
+   for (auto& worker : workers)
+      worker.join();
+}
+//---------------------------------------------------------------------------
+void CxxUDOExecutor::work(unsigned workerId)
+// The loop of a worker thread
+{
+   uint64_t lastJobNumber = 0;
+   unique_lock lock(jobMutex);
+   while (true) {
+      jobChanged.wait(lock, [&] { return stopping || jobNumber != lastJobNumber; });
+      if (stopping)
+         return;
+      lastJobNumber = jobNumber;
+
+      lock.unlock();
+      job(workerId);
+      lock.lock();
+
+      if (--numBusyWorkers == 0)
+         jobChanged.notify_all();
+   }
+}
+//---------------------------------------------------------------------------
+void CxxUDOExecutor::runOnAllWorkers(function<void(unsigned)> func)
+// Run a function on all workers and wait until it finished
+{
+   unique_lock lock(jobMutex);
+   job = move(func);
+   ++jobNumber;
+   numBusyWorkers = workers.size();
+   jobChanged.notify_all();
+   jobChanged.wait(lock, [&] { return numBusyWorkers == 0; });
+   job = nullptr;
+}
+//---------------------------------------------------------------------------
+void CxxUDOExecutor::setEmitFunctors(CxxUDOFunctors& functors)
+// Set the emit functors so that the emitted tuples are passed to the sink of
+// the execution
+{
+   // The type of the emit functor does not match the signature with which it
+   // is called, so the cast goes through the generic function pointer type
+   functors.emitFunctor = {reinterpret_cast<void (*)(void*, void*)>(reinterpret_cast<void (*)()>(&emitCallback)), nullptr};
+   functors.emitBatchFunctor = {&emitBatchCallback, nullptr};
+}
+//---------------------------------------------------------------------------
+CxxUDOExecutorStats CxxUDOExecutor::execute(const CxxUDOExecution& execution, const CxxUDOFunctions& functions, void* object, CxxUDOInput input, CxxUDOEmitSink* sink, uint64_t morselSize, bool recordLatencies)
+// Execute a UDO whose object was already constructed by the calling thread
+{
+   Run run(execution, functions, object, input, sink, morselSize, recordLatencies, getNumWorkers());
+   runOnAllWorkers([&run](unsigned workerId) { run.work(workerId); });
+   return run.collectStats();
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,126 @@
+#ifndef H_udo_CxxUDOExecutor
+#define H_udo_CxxUDOExecutor
+//---------------------------------------------------------------------------
+#include "udo/CxxUDOExecution.hpp"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+/// The input tuples of a UDO that is run by CxxUDOExecutor. The tuples are
+/// laid out like an array of the InputTuple type of the UDO.
+struct CxxUDOInput {
+   /// The first tuple
+   const std::byte* tuples = nullptr;
+   /// The size of a tuple including the padding to the next one
+   uint64_t tupleSize = 0;
+   /// The number of tuples
+   uint64_t numTuples = 0;
+};
+//---------------------------------------------------------------------------
+/// Receives the tuples that are emitted by a UDO that is run by
+/// CxxUDOExecutor. consume() is called concurrently by different workers but
+/// never concurrently for the same worker, so a sink can keep its state per
+/// worker without synchronization.
+class CxxUDOEmitSink {
+   public:
+   /// Destructor
+   virtual ~CxxUDOEmitSink() = default;
+
+   /// Consume tuples that were emitted by a worker
+   virtual void consume(unsigned workerId, const void* tuples, uint64_t numTuples) = 0;
+};
+//---------------------------------------------------------------------------
+/// The measurements of an execution with CxxUDOExecutor
+struct CxxUDOExecutorStats {
+   /// The wall time of the accept phase in nanoseconds
+   uint64_t acceptNs = 0;
+   /// The wall time of the extraWork phase in nanoseconds
+   uint64_t extraWorkNs = 0;
+   /// The wall time of the process phase in nanoseconds
+   uint64_t processNs = 0;
+   /// The number of morsels that were passed to accept
+   uint64_t numMorsels = 0;
+   /// The number of morsels that were stolen from another worker
+   uint64_t numStolenMorsels = 0;
+   /// The number of stages of extraWork
+   uint64_t numExtraWorkStages = 0;
+   /// The latencies of the morsels passed to accept in nanoseconds, only
+   /// recorded if requested
+   std::vector<uint64_t> acceptLatencies;
+   /// The latencies of the calls of extraWork in nanoseconds, only recorded if
+   /// requested
+   std::vector<uint64_t> extraWorkLatencies;
+   /// The latencies of the calls of process in nanoseconds, only recorded if
+   /// requested
+   std::vector<uint64_t> processLatencies;
+};
+//---------------------------------------------------------------------------
+/// A pool of worker threads that executes a linked C++ UDO. The input is split
+/// into one range per worker which is consumed in morsels, workers that are
+/// done with their own range steal morsels from the others. The workers run
+/// accept in parallel, then all stages of extraWork until every worker returns
+/// extraWorkDone, and then process until it returns false. Every worker has
+/// its own ExecutionState and LocalState, and its TLS is initialized for the
+/// UDO before it calls the UDO.
+class CxxUDOExecutor {
+   public:
+   /// The default number of tuples in a morsel
+   static constexpr uint64_t defaultMorselSize = 1024;
+
+   private:
+   struct Run;
+
+   /// The worker threads
+   std::vector<std::thread> workers;
+   /// The mutex that protects the job
+   std::mutex jobMutex;
+   /// The condition variable that is notified when a job is started or all
+   /// workers finished it
+   std::condition_variable jobChanged;
+   /// The current job
+   std::function<void(unsigned)> job;
+   /// The number of the current job, incremented for every job
+   uint64_t jobNumber = 0;
+   /// The number of workers that did not finish the current job yet
+   unsigned numBusyWorkers = 0;
+   /// Are the workers stopping?
+   bool stopping = false;
+
+   /// The loop of a worker thread
+   void work(unsigned workerId);
+   /// Run a function on all workers and wait until it finished
+   void runOnAllWorkers(std::function<void(unsigned)> func);
+
+   public:
+   /// Constructor, uses one worker per hardware thread if numWorkers is 0
+   explicit CxxUDOExecutor(unsigned numWorkers = 0);
+   /// Destructor
+   ~CxxUDOExecutor();
+
+   CxxUDOExecutor(const CxxUDOExecutor&) = delete;
+   CxxUDOExecutor& operator=(const CxxUDOExecutor&) = delete;
+
+   /// Get the number of workers
+   unsigned getNumWorkers() const { return workers.size(); }
+
+   /// Set the emit functors so that the emitted tuples are passed to the sink
+   /// of the execution. Must be called before `CxxUDOExecution::initialize()`.
+   static void setEmitFunctors(CxxUDOFunctors& functors);
+
+   /// Execute a UDO whose object was already constructed by the calling
+   /// thread. The emitted tuples are passed to `sink` if it is not nullptr.
+   CxxUDOExecutorStats execute(const CxxUDOExecution& execution, const CxxUDOFunctions& functions, void* object, CxxUDOInput input, CxxUDOEmitSink* sink, uint64_t morselSize = defaultMorselSize, bool recordLatencies = false);
+};
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+#endif
@@ -198,6 +198,34 @@ const DynamicTLS::AllocatedTLSSection* DynamicTLS::allocate(uint64_t size, unsig
    return &allocatedSection;
 }
 //---------------------------------------------------------------------------
+const DynamicTLS::AllocatedTLSSection* DynamicTLS::allocateAt(uint64_t storageOffset, uint64_t size)
+// Allocate a TLS section at a fixed offset in the TLS block
+{
+   assert(storageOffset % 8 == 0 && size % 8 == 0);
+   uint64_t allocationSize = getAllocationSize(size);
+   if (size == 0 || storageOffset + size > tlsBlockSize || storageOffset + allocationSize > freeBitmap.size() * 64 * 8)
+      return nullptr;
+
+   // Claim all bits of the region, roll back if any of them was already set
+   for (uint64_t offset = storageOffset; offset < storageOffset + allocationSize; offset += 8) {
+      auto bitmapEntryAtomic = atomic_ref(freeBitmap[offset / 8 / 64]);
+      uint64_t bit = 1ull << ((offset / 8) % 64);
+      if (bitmapEntryAtomic.fetch_or(bit) & bit) {
+         for (uint64_t claimedOffset = storageOffset; claimedOffset < offset; claimedOffset += 8)
+            atomic_ref(freeBitmap[claimedOffset / 8 / 64]).fetch_xor(1ull << ((claimedOffset / 8) % 64));
+         return nullptr;
+      }
+   }
+
+   auto& allocatedSection = allocatedTLSSections.emplace_back();
+   allocatedSection.tlsOffset = tlsBlockOffset + static_cast<int64_t>(storageOffset);
+   allocatedSection.storageOffset = storageOffset;
+   allocatedSection.size = size;
+   allocatedSection.initializationImage = make_unique<char[]>(size);
+
+   return &allocatedSection;
+}
+//---------------------------------------------------------------------------
 void* DynamicTLS::accessTLS(uint64_t offset) const
 // Access the TLS storage for the current thread at the given offset
 {
@@ -57,6 +57,11 @@ class DynamicTLS {
    /// Allocate a TLS section with the given size and alignment. Returns
    /// nullptr if memory couldn't be allocated.
    const AllocatedTLSSection* allocate(uint64_t size, unsigned alignment);
+   /// Allocate a TLS section at a fixed offset in the TLS block. The offset
+   /// and size must be the ones of a section that was allocated by another
+   /// DynamicTLS with the same TLS block. Returns nullptr if the region is
+   /// already in use.
+   const AllocatedTLSSection* allocateAt(uint64_t storageOffset, uint64_t size);
 
    /// Access the TLS storage for the current thread at the given offset
    void* accessTLS(uint64_t offset) const;
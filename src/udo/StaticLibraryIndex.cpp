@@ -0,0 +1,460 @@
+#include "udo/StaticLibraryIndex.hpp"
+#include "udo/CxxUDOCache.hpp"
+#include "udo/LLVMUtil.hpp"
+#include "udo/i18n.hpp"
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/BinaryFormat/ELF.h>
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/Object/Archive.h>
+#include <llvm/Object/ELFObjectFile.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/xxhash.h>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+using namespace std;
+namespace fs = std::filesystem;
+//---------------------------------------------------------------------------
+static const char tc[] = "udo/StaticLibraryIndex";
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+/// The version of the index format, must be increased whenever the format or
+/// the selection of the symbols changes.
+static constexpr uint32_t indexFormatVersion = 1;
+//---------------------------------------------------------------------------
+/// The magic bytes at the beginning of every index
+static constexpr char indexMagic[8] = {'U', 'D', 'O', 'S', 'Y', 'M', 'I', 'X'};
+//---------------------------------------------------------------------------
+/// The header of the index. It is followed by the members, the symbols, the
+/// hash table that contains the symbol index + 1 (or 0 for an empty slot),
+/// and the string table.
+struct IndexHeader {
+   /// The magic bytes
+   char magic[8];
+   /// The format version
+   uint32_t version;
+   /// Padding, always zero
+   uint32_t padding;
+   /// The size of the library file
+   uint64_t librarySize;
+   /// The modification time of the library file
+   int64_t libraryModificationTime;
+   /// The hash of the library file
+   uint64_t libraryHash;
+   /// The number of members
+   uint64_t numMembers;
+   /// The number of symbols
+   uint64_t numSymbols;
+   /// The number of slots of the hash table
+   uint64_t hashTableSize;
+   /// The size of the string table
+   uint64_t stringsSize;
+};
+//---------------------------------------------------------------------------
+/// A member as it is stored in the index
+struct IndexMember {
+   /// The offset of the member's data in the library file
+   uint64_t offset;
+   /// The size of the member's data
+   uint64_t size;
+   /// The offset of the name in the string table
+   uint32_t nameOffset;
+   /// The size of the name
+   uint32_t nameSize;
+};
+//---------------------------------------------------------------------------
+/// A symbol as it is stored in the index
+struct IndexSymbol {
+   /// The offset of the name in the string table
+   uint32_t nameOffset;
+   /// The size of the name
+   uint32_t nameSize;
+   /// The index of the member that contains the symbol
+   uint32_t memberIndex;
+   /// The raw JITSymbolFlags
+   uint8_t flags;
+   /// Is the symbol undefined?
+   uint8_t undefined;
+   /// Padding, always zero
+   uint16_t padding;
+};
+//---------------------------------------------------------------------------
+template <typename T>
+static T readAt(const llvm::MemoryBuffer& buffer, uint64_t offset)
+// Read a value from the buffer, the buffer may not be aligned
+{
+   T value;
+   memcpy(&value, buffer.getBufferStart() + offset, sizeof(T));
+   return value;
+}
+//---------------------------------------------------------------------------
+template <typename T>
+static void append(vector<char>& data, const T& value)
+// Append a value to the data
+{
+   auto* bytes = reinterpret_cast<const char*>(&value);
+   data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+//---------------------------------------------------------------------------
+static tl::expected<vector<char>, string> buildIndex(string_view path, const llvm::MemoryBuffer& library, IndexHeader header)
+// Parse the library and build the index for it
+{
+   unique_ptr<llvm::object::Archive> libArchive;
+   {
+      auto result = llvm::object::Archive::create(library.getMemBufferRef());
+      if (!result)
+         return tl::unexpected(trformat(tc, "error while reading static library {0}", path));
+      libArchive = move(*result);
+   }
+
+   /// A symbol that was found in an object file
+   struct FoundSymbol {
+      /// The index of the member
+      uint32_t memberIndex;
+      /// The flags
+      llvm::JITSymbolFlags flags;
+      /// Is the symbol undefined?
+      bool undefined;
+   };
+
+   vector<IndexMember> members;
+   vector<char> strings;
+   // Insert the symbols in the order in which they appear in the library so
+   // that the index is deterministic
+   vector<string_view> symbolNames;
+   unordered_map<string_view, FoundSymbol> foundSymbols;
+   vector<unique_ptr<llvm::object::ObjectFile>> objectFiles;
+
+   auto addString = [&](string_view str) {
+      auto offset = static_cast<uint32_t>(strings.size());
+      strings.insert(strings.end(), str.begin(), str.end());
+      return offset;
+   };
+
+   llvm::Error error = llvm::Error::success();
+   for (auto& child : libArchive->children(error)) {
+      unique_ptr<llvm::object::ObjectFile> libObject;
+      {
+         auto result = child.getAsBinary();
+         if (!result)
+            return tl::unexpected(trformat(tc, "error while reading object from static library {0}", path));
+         // Ignore archive contents that are not object files
+         if (auto objectFilePtr = llvm::dyn_cast<llvm::object::ObjectFile>(result->get()); objectFilePtr) {
+            result->release();
+            libObject.reset(objectFilePtr);
+         }
+      }
+      if (!libObject)
+         continue;
+
+      // The members are loaded directly from the library file later, so
+      // their data must be contained in it (i.e. no thin archives).
+      auto memberData = libObject->getMemoryBufferRef();
+      auto libraryData = library.getBuffer();
+      if (memberData.getBufferStart() < libraryData.begin() || memberData.getBufferEnd() > libraryData.end())
+         return tl::unexpected(trformat(tc, "unsupported member in static library {0}", path));
+
+      auto memberIndex = static_cast<uint32_t>(members.size());
+      auto& member = members.emplace_back();
+      member.offset = memberData.getBufferStart() - libraryData.begin();
+      member.size = memberData.getBufferSize();
+      auto memberName = asStringView(memberData.getBufferIdentifier());
+      member.nameOffset = addString(memberName);
+      member.nameSize = memberName.size();
+
+      auto& objectFile = *objectFiles.emplace_back(move(libObject));
+      bool isElf = objectFile.isELF();
+
+      for (auto& symbol : objectFile.symbols()) {
+         // If we can't determine the name of a symbol, then of course we can't
+         // use it for linking
+         auto name = [&] {
+            auto result = symbol.getName();
+            if (result)
+               return asStringView(*result);
+            else
+               return string_view();
+         }();
+         if (name.empty())
+            continue;
+
+         bool isUndefined = false;
+         if (auto section = symbol.getSection())
+            if (*section == objectFile.section_end())
+               isUndefined = true;
+
+         if (isElf) {
+            llvm::object::ELFSymbolRef elfSymbol(symbol);
+            switch (elfSymbol.getBinding()) {
+               case llvm::ELF::STB_GLOBAL:
+               case llvm::ELF::STB_WEAK:
+               case llvm::ELF::STB_GNU_UNIQUE:
+                  // STB_GNU_UNIQUE is a GNU extension for global symbols
+                  break;
+               default:
+                  // Only global symbols (weak symbols are also considered
+                  // global) should be used to link multiple object files
+                  continue;
+            }
+            switch (elfSymbol.getELFType()) {
+               case llvm::ELF::STT_NOTYPE: {
+                  if (elfSymbol.getBinding() == llvm::ELF::STB_WEAK) {
+                     // Remember undefined weak symbols as they should resolve
+                     // to 0 if they are never defined.
+                     isUndefined = true;
+                     break;
+                  } else {
+                     continue;
+                  }
+               }
+               case llvm::ELF::STT_FUNC:
+               case llvm::ELF::STT_OBJECT:
+                  // Regular global function or data symbol
+               case llvm::ELF::STT_TLS:
+                  // Thread-local symbol that CxxUDOMemoryManager can also handle
+               case llvm::ELF::STT_GNU_IFUNC:
+                  // IFUNC symbols are handled by RuntimeDyld
+
+                  // Skip all other symbols if they are undefined
+                  if (isUndefined)
+                     continue;
+                  break;
+               default:
+                  continue;
+            }
+         } else {
+            // We are only interested in functions and data
+            auto symbolType = symbol.getType();
+            if (!symbolType)
+               continue;
+            switch (*symbolType) {
+               case llvm::object::SymbolRef::ST_Data:
+               case llvm::object::SymbolRef::ST_Function:
+                  break;
+               default:
+                  continue;
+            }
+         }
+
+         llvm::JITSymbolFlags flags;
+         if (auto result = llvm::JITSymbolFlags::fromObjectSymbol(symbol)) {
+            flags = *result;
+         } else {
+            // Ignore symbols with unknown flags
+            continue;
+         }
+
+         FoundSymbol newSymbol{memberIndex, flags, isUndefined};
+
+         if (auto it = foundSymbols.find(name); it == foundSymbols.end()) {
+            foundSymbols.emplace(name, newSymbol);
+            symbolNames.push_back(name);
+         } else {
+            auto& symbol = it->second;
+            // Overwrite the existing symbol only if it's weak and undefined or
+            // if it's weak and the new one isn't.
+            if ((symbol.undefined && symbol.flags.isWeak()) || (!newSymbol.flags.isWeak() && symbol.flags.isWeak()))
+               symbol = newSymbol;
+         }
+      }
+   }
+
+   if (error)
+      return tl::unexpected(trformat(tc, "error while reading object file from static library {0}", path));
+
+   // Use a load factor of at most 0.5 so that the linear probing stays short
+   uint64_t hashTableSize = bit_ceil(max<uint64_t>(symbolNames.size() * 2, 1));
+   vector<uint32_t> hashTable(hashTableSize, 0);
+
+   vector<IndexSymbol> symbols;
+   symbols.reserve(symbolNames.size());
+   for (auto name : symbolNames) {
+      auto& foundSymbol = foundSymbols[name];
+      auto& symbol = symbols.emplace_back();
+      symbol.nameOffset = addString(name);
+      symbol.nameSize = name.size();
+      symbol.memberIndex = foundSymbol.memberIndex;
+      symbol.flags = foundSymbol.flags.getRawFlagsValue();
+      symbol.undefined = foundSymbol.undefined;
+      symbol.padding = 0;
+
+      auto slot = llvm::xxHash64(asStringRef(name)) & (hashTableSize - 1);
+      while (hashTable[slot] != 0)
+         slot = (slot + 1) & (hashTableSize - 1);
+      hashTable[slot] = symbols.size();
+   }
+
+   if (strings.size() > numeric_limits<uint32_t>::max())
+      return tl::unexpected(trformat(tc, "too many symbols in static library {0}", path));
+
+   header.numMembers = members.size();
+   header.numSymbols = symbols.size();
+   header.hashTableSize = hashTableSize;
+   header.stringsSize = strings.size();
+
+   vector<char> data;
+   data.reserve(sizeof(IndexHeader) + members.size() * sizeof(IndexMember) + symbols.size() * sizeof(IndexSymbol) + hashTable.size() * sizeof(uint32_t) + strings.size());
+   append(data, header);
+   for (auto& member : members)
+      append(data, member);
+   for (auto& symbol : symbols)
+      append(data, symbol);
+   for (auto entry : hashTable)
+      append(data, entry);
+   data.insert(data.end(), strings.begin(), strings.end());
+
+   return data;
+}
+//---------------------------------------------------------------------------
+StaticLibraryIndex::StaticLibraryIndex(unique_ptr<llvm::MemoryBuffer> buffer)
+   : buffer(move(buffer))
+// Constructor
+{
+}
+//---------------------------------------------------------------------------
+StaticLibraryIndex::~StaticLibraryIndex()
+// Destructor
+{
+}
+//---------------------------------------------------------------------------
+bool StaticLibraryIndex::initialize(uint64_t librarySize, int64_t libraryModificationTime, uint64_t libraryHash)
+// Check the header of the buffer and set the offsets
+{
+   auto bufferSize = buffer->getBufferSize();
+   if (bufferSize < sizeof(IndexHeader))
+      return false;
+   auto header = readAt<IndexHeader>(*buffer, 0);
+   if (memcmp(header.magic, indexMagic, sizeof(indexMagic)) != 0 || header.version != indexFormatVersion)
+      return false;
+   if (header.librarySize != librarySize || header.libraryModificationTime != libraryModificationTime || header.libraryHash != libraryHash)
+      return false;
+   if (!has_single_bit(header.hashTableSize) || header.hashTableSize <= header.numSymbols || header.numMembers > numeric_limits<uint32_t>::max())
+      return false;
+
+   membersOffset = sizeof(IndexHeader);
+   symbolsOffset = membersOffset + header.numMembers * sizeof(IndexMember);
+   hashTableOffset = symbolsOffset + header.numSymbols * sizeof(IndexSymbol);
+   stringsOffset = hashTableOffset + header.hashTableSize * sizeof(uint32_t);
+   if (stringsOffset + header.stringsSize != bufferSize)
+      return false;
+
+   numMembers = header.numMembers;
+   numSymbols = header.numSymbols;
+   hashTableSize = header.hashTableSize;
+
+   // Validate all references so that lookups never read out of bounds
+   for (uint64_t i = 0; i < numMembers; ++i) {
+      auto member = readAt<IndexMember>(*buffer, membersOffset + i * sizeof(IndexMember));
+      if (uint64_t(member.nameOffset) + member.nameSize > header.stringsSize || member.offset + member.size > librarySize)
+         return false;
+   }
+   for (uint64_t i = 0; i < numSymbols; ++i) {
+      auto symbol = readAt<IndexSymbol>(*buffer, symbolsOffset + i * sizeof(IndexSymbol));
+      if (uint64_t(symbol.nameOffset) + symbol.nameSize > header.stringsSize || symbol.memberIndex >= numMembers)
+         return false;
+   }
+   for (uint64_t i = 0; i < hashTableSize; ++i)
+      if (readAt<uint32_t>(*buffer, hashTableOffset + i * sizeof(uint32_t)) > numSymbols)
+         return false;
+
+   return true;
+}
+//---------------------------------------------------------------------------
+string_view StaticLibraryIndex::getString(uint32_t offset, uint32_t size) const
+// Get a string from the string table
+{
+   return string_view(buffer->getBufferStart() + stringsOffset + offset, size);
+}
+//---------------------------------------------------------------------------
+StaticLibraryIndex::Symbol StaticLibraryIndex::getSymbol(uint64_t index) const
+// Get the symbol with the given index
+{
+   auto indexSymbol = readAt<IndexSymbol>(*buffer, symbolsOffset + index * sizeof(IndexSymbol));
+   Symbol symbol;
+   symbol.name = getString(indexSymbol.nameOffset, indexSymbol.nameSize);
+   symbol.memberIndex = indexSymbol.memberIndex;
+   symbol.flags = indexSymbol.flags;
+   symbol.undefined = indexSymbol.undefined;
+   return symbol;
+}
+//---------------------------------------------------------------------------
+tl::expected<unique_ptr<StaticLibraryIndex>, string> StaticLibraryIndex::get(string_view path, const llvm::MemoryBuffer& library)
+// Get the index for a library
+{
+   IndexHeader header{};
+   memcpy(header.magic, indexMagic, sizeof(indexMagic));
+   header.version = indexFormatVersion;
+   header.librarySize = library.getBufferSize();
+   header.libraryHash = llvm::xxHash64(library.getBuffer());
+   {
+      error_code ec;
+      auto modificationTime = fs::last_write_time(fs::path(path), ec);
+      if (!ec)
+         header.libraryModificationTime = chrono::duration_cast<chrono::nanoseconds>(modificationTime.time_since_epoch()).count();
+   }
+
+   // The index file is named after the path of the library, so an outdated
+   // index is simply overwritten
+   auto indexFilename = "symbols-" + llvm::utohexstr(llvm::xxHash64(asStringRef(path))) + ".idx";
+
+   if (CxxUDOCache::isEnabled()) {
+      auto indexPath = fs::path(CxxUDOCache::getDirectory()) / indexFilename;
+      if (auto result = llvm::MemoryBuffer::getFile(indexPath.string(), false, false)) {
+         unique_ptr<StaticLibraryIndex> index(new StaticLibraryIndex(move(*result)));
+         if (index->initialize(header.librarySize, header.libraryModificationTime, header.libraryHash))
+            return index;
+      }
+   }
+
+   auto data = buildIndex(path, library, header);
+   if (!data)
+      return tl::unexpected(move(data).error());
+
+   // The index works without the cache as well, so ignore errors here
+   static_cast<void>(CxxUDOCache::storeFile(indexFilename, *data));
+
+   unique_ptr<StaticLibraryIndex> index(new StaticLibraryIndex(llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(data->data(), data->size()), asStringRef(path))));
+   if (!index->initialize(header.librarySize, header.libraryModificationTime, header.libraryHash))
+      return tl::unexpected(trformat(tc, "could not create symbol index for static library {0}", path));
+   return index;
+}
+//---------------------------------------------------------------------------
+optional<StaticLibraryIndex::Symbol> StaticLibraryIndex::findSymbol(string_view name) const
+// Find a symbol, returns nullopt if the library does not contain it
+{
+   auto mask = hashTableSize - 1;
+   for (auto slot = llvm::xxHash64(asStringRef(name)) & mask;; slot = (slot + 1) & mask) {
+      auto entry = readAt<uint32_t>(*buffer, hashTableOffset + slot * sizeof(uint32_t));
+      if (entry == 0)
+         return nullopt;
+      auto symbol = getSymbol(entry - 1);
+      if (symbol.name == name)
+         return symbol;
+   }
+}
+//---------------------------------------------------------------------------
+StaticLibraryIndex::Member StaticLibraryIndex::getMember(uint32_t index) const
+// Get a member
+{
+   auto indexMember = readAt<IndexMember>(*buffer, membersOffset + index * sizeof(IndexMember));
+   Member member;
+   member.name = getString(indexMember.nameOffset, indexMember.nameSize);
+   member.offset = indexMember.offset;
+   member.size = indexMember.size;
+   return member;
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,90 @@
+#ifndef H_udo_StaticLibraryIndex
+#define H_udo_StaticLibraryIndex
+//---------------------------------------------------------------------------
+#include "thirdparty/tl/expected.hpp"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+namespace llvm {
+class MemoryBuffer;
+}
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+/// A read-only index of the global symbols of a static library. It maps
+/// every symbol name to the archive member that defines it, so that symbols
+/// can be resolved without parsing all members of the archive. The index is
+/// stored in the C++ UDO cache directory and mapped directly into memory if
+/// it is still valid for the library.
+class StaticLibraryIndex {
+   public:
+   /// A symbol of the index
+   struct Symbol {
+      /// The name of the symbol
+      std::string_view name;
+      /// The index of the member that contains the symbol
+      uint32_t memberIndex;
+      /// The raw `llvm::JITSymbolFlags` of the symbol
+      uint8_t flags;
+      /// Is this symbol undefined? Only weak symbols may be undefined.
+      bool undefined;
+   };
+   /// An object file member of the archive
+   struct Member {
+      /// The name of the member
+      std::string_view name;
+      /// The offset of the member's data in the library file
+      uint64_t offset;
+      /// The size of the member's data
+      uint64_t size;
+   };
+
+   private:
+   /// The buffer that contains the index
+   std::unique_ptr<llvm::MemoryBuffer> buffer;
+   /// The number of members
+   uint64_t numMembers = 0;
+   /// The number of symbols
+   uint64_t numSymbols = 0;
+   /// The number of slots of the hash table, always a power of two
+   uint64_t hashTableSize = 0;
+   /// The offsets of the members, symbols, hash table and strings in the buffer
+   uint64_t membersOffset = 0, symbolsOffset = 0, hashTableOffset = 0, stringsOffset = 0;
+
+   /// Constructor
+   explicit StaticLibraryIndex(std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+   /// Check the header of the buffer and set the offsets. Returns false if
+   /// the index is invalid.
+   bool initialize(uint64_t librarySize, int64_t libraryModificationTime, uint64_t libraryHash);
+   /// Get a string from the string table
+   std::string_view getString(uint32_t offset, uint32_t size) const;
+   /// Get the symbol with the given index
+   Symbol getSymbol(uint64_t index) const;
+
+   public:
+   /// Destructor
+   ~StaticLibraryIndex();
+
+   /// Get the index for a library. The library must be the content of the
+   /// file at `path`. The index is created if it does not exist in the cache
+   /// or if it is outdated.
+   static tl::expected<std::unique_ptr<StaticLibraryIndex>, std::string> get(std::string_view path, const llvm::MemoryBuffer& library);
+
+   /// Find a symbol, returns nullopt if the library does not contain it
+   std::optional<Symbol> findSymbol(std::string_view name) const;
+   /// Get the number of members
+   uint64_t getNumMembers() const { return numMembers; }
+   /// Get a member
+   Member getMember(uint32_t index) const;
+};
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+#endif
@@ -1,10 +1,15 @@
 #include "udo/UDOMemoryManager.hpp"
+#include "udo/Setting.hpp"
 #include <algorithm>
 #include <bit>
 #include <cassert>
 #include <cstring>
 #include <limits>
+#include <map>
+#include <mutex>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 //---------------------------------------------------------------------------
 // UDO runtime
 // (c) 2021 Moritz Sichert
@@ -13,6 +18,11 @@ using namespace std;
 //---------------------------------------------------------------------------
 namespace udo {
 //---------------------------------------------------------------------------
+static Setting<bool> udoHugePageCode("udoHugePageCode", "Place the code of linked UDOs in huge pages to reduce iTLB misses", false);
+static Setting<uint64_t> udoMemoryRegionSize("udoMemoryRegionSize", "The size of the memory region of a linked UDO, rounded to a multiple of 2 MiB and at most 2 GiB. Smaller regions share one 2 GiB window, but UDOs that need more memory than their region cannot be linked.", 2ull << 30, settinghelper::makeParser<uint64_t>(&settinghelper::DefaultParserFunctions<uint64_t>::parseWithUnits));
+static Setting<uint64_t> udoMemoryRegionPoolSize("udoMemoryRegionPoolSize", "The maximum size of the committed memory of the released memory regions of linked UDOs that are kept populated to be reused by the next UDO, 0 disables the pool", 256ull << 20, settinghelper::makeParser<uint64_t>(&settinghelper::DefaultParserFunctions<uint64_t>::parseWithUnits));
+static Setting<bool> udoHugePageROData("udoHugePageROData", "Place the read-only data of linked UDOs in huge pages, only used with udoHugePageCode", false);
+//---------------------------------------------------------------------------
 template <typename T>
 static constexpr T log2(T value)
 // Compute log2, rounding down. Undefined for 0
@@ -29,25 +39,227 @@ static constexpr T log2_ceil(T value)
    return static_cast<T>(sizeof(T) * CHAR_BIT - countl_zero(value - 1));
 }
 //---------------------------------------------------------------------------
+static bool writeFile(int fd, const byte* data, uint64_t size, uint64_t offset)
+// Write the data to the file at the given offset
+{
+   for (uint64_t written = 0; written < size;) {
+      auto result = ::pwrite(fd, data + written, size - written, static_cast<off_t>(offset + written));
+      if (result <= 0)
+         return false;
+      written += static_cast<uint64_t>(result);
+   }
+   return true;
+}
+//---------------------------------------------------------------------------
+static int getPagemapFd()
+// Get the file descriptor of /proc/self/pagemap, -1 if it can't be opened
+{
+   static int pagemapFd = ::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+   return pagemapFd;
+}
+//---------------------------------------------------------------------------
+static bool mapHugePages(byte* ptr, uint64_t size, bool& isHugeTLB)
+// Back a region of the reserved memory with huge pages. Returns false if the
+// region could not be restored after an error. `isHugeTLB` is set if the
+// region is backed by explicit huge pages.
+{
+   // Explicit huge pages are only available if they were reserved by the
+   // administrator, otherwise transparent huge pages are requested.
+   isHugeTLB = ::mmap(ptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED;
+   if (isHugeTLB)
+      return true;
+   // A failed fixed mapping may already have unmapped the region
+   if (::mmap(ptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      return false;
+   ::madvise(ptr, size, MADV_HUGEPAGE);
+   return true;
+}
+//---------------------------------------------------------------------------
+namespace {
+//---------------------------------------------------------------------------
+/// The arena that the regions of the memory managers are allocated from. It
+/// reserves windows of 2 GiB that are split into regions, released regions
+/// are reused. Reserved memory is mapped with PROT_NONE and MAP_NORESERVE, so
+/// it does not count as committed memory until it is made writable. Up to
+/// udoMemoryRegionPoolSize bytes of released regions are kept committed and
+/// populated in a pool, so that the next memory manager does not have to
+/// fault in its pages again.
+class RegionArena {
+   private:
+   /// A region in the pool
+   struct PooledRegion {
+      /// The pointer to the region
+      byte* ptr;
+      /// The size of the committed memory at the beginning of the region
+      uint64_t committedSize;
+   };
+
+   /// The mutex
+   mutex arenaMutex;
+   /// The unused rest of the current window
+   byte* windowBegin = nullptr;
+   /// The end of the current window
+   byte* windowEnd = nullptr;
+   /// The released regions by their size
+   map<uint64_t, vector<byte*>> freeRegions;
+   /// The pooled regions by their size
+   map<uint64_t, vector<PooledRegion>> pooledRegions;
+   /// The committed size of all pooled regions
+   uint64_t pooledSize = 0;
+
+   public:
+   /// The alignment of windows and regions
+   static constexpr uint64_t alignment = 2ull << 20;
+
+   /// Allocate a region, returns nullptr if no memory could be reserved.
+   /// `committedSize` is set to the size of the memory at the beginning of the
+   /// region that is already committed and contains zeros.
+   byte* allocateRegion(uint64_t size, uint64_t windowSize, uint64_t& committedSize);
+   /// Can a region with the given committed size be added to the pool?
+   bool canPoolRegion(uint64_t committedSize);
+   /// Add a region that was reset to the pool. Returns false if the pool is full.
+   bool poolRegion(byte* ptr, uint64_t size, uint64_t committedSize);
+   /// Release a region. Its memory is dropped and reserved again.
+   void releaseRegion(byte* ptr, uint64_t size);
+};
+//---------------------------------------------------------------------------
+byte* RegionArena::allocateRegion(uint64_t size, uint64_t windowSize, uint64_t& committedSize)
+// Allocate a region
+{
+   unique_lock lock(arenaMutex);
+
+   committedSize = 0;
+   if (auto it = pooledRegions.find(size); it != pooledRegions.end() && !it->second.empty()) {
+      auto region = it->second.back();
+      it->second.pop_back();
+      pooledSize -= region.committedSize;
+      committedSize = region.committedSize;
+      return region.ptr;
+   }
+
+   if (auto it = freeRegions.find(size); it != freeRegions.end() && !it->second.empty()) {
+      auto* ptr = it->second.back();
+      it->second.pop_back();
+      return ptr;
+   }
+
+   if (static_cast<uint64_t>(windowEnd - windowBegin) < size) {
+      // The rest of the current window is left unused
+      auto* result = ::mmap(nullptr, windowSize + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (result == MAP_FAILED)
+         return nullptr;
+      auto* reserved = static_cast<byte*>(result);
+      auto padding = (alignment - reinterpret_cast<uintptr_t>(reserved) % alignment) % alignment;
+      if (padding > 0)
+         ::munmap(reserved, padding);
+      ::munmap(reserved + padding + windowSize, alignment - padding);
+      windowBegin = reserved + padding;
+      windowEnd = windowBegin + windowSize;
+   }
+
+   auto* ptr = windowBegin;
+   windowBegin += size;
+   return ptr;
+}
+//---------------------------------------------------------------------------
+bool RegionArena::canPoolRegion(uint64_t committedSize)
+// Can a region with the given committed size be added to the pool?
+{
+   unique_lock lock(arenaMutex);
+   return pooledSize + committedSize <= udoMemoryRegionPoolSize.get();
+}
+//---------------------------------------------------------------------------
+bool RegionArena::poolRegion(byte* ptr, uint64_t size, uint64_t committedSize)
+// Add a region that was reset to the pool
+{
+   unique_lock lock(arenaMutex);
+   // Another region may have been added since canPoolRegion() was called
+   if (pooledSize + committedSize > udoMemoryRegionPoolSize.get())
+      return false;
+   pooledRegions[size].push_back({ptr, committedSize});
+   pooledSize += committedSize;
+   return true;
+}
+//---------------------------------------------------------------------------
+void RegionArena::releaseRegion(byte* ptr, uint64_t size)
+// Release a region
+{
+   // Mapping the region again drops all of its pages, including the file and
+   // huge page mappings that were placed in it
+   if (::mmap(ptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      ::munmap(ptr, size);
+      return;
+   }
+
+   unique_lock lock(arenaMutex);
+   freeRegions[size].push_back(ptr);
+}
+//---------------------------------------------------------------------------
+static RegionArena& getRegionArena()
+// Get the arena of the process
+{
+   // The arena is never destroyed, so that memory managers that are
+   // destroyed during the exit of the process can still release their regions
+   static auto* arena = new RegionArena();
+   return *arena;
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
 UDOMemoryManager::~UDOMemoryManager()
 // Destructor
 {
-   if (systemAllocatedMemory)
-      ::munmap(systemAllocatedMemory, memorySize);
+   if (systemAllocatedMemory) {
+      auto& arena = getRegionArena();
+      uint64_t committedSize = systemMemoryCommitted - systemAllocatedMemory;
+      bool isPooled = committedSize > 0 && arena.canPoolRegion(committedSize) && resetRegion() && arena.poolRegion(systemAllocatedMemory, memorySize, committedSize);
+      if (!isPooled)
+         arena.releaseRegion(systemAllocatedMemory, memorySize);
+   }
+   if (frozenDataFd >= 0)
+      ::close(frozenDataFd);
 }
 //---------------------------------------------------------------------------
-byte* UDOMemoryManager::allocatePages(uint64_t numPages)
+byte* UDOMemoryManager::allocatePages(uint64_t numPages, AllocationType allocationType)
 // Allocate new pages from the operating system
 {
    if (!systemAllocatedMemory) {
-      auto* result = ::mmap(nullptr, memorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-      if (result == MAP_FAILED)
+      // The region is aligned to the huge page size, so that the huge page
+      // regions are at the same offsets in all memory managers. Otherwise,
+      // no image could be created from two of them.
+      static_assert(RegionArena::alignment == hugePageSize);
+      auto regionSize = (udoMemoryRegionSize.get() + hugePageSize - 1) / hugePageSize * hugePageSize;
+      regionSize = clamp(regionSize, hugePageSize, windowSize);
+      uint64_t committedSize = 0;
+      auto* region = getRegionArena().allocateRegion(regionSize, windowSize, committedSize);
+      if (!region)
          return nullptr;
-      systemAllocatedMemory = static_cast<byte*>(result);
-      systemMemoryBegin = systemAllocatedMemory;
+      systemAllocatedMemory = region;
+      systemMemoryBegin = region;
+      systemMemoryCommitted = region + committedSize;
+      memorySize = regionSize;
    }
+
+   if (udoHugePageCode && (allocationType == AllocationType::Code || (allocationType == AllocationType::ROData && udoHugePageROData))) {
+      auto& begin = allocationType == AllocationType::Code ? codeHugePagesBegin : roDataHugePagesBegin;
+      auto& end = allocationType == AllocationType::Code ? codeHugePagesEnd : roDataHugePagesEnd;
+      auto size = numPages * pageSize;
+      if (static_cast<uint64_t>(end - begin) < size) {
+         // The rest of the current region is left unused, so that all
+         // allocations of a type are packed into as few huge pages as possible
+         auto* region = allocateHugePageRegion(size, allocationType);
+         if (!region)
+            return nullptr;
+         begin = region->ptr;
+         end = region->ptr + region->size;
+      }
+      auto* ptr = begin;
+      begin += size;
+      return ptr;
+   }
+
    auto* newBegin = systemMemoryBegin + numPages * pageSize;
-   if (newBegin > systemAllocatedMemory + memorySize)
+   if (newBegin > systemAllocatedMemory + memorySize || !commit(newBegin))
       return nullptr;
 
    auto* ptr = systemMemoryBegin;
@@ -55,6 +267,85 @@ byte* UDOMemoryManager::allocatePages(uint64_t numPages)
    return ptr;
 }
 //---------------------------------------------------------------------------
+UDOMemoryManager::HugePageRegion* UDOMemoryManager::allocateHugePageRegion(uint64_t size, AllocationType allocationType)
+// Allocate a new huge page region that is large enough for the given size
+{
+   auto offset = static_cast<uint64_t>(systemMemoryBegin - systemAllocatedMemory);
+   auto regionOffset = (offset + hugePageSize - 1) / hugePageSize * hugePageSize;
+   auto regionSize = (size + hugePageSize - 1) / hugePageSize * hugePageSize;
+   if (regionOffset + regionSize > memorySize)
+      return nullptr;
+
+   // The pages that are skipped for the alignment must be accessible as well,
+   // as images contain the whole memory
+   auto* ptr = systemAllocatedMemory + regionOffset;
+   bool isHugeTLB = false;
+   if (!commit(ptr) || !mapHugePages(ptr, regionSize, isHugeTLB))
+      return nullptr;
+   systemMemoryCommitted = max(systemMemoryCommitted, ptr + regionSize);
+
+   // The pages that were skipped for the alignment are never used
+   systemMemoryBegin = ptr + regionSize;
+   // Transparent huge pages are only requested, the kernel may never back
+   // the region with them. Explicit huge pages can't be split into regular
+   // pages when the region is reused, so they are remapped.
+   if (isHugeTLB) {
+      numHugePages += regionSize / hugePageSize;
+      remappedRanges.emplace_back(ptr, regionSize);
+   }
+   return &hugePageRegions.emplace_back(HugePageRegion{ptr, regionSize, allocationType});
+}
+//---------------------------------------------------------------------------
+bool UDOMemoryManager::commit(byte* end)
+// Commit the memory of the region up to at least `end`
+{
+   if (end <= systemMemoryCommitted)
+      return true;
+
+   // The memory is committed in steps of 2 MiB, so that mprotect() is rarely
+   // called and transparent huge pages can still be used
+   auto committedSize = (static_cast<uint64_t>(end - systemAllocatedMemory) + hugePageSize - 1) / hugePageSize * hugePageSize;
+   auto* newCommitted = systemAllocatedMemory + min(committedSize, memorySize);
+   if (::mprotect(systemMemoryCommitted, newCommitted - systemMemoryCommitted, PROT_READ | PROT_WRITE) < 0)
+      return false;
+   systemMemoryCommitted = newCommitted;
+   return true;
+}
+//---------------------------------------------------------------------------
+bool UDOMemoryManager::resetRegion()
+// Reset the region so that it can be reused by another memory manager
+{
+   // File mappings and explicit huge pages can't be reused as regular pages,
+   // they are replaced by anonymous memory that contains zeros
+   for (auto [ptr, size] : remappedRanges)
+      if (::mmap(ptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+         return false;
+   if (::mprotect(systemAllocatedMemory, systemMemoryCommitted - systemAllocatedMemory, PROT_READ | PROT_WRITE) < 0)
+      return false;
+
+   // All other pages stay populated. Images compare all memory of two memory
+   // managers, so the allocations in them must be cleared. The pages outside
+   // of the allocations were never written.
+   auto ranges = remappedRanges;
+   sort(ranges.begin(), ranges.end());
+   for (auto& mem : allocatedMemory) {
+      auto it = upper_bound(ranges.begin(), ranges.end(), mem.ptr, [](const byte* ptr, const pair<byte*, uint64_t>& range) { return ptr < range.first; });
+      if (it != ranges.begin() && mem.ptr + mem.size <= prev(it)->first + prev(it)->second)
+         continue;
+      memset(mem.ptr, 0, mem.size);
+   }
+   return true;
+}
+//---------------------------------------------------------------------------
+bool UDOMemoryManager::isInHugePageRegion(const byte* ptr) const
+// Is the pointer in a huge page region?
+{
+   for (auto& region : hugePageRegions)
+      if (ptr >= region.ptr && ptr < region.ptr + region.size)
+         return true;
+   return false;
+}
+//---------------------------------------------------------------------------
 byte* UDOMemoryManager::allocate(uint64_t size, unsigned alignment, AllocationType allocationType)
 // Allocate
 {
@@ -106,7 +397,7 @@ byte* UDOMemoryManager::allocate(uint64_t size, unsigned alignment, AllocationTy
       auto numPages = ((size - 1) / pageSize + 1);
       allocationSize = numPages * pageSize;
 
-      auto* ptr = allocatePages(numPages);
+      auto* ptr = allocatePages(numPages, allocationType);
       if (!ptr)
          return nullptr;
 
@@ -123,6 +414,9 @@ byte* UDOMemoryManager::allocate(uint64_t size, unsigned alignment, AllocationTy
          case AllocationType::Code:
             sizeClasses = &codePageClasses;
             break;
+         case AllocationType::ColdCode:
+            sizeClasses = &coldCodePageClasses;
+            break;
       }
 
       updateFreeLists(*sizeClasses, ptr + allocationSize, allocationSize - size);
@@ -142,6 +436,9 @@ byte* UDOMemoryManager::allocate(uint64_t size, unsigned alignment, AllocationTy
          case AllocationType::Code:
             sizeClasses = &codePageClasses;
             break;
+         case AllocationType::ColdCode:
+            sizeClasses = &coldCodePageClasses;
+            break;
       }
       auto& page = (*sizeClasses)[sizeLog2 - smallestAllocationLog2];
 
@@ -161,7 +458,7 @@ byte* UDOMemoryManager::allocate(uint64_t size, unsigned alignment, AllocationTy
       }
 
       if (page.begin == page.end) {
-         auto* pagePtr = allocatePages(1);
+         auto* pagePtr = allocatePages(1, allocationType);
          if (!pagePtr)
             return nullptr;
 
@@ -183,6 +480,28 @@ byte* UDOMemoryManager::allocate(uint64_t size, unsigned alignment, AllocationTy
    }
 }
 //---------------------------------------------------------------------------
+bool UDOMemoryManager::snapshotData()
+// Save the rw-pages in a memfd. Returns false if no memfd could be created.
+{
+   int fd = ::memfd_create("udo-data", MFD_CLOEXEC);
+   if (fd < 0)
+      return false;
+
+   uint64_t offset = 0;
+   for (auto& mem : allocatedMemory) {
+      if (mem.type == AllocationType::Data) {
+         if (!writeFile(fd, mem.ptr, mem.size, offset)) {
+            ::close(fd);
+            return false;
+         }
+         offset += mem.size;
+      }
+   }
+
+   frozenDataFd = fd;
+   return true;
+}
+//---------------------------------------------------------------------------
 bool UDOMemoryManager::freeze()
 // "Freeze" the state of the memory manager: The correct page permissions
 // will be applied and all rw-pages are saved so that their contents can be
@@ -190,18 +509,31 @@ bool UDOMemoryManager::freeze()
 {
    size_t totalFrozenSize = 0;
 
+   // The huge page regions are protected as a whole, as protecting only a
+   // part of a huge page would split it into regular pages
+   for (auto& region : hugePageRegions) {
+      auto result = ::mprotect(region.ptr, region.size, region.type == AllocationType::Code ? (PROT_READ | PROT_EXEC) : PROT_READ);
+      if (result < 0)
+         return false;
+   }
+
    for (auto& mem : allocatedMemory) {
       switch (mem.type) {
          case AllocationType::Data:
             totalFrozenSize += mem.size;
             break;
          case AllocationType::ROData: {
+            if (isInHugePageRegion(mem.ptr))
+               break;
             auto result = ::mprotect(mem.ptr, mem.size, PROT_READ);
             if (result < 0)
                return false;
             break;
          }
-         case AllocationType::Code: {
+         case AllocationType::Code:
+         case AllocationType::ColdCode: {
+            if (isInHugePageRegion(mem.ptr))
+               break;
             auto result = ::mprotect(mem.ptr, mem.size, PROT_READ | PROT_EXEC);
             if (result < 0)
                return false;
@@ -210,6 +542,25 @@ bool UDOMemoryManager::freeze()
       }
    }
 
+   resetStatistics.numDataPages = totalFrozenSize / pageSize;
+   isClean = true;
+
+   // Preferably, the rw-pages are mapped copy-on-write from a snapshot. Then,
+   // initialize() only has to drop the pages that were actually written.
+   if (snapshotData()) {
+      size_t offset = 0;
+      for (auto& mem : allocatedMemory) {
+         if (mem.type == AllocationType::Data) {
+            auto* result = ::mmap(mem.ptr, mem.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, frozenDataFd, static_cast<off_t>(offset));
+            if (result == MAP_FAILED)
+               return false;
+            remappedRanges.emplace_back(mem.ptr, mem.size);
+            offset += mem.size;
+         }
+      }
+      return true;
+   }
+
    // Doing this instead of using make_unique does not zero the memory. This is
    // unnecessary as we overwrite the memory below anyway.
    frozenData = unique_ptr<byte[]>(new byte[totalFrozenSize]);
@@ -222,14 +573,73 @@ bool UDOMemoryManager::freeze()
       }
    }
 
-   isClean = true;
-
    return true;
 }
 //---------------------------------------------------------------------------
+uint64_t UDOMemoryManager::dropWrittenPages(byte* ptr, uint64_t size) const
+// Drop the private copies of the pages in the given region that were written
+// since they were mapped. Returns the number of dropped pages.
+{
+   auto numPages = size / pageSize;
+
+   int pagemapFd = getPagemapFd();
+   if (pagemapFd < 0) {
+      ::madvise(ptr, size, MADV_DONTNEED);
+      return numPages;
+   }
+
+   // The pagemap contains one 64 bit entry per page. A written page of a
+   // private file mapping is no longer backed by the file, so its "file-page"
+   // bit is cleared. A written page can also have been swapped out, clean
+   // pages of the file are never swapped but just dropped by the kernel.
+   static constexpr uint64_t pagePresentBit = 1ull << 63;
+   static constexpr uint64_t pageSwappedBit = 1ull << 62;
+   static constexpr uint64_t pageFileBit = 1ull << 61;
+   static constexpr uint64_t entriesPerRead = 512;
+
+   uint64_t numDroppedPages = 0;
+   uint64_t firstPage = reinterpret_cast<uintptr_t>(ptr) >> pageSizeLog2;
+   // The begin of the current run of written pages, numPages if there is none
+   uint64_t runBegin = numPages;
+   auto dropRun = [&](uint64_t runEnd) {
+      if (runBegin < runEnd) {
+         ::madvise(ptr + runBegin * pageSize, (runEnd - runBegin) * pageSize, MADV_DONTNEED);
+         numDroppedPages += runEnd - runBegin;
+      }
+      runBegin = numPages;
+   };
+
+   array<uint64_t, entriesPerRead> entries;
+   for (uint64_t i = 0; i < numPages; i += entriesPerRead) {
+      auto numEntries = min(entriesPerRead, numPages - i);
+      auto bytes = numEntries * sizeof(uint64_t);
+      if (::pread(pagemapFd, entries.data(), bytes, static_cast<off_t>((firstPage + i) * sizeof(uint64_t))) != static_cast<ssize_t>(bytes)) {
+         // Conservatively drop everything that was not checked
+         dropRun(i);
+         ::madvise(ptr + i * pageSize, (numPages - i) * pageSize, MADV_DONTNEED);
+         return numDroppedPages + numPages - i;
+      }
+
+      for (uint64_t j = 0; j < numEntries; ++j) {
+         bool isWritten = ((entries[j] & pagePresentBit) && !(entries[j] & pageFileBit)) || (entries[j] & pageSwappedBit);
+         if (isWritten) {
+            if (runBegin == numPages)
+               runBegin = i + j;
+         } else {
+            dropRun(i + j);
+         }
+      }
+   }
+   dropRun(numPages);
+
+   return numDroppedPages;
+}
+//---------------------------------------------------------------------------
 void UDOMemoryManager::initialize() const
 // Initialize the rw-pages to the state when freeze() was called.
 {
+   ++resetStatistics.numInitializations;
+
    // The first time initialize() is used, the memory is considered clean, so
    // in that case we don't need to do anything. Just remember that
    // initialize() was called once by setting isClean to false.
@@ -238,6 +648,15 @@ void UDOMemoryManager::initialize() const
       return;
    }
 
+   if (frozenDataFd >= 0) {
+      // Dropping the private copies of the written pages restores their
+      // contents from the snapshot on the next access.
+      for (auto& mem : allocatedMemory)
+         if (mem.type == AllocationType::Data)
+            resetStatistics.numRestoredPages += dropWrittenPages(mem.ptr, mem.size);
+      return;
+   }
+
    // freeze() must be called before initialize()
    assert(frozenData);
 
@@ -248,6 +667,144 @@ void UDOMemoryManager::initialize() const
          offset += mem.size;
       }
    }
+   resetStatistics.numRestoredPages += resetStatistics.numDataPages;
+}
+//---------------------------------------------------------------------------
+UDOMemoryManager::Image::~Image()
+// Destructor
+{
+   if (fd >= 0)
+      ::close(fd);
+}
+//---------------------------------------------------------------------------
+bool UDOMemoryManager::findRelocations(span<const byte> first, span<const byte> second, uint64_t delta, vector<uint64_t>& relocations)
+// Find the offsets of all 64 bit values in `first` and `second` that differ
+// by exactly `delta`. Returns false if there are other differences.
+{
+   if (first.size() != second.size())
+      return false;
+
+   uint64_t size = first.size();
+   uint64_t coveredEnd = 0;
+   for (uint64_t i = 0; i < size;) {
+      // Skip identical pages quickly
+      if (i % pageSize == 0 && i + pageSize <= size && memcmp(first.data() + i, second.data() + i, pageSize) == 0) {
+         i += pageSize;
+         continue;
+      }
+      if (first[i] == second[i]) {
+         ++i;
+         continue;
+      }
+
+      // The lowest bytes of the addresses may be identical, so the value can
+      // start up to 7 bytes before the first differing byte.
+      bool found = false;
+      for (uint64_t start = max<uint64_t>(i >= 7 ? i - 7 : 0, coveredEnd); start <= i && start + sizeof(uint64_t) <= size; ++start) {
+         uint64_t firstValue, secondValue;
+         memcpy(&firstValue, first.data() + start, sizeof(uint64_t));
+         memcpy(&secondValue, second.data() + start, sizeof(uint64_t));
+         if (secondValue - firstValue == delta) {
+            relocations.push_back(start);
+            coveredEnd = start + sizeof(uint64_t);
+            i = coveredEnd;
+            found = true;
+            break;
+         }
+      }
+      if (!found)
+         return false;
+   }
+
+   return true;
+}
+//---------------------------------------------------------------------------
+unique_ptr<UDOMemoryManager::Image> UDOMemoryManager::createImage(const UDOMemoryManager& first, const UDOMemoryManager& second)
+// Create an image from two memory managers that contain the same objects
+// linked at different addresses
+{
+   if (!first.systemAllocatedMemory || !second.systemAllocatedMemory)
+      return nullptr;
+
+   uint64_t size = first.systemMemoryBegin - first.systemAllocatedMemory;
+   if (size != static_cast<uint64_t>(second.systemMemoryBegin - second.systemAllocatedMemory))
+      return nullptr;
+   if (first.allocatedMemory.size() != second.allocatedMemory.size())
+      return nullptr;
+
+   auto image = make_unique<Image>();
+   image->size = size;
+   image->baseAddress = reinterpret_cast<uintptr_t>(first.systemAllocatedMemory);
+
+   for (size_t i = 0; i < first.allocatedMemory.size(); ++i) {
+      auto& firstMem = first.allocatedMemory[i];
+      auto& secondMem = second.allocatedMemory[i];
+      uint64_t offset = firstMem.ptr - first.systemAllocatedMemory;
+      if (offset != static_cast<uint64_t>(secondMem.ptr - second.systemAllocatedMemory) || firstMem.size != secondMem.size || firstMem.type != secondMem.type)
+         return nullptr;
+      image->allocations.push_back({offset, firstMem.size, firstMem.type, false});
+   }
+
+   uint64_t delta = reinterpret_cast<uintptr_t>(second.systemAllocatedMemory) - image->baseAddress;
+   if (!findRelocations(span(first.systemAllocatedMemory, size), span(second.systemAllocatedMemory, size), delta, image->relocations))
+      return nullptr;
+
+   // Remember which allocations contain relocations as they can't be shared
+   {
+      auto relocationIt = image->relocations.begin();
+      for (auto& allocation : image->allocations) {
+         relocationIt = lower_bound(relocationIt, image->relocations.end(), allocation.offset);
+         if (relocationIt != image->relocations.end() && *relocationIt < allocation.offset + allocation.size)
+            allocation.hasRelocations = true;
+      }
+   }
+
+   image->fd = ::memfd_create("udo-image", MFD_CLOEXEC);
+   if (image->fd < 0)
+      return nullptr;
+   if (::ftruncate(image->fd, static_cast<off_t>(size)) < 0)
+      return nullptr;
+   if (!writeFile(image->fd, first.systemAllocatedMemory, size, 0))
+      return nullptr;
+
+   return image;
+}
+//---------------------------------------------------------------------------
+bool UDOMemoryManager::mapImage(const Image& image)
+// Map an image at the beginning of the memory
+{
+   if (systemAllocatedMemory || image.size % pageSize != 0)
+      return false;
+
+   // The image is mapped from its file, so it never uses huge pages
+   auto* base = allocatePages(image.size / pageSize, AllocationType::Data);
+   if (!base)
+      return false;
+
+   for (auto& allocation : image.allocations) {
+      auto* ptr = base + allocation.offset;
+      // Only allocations that are never written can be shared, all others
+      // are mapped copy-on-write.
+      bool isShared = allocation.type != AllocationType::Data && !allocation.hasRelocations;
+      int prot = PROT_READ | PROT_WRITE;
+      if (isShared)
+         prot = (allocation.type == AllocationType::Code || allocation.type == AllocationType::ColdCode) ? (PROT_READ | PROT_EXEC) : PROT_READ;
+      auto* result = ::mmap(ptr, allocation.size, prot, (isShared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, image.fd, static_cast<off_t>(allocation.offset));
+      if (result == MAP_FAILED)
+         return false;
+      remappedRanges.emplace_back(ptr, allocation.size);
+      allocatedMemory.push_back({ptr, allocation.size, allocation.type});
+   }
+
+   uint64_t delta = reinterpret_cast<uintptr_t>(base) - image.baseAddress;
+   for (auto offset : image.relocations) {
+      uint64_t value;
+      memcpy(&value, base + offset, sizeof(value));
+      value += delta;
+      memcpy(base + offset, &value, sizeof(value));
+   }
+
+   return true;
 }
 //---------------------------------------------------------------------------
 }
@@ -5,6 +5,8 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <span>
+#include <utility>
 #include <vector>
 //---------------------------------------------------------------------------
 // UDO runtime
@@ -20,7 +22,10 @@ class UDOMemoryManager {
    enum class AllocationType {
       Data,
       ROData,
-      Code
+      Code,
+      /// Code that is rarely executed, it is kept apart from the other code
+      /// so that the hot code is packed into fewer pages
+      ColdCode
    };
 
    private:
@@ -34,6 +39,16 @@ class UDOMemoryManager {
       AllocationType type;
    };
 
+   /// A region of huge pages that is split into pages for one allocation type
+   struct HugePageRegion {
+      /// The pointer to the region
+      std::byte* ptr;
+      /// The size of the region
+      uint64_t size;
+      /// The type of the allocations in this region
+      AllocationType type;
+   };
+
    /// The current non-full page for a size class
    struct CurrentPage {
       /// The pointer to the beginning of the free list
@@ -47,13 +62,16 @@ class UDOMemoryManager {
    // The code from the object files that we load for the libraries that UDOs
    // depend on expect to lie within 2 GiB of eatch other. This is because it
    // is usually compiled with -mcmodel=small which is the default for x86_64.
-   // To ensure this, we just allocate a large 2 GiB region and rely on the
-   // kernel to not actually allocate the pages until they are actually used.
-   static constexpr uint64_t memorySize = 2 * (1ull << 30);
+   // To ensure this, every memory manager gets a region of at most 2 GiB.
+   // The regions are split from windows of 2 GiB that are only reserved, the
+   // memory of a region is committed as it is allocated.
+   static constexpr uint64_t windowSize = 2 * (1ull << 30);
    /// The log 2 of the page size
    static constexpr uint64_t pageSizeLog2 = 12;
    /// The page size
    static constexpr uint64_t pageSize = 1ull << pageSizeLog2;
+   /// The size of a huge page
+   static constexpr uint64_t hugePageSize = 2ull << 20;
    /// The log2 of the smallest allocation size. It must be at least 8B so that
    /// a pointer for the free list can be embedded into any allocation.
    static constexpr uint64_t smallestAllocationLog2 = 4;
@@ -65,6 +83,10 @@ class UDOMemoryManager {
    std::byte* systemAllocatedMemory = nullptr;
    /// The start of the unused system memory
    std::byte* systemMemoryBegin = nullptr;
+   /// The end of the memory that was committed
+   std::byte* systemMemoryCommitted = nullptr;
+   /// The size of the region of the memory manager
+   uint64_t memorySize = 0;
    /// All allocated pages
    std::vector<AllocatedMemory> allocatedMemory;
    /// The current data pages for all size classes
@@ -73,14 +95,111 @@ class UDOMemoryManager {
    std::array<CurrentPage, numSizeClasses> roDataPageClasses = {};
    /// The current code pages for all size classes
    std::array<CurrentPage, numSizeClasses> codePageClasses = {};
+   /// The current cold code pages for all size classes
+   std::array<CurrentPage, numSizeClasses> coldCodePageClasses = {};
+   /// All regions of huge pages
+   std::vector<HugePageRegion> hugePageRegions;
+   /// The unused part of the current huge page region for code
+   std::byte* codeHugePagesBegin = nullptr;
+   /// The end of the current huge page region for code
+   std::byte* codeHugePagesEnd = nullptr;
+   /// The unused part of the current huge page region for read-only data
+   std::byte* roDataHugePagesBegin = nullptr;
+   /// The end of the current huge page region for read-only data
+   std::byte* roDataHugePagesEnd = nullptr;
+   /// The number of explicit huge pages that back the regions
+   uint64_t numHugePages = 0;
+   /// The ranges that were mapped from a file or with explicit huge pages.
+   /// They are replaced by anonymous memory when the region is reused.
+   std::vector<std::pair<std::byte*, uint64_t>> remappedRanges;
+
+   public:
+   /// A relocatable snapshot of all pages of a memory manager that can be
+   /// mapped into other memory managers. The code and read-only pages of the
+   /// image are shared between all memory managers that map it.
+   class Image {
+      private:
+      friend UDOMemoryManager;
+
+      /// An allocation of the image
+      struct Allocation {
+         /// The offset of the allocation in the image
+         uint64_t offset;
+         /// The size of the allocation
+         uint64_t size;
+         /// The type of the allocation
+         AllocationType type;
+         /// Does the allocation contain relocations?
+         bool hasRelocations;
+      };
 
-   /// The frozen data generated by calling freeze()
+      /// The file descriptor of the memfd that contains the image
+      int fd = -1;
+      /// The size of the image
+      uint64_t size = 0;
+      /// The address the image was created at
+      uintptr_t baseAddress = 0;
+      /// The allocations
+      std::vector<Allocation> allocations;
+      /// The offsets of all 64 bit absolute addresses that point into the
+      /// image and have to be relocated when the image is mapped
+      std::vector<uint64_t> relocations;
+
+      public:
+      /// Constructor
+      Image() = default;
+      /// Destructor
+      ~Image();
+
+      Image(const Image&) = delete;
+      Image& operator=(const Image&) = delete;
+
+      /// Get the address the image was created at
+      uintptr_t getBaseAddress() const { return baseAddress; }
+      /// Get the size of the image
+      uint64_t getSize() const { return size; }
+   };
+
+   /// Statistics about the resets of the rw-pages by initialize()
+   struct ResetStatistics {
+      /// The number of calls to initialize()
+      uint64_t numInitializations = 0;
+      /// The total number of pages that had to be restored
+      uint64_t numRestoredPages = 0;
+      /// The number of rw-pages
+      uint64_t numDataPages = 0;
+   };
+
+   private:
+   /// The frozen data generated by calling freeze() if no snapshot could be
+   /// created
    std::unique_ptr<std::byte[]> frozenData;
+   /// The memfd that contains the snapshot of the rw-pages generated by
+   /// calling freeze(), -1 if frozenData is used instead
+   int frozenDataFd = -1;
    /// Is the memory in the initial, clean state?
    mutable bool isClean = false;
+   /// The reset statistics
+   mutable ResetStatistics resetStatistics;
 
-   /// Allocate new pages from the operating system
-   std::byte* allocatePages(uint64_t numPages);
+   /// Allocate new pages from the operating system. Code and read-only data
+   /// are placed in huge page regions if that is enabled for their type.
+   std::byte* allocatePages(uint64_t numPages, AllocationType allocationType);
+   /// Commit the memory of the region up to at least `end`
+   bool commit(std::byte* end);
+   /// Reset the region so that it can be reused by another memory manager:
+   /// All pages are writable anonymous memory and contain zeros, but stay
+   /// populated. Returns false when an error occurred.
+   bool resetRegion();
+   /// Allocate a new huge page region that is large enough for the given size
+   HugePageRegion* allocateHugePageRegion(uint64_t size, AllocationType allocationType);
+   /// Is the pointer in a huge page region?
+   bool isInHugePageRegion(const std::byte* ptr) const;
+   /// Save the rw-pages in a memfd and map them copy-on-write from there
+   bool snapshotData();
+   /// Drop the private copies of the pages in the given region that were
+   /// written since they were mapped. Returns the number of dropped pages.
+   uint64_t dropWrittenPages(std::byte* ptr, uint64_t size) const;
 
    public:
    /// Constructor
@@ -94,8 +213,34 @@ class UDOMemoryManager {
    /// will be applied and all rw-pages are saved so that their contents can be
    /// restored by calling initialize(). Returns false when an error occurred.
    bool freeze();
-   /// Initialize the rw-pages to the state when freeze() was called.
+   /// Initialize the rw-pages to the state when freeze() was called. Only
+   /// the pages that were written since the last call are restored.
    void initialize() const;
+   /// Get the statistics about the resets by initialize()
+   const ResetStatistics& getResetStatistics() const { return resetStatistics; }
+
+   /// Get the address of the memory region, nullptr if nothing was allocated yet
+   std::byte* getBaseAddress() const { return systemAllocatedMemory; }
+   /// Get the size of the pages that were allocated from the reserved region
+   uint64_t getAllocatedSize() const { return systemMemoryBegin - systemAllocatedMemory; }
+   /// Get the size of the copy of the rw-pages that was saved by freeze()
+   uint64_t getFrozenDataSize() const { return resetStatistics.numDataPages * pageSize; }
+   /// Get the number of explicit huge pages that back code and read-only
+   /// data. Regions that fell back to transparent huge pages are not counted,
+   /// the kernel may still back them with regular pages.
+   uint64_t getNumHugePages() const { return numHugePages; }
+   /// Create an image from two memory managers that contain the same objects
+   /// linked at different addresses. The differences between both are used to
+   /// find the absolute addresses that need to be relocated. Returns nullptr
+   /// if the memory managers differ in any other way.
+   static std::unique_ptr<Image> createImage(const UDOMemoryManager& first, const UDOMemoryManager& second);
+   /// Map an image at the beginning of the memory. Must be called before
+   /// anything else is allocated. Returns false when an error occurred.
+   bool mapImage(const Image& image);
+
+   /// Find the offsets of all 64 bit values in `first` and `second` that
+   /// differ by exactly `delta`. Returns false if there are other differences.
+   static bool findRelocations(std::span<const std::byte> first, std::span<const std::byte> second, uint64_t delta, std::vector<uint64_t>& relocations);
 };
 //---------------------------------------------------------------------------
 }
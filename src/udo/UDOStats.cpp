@@ -0,0 +1,98 @@
+#include "udo/UDOStats.hpp"
+#include <ctime>
+#include <sys/resource.h>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+using namespace std;
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+/// The statistics that are collected by the current thread
+static thread_local UDOStats* currentStats = nullptr;
+/// The phases that are currently measured by the current thread as bitmask
+static thread_local unsigned activePhases = 0;
+//---------------------------------------------------------------------------
+static uint64_t getThreadCPUTime()
+// Get the CPU time of the current thread in nanoseconds
+{
+   timespec ts;
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+      return 0;
+   return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + static_cast<uint64_t>(ts.tv_nsec);
+}
+//---------------------------------------------------------------------------
+static uint64_t getPeakRSS()
+// Get the peak resident set size of the process in KiB
+{
+   rusage usage;
+   if (getrusage(RUSAGE_SELF, &usage) != 0)
+      return 0;
+   return static_cast<uint64_t>(usage.ru_maxrss);
+}
+//---------------------------------------------------------------------------
+UDOStats::Scope::Scope(UDOStats* stats)
+   : previous(currentStats)
+// Constructor
+{
+   currentStats = stats;
+}
+//---------------------------------------------------------------------------
+UDOStats::Scope::~Scope()
+// Destructor
+{
+   currentStats = previous;
+}
+//---------------------------------------------------------------------------
+UDOStats::PhaseTimer::PhaseTimer(UDOPhase phase)
+   : stats(currentStats ? &currentStats->phases[static_cast<unsigned>(phase)] : nullptr), phaseBit(1u << static_cast<unsigned>(phase)), cpuStart(0), peakRSSStart(0)
+// Constructor
+{
+   if (!stats)
+      return;
+   if (activePhases & phaseBit) {
+      stats = nullptr;
+      return;
+   }
+   activePhases |= phaseBit;
+
+   peakRSSStart = getPeakRSS();
+   cpuStart = getThreadCPUTime();
+   wallStart = chrono::steady_clock::now();
+}
+//---------------------------------------------------------------------------
+UDOStats::PhaseTimer::~PhaseTimer()
+// Destructor
+{
+   if (!stats)
+      return;
+   activePhases &= ~phaseBit;
+
+   auto wallEnd = chrono::steady_clock::now();
+   auto cpuEnd = getThreadCPUTime();
+   auto peakRSSEnd = getPeakRSS();
+
+   ++stats->count;
+   stats->wallTimeNs += chrono::duration_cast<chrono::nanoseconds>(wallEnd - wallStart).count();
+   if (cpuEnd > cpuStart)
+      stats->cpuTimeNs += cpuEnd - cpuStart;
+   if (peakRSSEnd > peakRSSStart)
+      stats->peakRSSDeltaKiB += peakRSSEnd - peakRSSStart;
+}
+//---------------------------------------------------------------------------
+UDOStats* UDOStats::getCurrent()
+// Get the statistics that are collected by the current thread
+{
+   return currentStats;
+}
+//---------------------------------------------------------------------------
+void UDOStats::count(uint64_t UDOStats::*counter, uint64_t value)
+// Increment a counter of the statistics of the current thread
+{
+   if (currentStats)
+      currentStats->*counter += value;
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,109 @@
+#ifndef H_udo_UDOStats
+#define H_udo_UDOStats
+//---------------------------------------------------------------------------
+#include <array>
+#include <chrono>
+#include <cstdint>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+/// The phases of compiling and linking a UDO that are measured. The phases
+/// can be nested, e.g. CodeGen is part of ClangCompile and Freeze is part of
+/// Finalize. A phase that is nested in the same phase, like loading an object
+/// from a static library while the UDO object is loaded, is only measured
+/// once.
+enum class UDOPhase : unsigned {
+   ClangCompile,
+   CodeGen,
+   Optimize,
+   CompileModule,
+   AddLibrary,
+   LoadObject,
+   Finalize,
+   Freeze,
+};
+//---------------------------------------------------------------------------
+/// The number of phases in UDOPhase
+constexpr unsigned numUDOPhases = static_cast<unsigned>(UDOPhase::Freeze) + 1;
+//---------------------------------------------------------------------------
+/// The measurements of one phase, summed up over all times the phase ran
+struct UDOPhaseStats {
+   /// How often the phase ran
+   uint64_t count = 0;
+   /// The wall time in nanoseconds
+   uint64_t wallTimeNs = 0;
+   /// The CPU time of the thread in nanoseconds
+   uint64_t cpuTimeNs = 0;
+   /// The increase of the peak resident set size of the process in KiB
+   uint64_t peakRSSDeltaKiB = 0;
+};
+//---------------------------------------------------------------------------
+/// The statistics about compiling and linking a UDO. The statistics are
+/// collected for the thread that set them with Scope, so the code that runs
+/// the phases does not need to know where the statistics go.
+struct UDOStats {
+   /// The measurements of each phase
+   std::array<UDOPhaseStats, numUDOPhases> phases;
+   /// The size of the compiled object file
+   uint64_t objectSize = 0;
+   /// The number of objects that were loaded from static libraries
+   uint64_t numArchiveMembersLoaded = 0;
+   /// The number of symbols that were resolved by the linker
+   uint64_t numSymbolsResolved = 0;
+   /// The number of explicit huge pages that back the linked code
+   uint64_t numHugePages = 0;
+
+   /// Sets the statistics that are collected by the current thread until
+   /// the scope ends
+   class Scope {
+      private:
+      /// The statistics that were collected before
+      UDOStats* previous;
+
+      public:
+      /// Constructor
+      explicit Scope(UDOStats* stats);
+      /// Destructor
+      ~Scope();
+
+      Scope(const Scope&) = delete;
+      Scope& operator=(const Scope&) = delete;
+   };
+
+   /// Measures a phase until the timer is destroyed
+   class PhaseTimer {
+      private:
+      /// The statistics of the phase, nullptr if no statistics are collected
+      UDOPhaseStats* stats;
+      /// The bit of the phase in the active phases of the thread
+      unsigned phaseBit;
+      /// The wall time when the phase started
+      std::chrono::steady_clock::time_point wallStart;
+      /// The CPU time when the phase started
+      uint64_t cpuStart;
+      /// The peak resident set size when the phase started
+      uint64_t peakRSSStart;
+
+      public:
+      /// Constructor
+      explicit PhaseTimer(UDOPhase phase);
+      /// Destructor
+      ~PhaseTimer();
+
+      PhaseTimer(const PhaseTimer&) = delete;
+      PhaseTimer& operator=(const PhaseTimer&) = delete;
+   };
+
+   /// Get the statistics that are collected by the current thread, nullptr if
+   /// there are none
+   static UDOStats* getCurrent();
+   /// Increment a counter of the statistics of the current thread
+   static void count(uint64_t UDOStats::*counter, uint64_t value = 1);
+};
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+#endif
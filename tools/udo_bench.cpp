@@ -0,0 +1,577 @@
+#include "runtime/UDOperator.hpp"
+#include "udo/CxxUDOAnalyzer.hpp"
+#include "udo/CxxUDOCompiler.hpp"
+#include "udo/CxxUDOExecution.hpp"
+#include "udo/CxxUDOExecutor.hpp"
+#include "udo/Setting.hpp"
+#include "udo/UDOStats.hpp"
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+//---------------------------------------------------------------------------
+// UDO runtime
+// (c) 2021 Moritz Sichert
+//---------------------------------------------------------------------------
+// udo_bench compiles a C++ UDO, links it into its own process and executes
+// it on synthetic or file-backed input without a database. It reports the
+// time of every step of the execution and the latencies of the calls into the
+// UDO, so that the UDO runtime can be profiled in isolation.
+//
+// Usage: udo_bench [--<setting>=<value>]... <source file> <UDO class name>
+//
+// All settings can also be set on the command line, e.g. --cxxUDOOptLevel=2.
+//---------------------------------------------------------------------------
+using namespace std;
+//---------------------------------------------------------------------------
+namespace udo {
+//---------------------------------------------------------------------------
+static Setting<unsigned> udoBenchThreads("udoBenchThreads", "The number of worker threads of udo_bench, 0 to use one per hardware thread", 0);
+static Setting<uint64_t> udoBenchTuples("udoBenchTuples", "The number of synthetic input tuples that udo_bench generates if udoBenchInput is not set", 1'000'000);
+static Setting<unsigned> udoBenchBatchSize("udoBenchBatchSize", "The number of input tuples in a morsel of udo_bench, the latency of accept is measured per morsel", 1024);
+static Setting<string> udoBenchInput("udoBenchInput", "A file with the input tuples of udo_bench, one tuple per line with comma-separated attributes", {});
+static Setting<string> udoBenchArguments("udoBenchArguments", "The comma-separated scalar arguments that udo_bench passes to the constructor of the UDO", {});
+//---------------------------------------------------------------------------
+namespace {
+//---------------------------------------------------------------------------
+/// The size of the TLS block that is reserved for the UDO
+constexpr uint64_t tlsBlockSize = 64 * 1024;
+/// The TLS block of the UDO. It is part of the static TLS of the executable,
+/// so it has the same offset to the thread pointer in every thread.
+alignas(64) thread_local byte tlsBlock[tlsBlockSize];
+/// The random number generator of the current thread
+thread_local mt19937_64 randomGenerator;
+/// The mutex that serializes the debug output of the UDO
+mutex printDebugMutex;
+//---------------------------------------------------------------------------
+/// The kind of an attribute of the input tuple
+enum class AttributeKind {
+   Integer,
+   Float,
+   Double,
+   String,
+};
+//---------------------------------------------------------------------------
+/// An attribute of the input tuple
+struct InputAttribute {
+   /// The kind
+   AttributeKind kind;
+   /// The offset in the tuple
+   uint64_t offset;
+   /// The size in bytes
+   uint64_t size;
+};
+//---------------------------------------------------------------------------
+/// The input tuples of the UDO
+struct InputData {
+   /// The tuples, laid out like an array of InputTuple
+   vector<byte> tuples;
+   /// The size of a tuple including the padding to the next one
+   uint64_t tupleSize = 0;
+   /// The number of tuples
+   uint64_t numTuples = 0;
+   /// The long strings that are referenced by the tuples
+   deque<string> strings;
+};
+//---------------------------------------------------------------------------
+/// The arguments of the constructor in the order in which they are passed in
+/// registers by the x86-64 SysV calling convention. Integer and floating
+/// point arguments use separate registers, so passing all registers lets the
+/// constructor be called without knowing its exact signature.
+struct ConstructorArguments {
+   /// The integer arguments
+   array<uint64_t, 5> integers = {};
+   /// The floating point arguments
+   array<double, 8> floatingPoints = {};
+};
+//---------------------------------------------------------------------------
+/// The emit sink that counts the emitted tuples
+class CountingSink : public CxxUDOEmitSink {
+   private:
+   /// The counter of a worker
+   struct alignas(64) Counter {
+      /// The number of emitted tuples
+      uint64_t numTuples = 0;
+   };
+
+   /// The counters of all workers
+   vector<Counter> counters;
+
+   public:
+   /// Constructor
+   explicit CountingSink(unsigned numWorkers) : counters(numWorkers) {}
+
+   /// Consume tuples that were emitted by a worker
+   void consume(unsigned workerId, const void* /*tuples*/, uint64_t numTuples) override { counters[workerId].numTuples += numTuples; }
+   /// Get the number of emitted tuples
+   uint64_t getNumTuples() const {
+      uint64_t numTuples = 0;
+      for (auto& counter : counters)
+         numTuples += counter.numTuples;
+      return numTuples;
+   }
+};
+//---------------------------------------------------------------------------
+uint64_t measureNs(chrono::steady_clock::time_point start)
+// Get the nanoseconds since start
+{
+   return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+//---------------------------------------------------------------------------
+void printDebugCallback(void* /*functor*/, const char* msg, uint64_t size)
+// The printDebug callback
+{
+   unique_lock lock(printDebugMutex);
+   cerr.write(msg, size);
+   cerr << '\n';
+}
+//---------------------------------------------------------------------------
+uint64_t getRandomCallback(void* /*functor*/)
+// The getRandom callback
+{
+   return randomGenerator();
+}
+//---------------------------------------------------------------------------
+int64_t getTLSBlockOffset()
+// Get the offset of the TLS block relative to the thread pointer
+{
+   byte* threadPointer;
+#if defined(__x86_64__) && defined(__ELF__)
+   asm("mov %%fs:0, %0"
+       : "=r"(threadPointer));
+#else
+#error "Unsupported target for thread-local storage"
+#endif
+   return tlsBlock - threadPointer;
+}
+//---------------------------------------------------------------------------
+vector<string_view> split(string_view str, char separator)
+// Split a string at a separator
+{
+   vector<string_view> parts;
+   while (true) {
+      auto pos = str.find(separator);
+      parts.push_back(str.substr(0, pos));
+      if (pos == string_view::npos)
+         return parts;
+      str.remove_prefix(pos + 1);
+   }
+}
+//---------------------------------------------------------------------------
+template <typename T>
+bool parseNumber(string_view str, T& value)
+// Parse a number that must span the whole string
+{
+   while (!str.empty() && str.front() == ' ')
+      str.remove_prefix(1);
+   while (!str.empty() && str.back() == ' ')
+      str.remove_suffix(1);
+   auto [ptr, ec] = from_chars(str.data(), str.data() + str.size(), value);
+   return ec == errc() && ptr == str.data() + str.size();
+}
+//---------------------------------------------------------------------------
+tl::expected<vector<InputAttribute>, string> getInputAttributes(const CxxUDOAnalysis& analysis, const llvm::DataLayout& dataLayout, uint64_t& tupleSize)
+// Get the attributes of the input tuple of a UDO
+{
+   vector<InputAttribute> attributes;
+   tupleSize = 0;
+   if (!analysis.inputTupleType)
+      return attributes;
+
+   auto* structType = llvm::dyn_cast<llvm::StructType>(analysis.inputTupleType);
+   if (!structType)
+      return tl::unexpected("InputTuple is not a struct"s);
+   auto* structLayout = dataLayout.getStructLayout(structType);
+   tupleSize = dataLayout.getTypeAllocSize(structType);
+
+   for (unsigned i = 0; i < structType->getNumElements(); ++i) {
+      auto* type = structType->getElementType(i);
+      InputAttribute attribute;
+      attribute.offset = structLayout->getElementOffset(i);
+      attribute.size = dataLayout.getTypeAllocSize(type);
+      if (type == analysis.stringType)
+         attribute.kind = AttributeKind::String;
+      else if (type->isIntegerTy() && attribute.size <= sizeof(uint64_t))
+         attribute.kind = AttributeKind::Integer;
+      else if (type->isFloatTy())
+         attribute.kind = AttributeKind::Float;
+      else if (type->isDoubleTy())
+         attribute.kind = AttributeKind::Double;
+      else
+         return tl::unexpected("unsupported type of input attribute " + to_string(i));
+      attributes.push_back(attribute);
+   }
+
+   return attributes;
+}
+//---------------------------------------------------------------------------
+void setAttribute(const InputAttribute& attribute, byte* tuple, int64_t integer, double floatingPoint)
+// Set a scalar attribute, integer is used for integers and floatingPoint for
+// floating point numbers
+{
+   switch (attribute.kind) {
+      case AttributeKind::Integer:
+         // x86-64 is little endian, so the low bytes are stored first
+         memcpy(tuple + attribute.offset, &integer, attribute.size);
+         break;
+      case AttributeKind::Float: {
+         auto value = static_cast<float>(floatingPoint);
+         memcpy(tuple + attribute.offset, &value, sizeof(value));
+         break;
+      }
+      case AttributeKind::Double:
+         memcpy(tuple + attribute.offset, &floatingPoint, sizeof(floatingPoint));
+         break;
+      case AttributeKind::String:
+         break;
+   }
+}
+//---------------------------------------------------------------------------
+void setString(const InputAttribute& attribute, byte* tuple, string_view value, InputData& input)
+// Set a string attribute
+{
+   // Only long strings are stored as pointers, so only they must be kept alive
+   String str(value);
+   if (value.size() > 12)
+      str = String(input.strings.emplace_back(value));
+   memcpy(tuple + attribute.offset, &str, sizeof(str));
+}
+//---------------------------------------------------------------------------
+InputData generateInput(span<const InputAttribute> attributes, uint64_t tupleSize, uint64_t numTuples)
+// Generate synthetic input tuples, attribute j of tuple i is i + j
+{
+   InputData input;
+   input.tupleSize = tupleSize;
+   input.numTuples = numTuples;
+   input.tuples.resize(tupleSize * numTuples);
+
+   string str;
+   for (uint64_t i = 0; i < numTuples; ++i) {
+      auto* tuple = input.tuples.data() + i * tupleSize;
+      for (unsigned j = 0; j < attributes.size(); ++j) {
+         auto value = static_cast<int64_t>(i + j);
+         if (attributes[j].kind == AttributeKind::String) {
+            str = "str" + to_string(value);
+            setString(attributes[j], tuple, str, input);
+         } else {
+            setAttribute(attributes[j], tuple, value, static_cast<double>(value) + 0.5);
+         }
+      }
+   }
+
+   return input;
+}
+//---------------------------------------------------------------------------
+tl::expected<InputData, string> readInput(const string& path, span<const InputAttribute> attributes, uint64_t tupleSize)
+// Read the input tuples from a file with one tuple per line
+{
+   ifstream file(path);
+   if (!file)
+      return tl::unexpected("could not open " + path);
+
+   InputData input;
+   input.tupleSize = tupleSize;
+
+   string line;
+   uint64_t lineNumber = 0;
+   while (getline(file, line)) {
+      ++lineNumber;
+      if (line.empty())
+         continue;
+      auto values = split(line, ',');
+      if (values.size() != attributes.size())
+         return tl::unexpected("line " + to_string(lineNumber) + " has " + to_string(values.size()) + " attributes, expected " + to_string(attributes.size()));
+
+      input.tuples.resize(input.tuples.size() + tupleSize);
+      auto* tuple = input.tuples.data() + input.numTuples * tupleSize;
+      ++input.numTuples;
+      for (unsigned j = 0; j < attributes.size(); ++j) {
+         bool valid = true;
+         switch (attributes[j].kind) {
+            case AttributeKind::Integer: {
+               int64_t value;
+               valid = parseNumber(values[j], value);
+               setAttribute(attributes[j], tuple, value, 0);
+               break;
+            }
+            case AttributeKind::Float:
+            case AttributeKind::Double: {
+               double value;
+               valid = parseNumber(values[j], value);
+               setAttribute(attributes[j], tuple, 0, value);
+               break;
+            }
+            case AttributeKind::String:
+               setString(attributes[j], tuple, values[j], input);
+               break;
+         }
+         if (!valid)
+            return tl::unexpected("invalid value for attribute " + to_string(j) + " in line " + to_string(lineNumber));
+      }
+   }
+
+   return input;
+}
+//---------------------------------------------------------------------------
+tl::expected<ConstructorArguments, string> parseConstructorArguments(const llvm::Function& constructor, string_view argumentString)
+// Parse the arguments of the constructor according to its signature
+{
+   ConstructorArguments arguments;
+   auto values = argumentString.empty() ? vector<string_view>() : split(argumentString, ',');
+   // The first argument of the constructor is the object
+   if (values.size() != constructor.arg_size() - 1)
+      return tl::unexpected("the constructor expects " + to_string(constructor.arg_size() - 1) + " arguments, but " + to_string(values.size()) + " were given");
+
+   unsigned numIntegers = 0;
+   unsigned numFloatingPoints = 0;
+   for (unsigned i = 0; i < values.size(); ++i) {
+      auto* type = constructor.getFunctionType()->getParamType(i + 1);
+      bool valid;
+      if (type->isIntegerTy() && type->getIntegerBitWidth() <= 64) {
+         if (numIntegers == arguments.integers.size())
+            return tl::unexpected("too many integer arguments"s);
+         int64_t value;
+         valid = parseNumber(values[i], value);
+         arguments.integers[numIntegers++] = value;
+      } else if (type->isFloatTy() || type->isDoubleTy()) {
+         if (numFloatingPoints == arguments.floatingPoints.size())
+            return tl::unexpected("too many floating point arguments"s);
+         double value;
+         valid = parseNumber(values[i], value);
+         // A float is passed in the lower 32 bits of the register
+         if (type->isFloatTy())
+            value = bit_cast<double>(static_cast<uint64_t>(bit_cast<uint32_t>(static_cast<float>(value))));
+         arguments.floatingPoints[numFloatingPoints++] = value;
+      } else {
+         return tl::unexpected("unsupported type of constructor argument " + to_string(i));
+      }
+      if (!valid)
+         return tl::unexpected("invalid value for constructor argument " + to_string(i));
+   }
+
+   return arguments;
+}
+//---------------------------------------------------------------------------
+void printDuration(string_view name, uint64_t ns)
+// Print the duration of a step
+{
+   cout << setw(16) << left << name << right << fixed << setprecision(3) << static_cast<double>(ns) / 1e6 << " ms\n";
+}
+//---------------------------------------------------------------------------
+void printPhase(string_view name, uint64_t ns, uint64_t numItems, string_view unit, vector<uint64_t>& latencies)
+// Print the duration, throughput, and latency percentiles of an execution
+// phase
+{
+   cout << setw(16) << left << name << right << fixed << setprecision(3) << static_cast<double>(ns) / 1e6 << " ms";
+   if (numItems > 0 && ns > 0)
+      cout << ", " << setprecision(0) << static_cast<double>(numItems) * 1e9 / static_cast<double>(ns) << ' ' << unit << "/s";
+   if (!latencies.empty()) {
+      sort(latencies.begin(), latencies.end());
+      auto percentile = [&](double p) {
+         auto index = min<size_t>(latencies.size() - 1, static_cast<size_t>(p * static_cast<double>(latencies.size())));
+         return static_cast<double>(latencies[index]) / 1e3;
+      };
+      cout << setprecision(3) << ", latency us p50 " << percentile(0.5) << " p90 " << percentile(0.9) << " p99 " << percentile(0.99) << " max " << static_cast<double>(latencies.back()) / 1e3;
+   }
+   cout << '\n';
+}
+//---------------------------------------------------------------------------
+void printStats(const UDOStats& stats)
+// Print the statistics about compiling and linking the UDO
+{
+   static constexpr array<string_view, numUDOPhases> phaseNames = {"clang", "codegen", "optimize", "compile module", "add library", "load object", "finalize", "freeze"};
+   for (unsigned i = 0; i < numUDOPhases; ++i) {
+      auto& phase = stats.phases[i];
+      if (phase.count == 0)
+         continue;
+      cout << "  " << setw(14) << left << phaseNames[i] << right << fixed << setprecision(3) << static_cast<double>(phase.wallTimeNs) / 1e6 << " ms wall, " << static_cast<double>(phase.cpuTimeNs) / 1e6 << " ms cpu, " << phase.count << "x\n";
+   }
+   cout << "  object size " << stats.objectSize << " B, " << stats.numArchiveMembersLoaded << " library objects loaded, " << stats.numSymbolsResolved << " symbols resolved, " << stats.numHugePages << " huge pages\n";
+}
+//---------------------------------------------------------------------------
+tl::expected<string, string> readFile(const string& path)
+// Read a whole file
+{
+   ifstream file(path);
+   if (!file)
+      return tl::unexpected("could not open " + path);
+   ostringstream content;
+   content << file.rdbuf();
+   return move(content).str();
+}
+//---------------------------------------------------------------------------
+tl::expected<void, string> runBenchmark(const string& sourcePath, const string& udoClassName)
+// Compile, link, and execute a UDO
+{
+   auto source = readFile(sourcePath);
+   if (!source)
+      return tl::unexpected(move(source).error());
+
+   UDOStats stats;
+   UDOStats::Scope statsScope(&stats);
+
+   // Compile
+   auto compileStart = chrono::steady_clock::now();
+   CxxUDOAnalyzer analyzer(move(*source), udoClassName);
+   if (auto result = analyzer.analyze(nullptr, CxxUDOCompiler::getOptLevel()); !result)
+      return tl::unexpected(move(result).error());
+   auto analyzeNs = measureNs(compileStart);
+
+   // The analysis refers to the module which is changed by the compiler, so
+   // everything that is needed later is extracted first.
+   auto& analysis = analyzer.getAnalysis();
+   uint64_t tupleSize;
+   auto attributes = getInputAttributes(analysis, analyzer.getModule().getDataLayout(), tupleSize);
+   if (!attributes)
+      return tl::unexpected(move(attributes).error());
+   auto constructorArguments = parseConstructorArguments(*analysis.constructor, udoBenchArguments.get());
+   if (!constructorArguments)
+      return tl::unexpected(move(constructorArguments).error());
+   size_t objectSize = analysis.size;
+   size_t objectAlignment = max<size_t>(analysis.alignment, alignof(max_align_t));
+
+   auto preprocessStart = chrono::steady_clock::now();
+   CxxUDOCompiler compiler(analyzer);
+   if (auto result = compiler.preprocessModule(); !result)
+      return tl::unexpected(move(result).error());
+   auto objectFile = compiler.compile();
+   if (!objectFile)
+      return tl::unexpected(move(objectFile).error());
+   auto compileNs = measureNs(preprocessStart);
+   stats.objectSize = objectFile->size();
+
+   // Link
+   auto linkStart = chrono::steady_clock::now();
+   CxxUDOExecution execution(*objectFile);
+   CxxUDOAllocationFuncs allocationFuncs{&malloc, &calloc, &realloc, &posix_memalign, &free};
+   if (auto result = execution.link(allocationFuncs, getTLSBlockOffset(), tlsBlockSize); !result)
+      return tl::unexpected(move(result).error());
+   auto linkNs = measureNs(linkStart);
+
+   auto& functors = execution.getFunctors();
+   CxxUDOExecutor::setEmitFunctors(functors);
+   functors.printDebugFunctor = {&printDebugCallback, nullptr};
+   functors.getRandomFunctor = {&getRandomCallback, nullptr};
+
+   // Prepare the input, this is not measured
+   InputData input;
+   if (!udoBenchInput.get().empty()) {
+      auto result = readInput(udoBenchInput.get(), *attributes, tupleSize);
+      if (!result)
+         return tl::unexpected(move(result).error());
+      input = move(*result);
+   } else if (!attributes->empty()) {
+      input = generateInput(*attributes, tupleSize, udoBenchTuples.get());
+   }
+
+   // Initialize
+   auto initializeStart = chrono::steady_clock::now();
+   auto functions = execution.initialize();
+   auto constructorArg = CxxUDOExecution::createLibcConstructorArg();
+   if (functions.globalConstructor)
+      functions.globalConstructor(reinterpret_cast<CxxUDOFunctions::GlobalConstructorArg*>(constructorArg.get()));
+   if (functions.threadInit)
+      functions.threadInit();
+   void* object = ::operator new(objectSize, align_val_t(objectAlignment));
+   memset(object, 0, objectSize);
+   {
+      using ConstructorFunc = void(void*, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, double, double, double, double, double, double, double, double);
+      auto* constructor = reinterpret_cast<ConstructorFunc*>(functions.constructor);
+      auto& ints = constructorArguments->integers;
+      auto& fps = constructorArguments->floatingPoints;
+      constructor(object, ints[0], ints[1], ints[2], ints[3], ints[4], fps[0], fps[1], fps[2], fps[3], fps[4], fps[5], fps[6], fps[7]);
+   }
+   auto initializeNs = measureNs(initializeStart);
+
+   // Execute
+   CxxUDOExecutor executor(udoBenchThreads.get());
+   CountingSink sink(executor.getNumWorkers());
+   CxxUDOInput executorInput{input.tuples.data(), input.tupleSize, input.numTuples};
+   auto executorStats = executor.execute(execution, functions, object, executorInput, &sink, udoBenchBatchSize.get(), true);
+
+   // Destroy
+   auto destroyStart = chrono::steady_clock::now();
+   if (functions.destructor)
+      functions.destructor(object);
+   ::operator delete(object, align_val_t(objectAlignment));
+   if (functions.globalDestructor)
+      functions.globalDestructor();
+   auto destroyNs = measureNs(destroyStart);
+
+   // Report
+   cout << udoClassName << ": " << input.numTuples << " input tuples, " << executor.getNumWorkers() << " threads, " << sink.getNumTuples() << " output tuples, " << executorStats.numMorsels << " morsels (" << executorStats.numStolenMorsels << " stolen)\n";
+   printDuration("analyze", analyzeNs);
+   printDuration("compile", compileNs);
+   printDuration("link", linkNs);
+   printStats(stats);
+   printDuration("initialize", initializeNs);
+   printPhase("accept", executorStats.acceptNs, input.numTuples, "tuples", executorStats.acceptLatencies);
+   printPhase("extraWork", executorStats.extraWorkNs, executorStats.numExtraWorkStages, "stages", executorStats.extraWorkLatencies);
+   printPhase("process", executorStats.processNs, executorStats.processLatencies.size(), "calls", executorStats.processLatencies);
+   printDuration("destroy", destroyNs);
+   if (auto allocationStats = execution.getAllocationStats())
+      cout << "  allocations " << allocationStats->numAllocations << " (" << allocationStats->numFailedAllocations << " failed), " << allocationStats->numFrees << " frees, peak " << allocationStats->peakBytes << " B, " << allocationStats->liveBytes << " B still allocated\n";
+
+   return {};
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+}
+//---------------------------------------------------------------------------
+int main(int argc, char** argv)
+// Entry point
+{
+   using namespace udo;
+
+   vector<string> positional;
+   for (int i = 1; i < argc; ++i) {
+      string_view arg = argv[i];
+      if (arg.starts_with("--")) {
+         arg.remove_prefix(2);
+         auto pos = arg.find('=');
+         auto* setting = SettingBase::getSetting(arg.substr(0, pos));
+         if (!setting) {
+            cerr << "unknown setting " << arg.substr(0, pos) << '\n';
+            return 1;
+         }
+         if (!setting->setFromString(pos == string_view::npos ? "true"sv : arg.substr(pos + 1))) {
+            cerr << setting->formatErrorMessage(arg) << '\n';
+            return 1;
+         }
+      } else {
+         positional.emplace_back(arg);
+      }
+   }
+   if (positional.size() != 2) {
+      cerr << "usage: " << argv[0] << " [--<setting>=<value>]... <source file> <UDO class name>\n\nsettings:\n";
+      for (SettingBase& setting : SettingBase::getAllSettings())
+         cerr << "  " << setting.getName() << ": " << setting.getDescription() << '\n';
+      return 1;
+   }
+
+   if (auto result = runBenchmark(positional[0], positional[1]); !result) {
+      cerr << result.error() << '\n';
+      return 1;
+   }
+   return 0;
+}
+//---------------------------------------------------------------------------